@@ -1,18 +1,34 @@
 #include "BVH.h"
 #include <iterator>
 #include <algorithm>
+#include <unordered_map>
 #include "../Globals.h"
+#include "../stats.h"
 
-BVH::BVH(Scene& scene)
+static Vertex objectPosition(Object* object)
+{
+	switch (object->type) {
+	case ObjectType::SPHERE: return ((Sphere*)object)->transformations * glm::vec4(0, 0, 0, 1);
+	case ObjectType::CYLINDER: return ((Cylinder*)object)->transformations * glm::vec4(0, 0, 0, 1);
+	case ObjectType::INSTANCE: return ((Instance*)object)->transformations * glm::vec4(0, 0, 0, 1);
+	case ObjectType::TRIANGLE: {
+		Triangle* triangle = (Triangle*)object;
+		return triangle->parent_mesh->transformations * glm::vec4((triangle->vertex(0) + triangle->vertex(1) + triangle->vertex(2)) / 3.0f, 1.0f);
+	}
+	default: return Vertex(0);
+	}
+}
+
+BVH::BVH(Scene& scene, BS::thread_pool* pool) : pool(pool)
 {
 	std::vector<Object*> copyWithoutPlanes;
 
-	std::copy_if(scene.objects.begin(), scene.objects.end(), std::back_inserter(copyWithoutPlanes), [](Object* o) {return o->type != "plane"; });
-	std::copy_if(scene.objects.begin(), scene.objects.end(), std::back_inserter(this->planes), [](Object* o) {return o->type == "plane"; });
+	std::copy_if(scene.objects.begin(), scene.objects.end(), std::back_inserter(copyWithoutPlanes), [](Object* o) {return o->type != ObjectType::PLANE; });
+	std::copy_if(scene.objects.begin(), scene.objects.end(), std::back_inserter(this->planes), [](Object* o) {return o->type == ObjectType::PLANE; });
 
 	std::vector<Object*> splitMeshObjects;
 	for (auto&& obj : copyWithoutPlanes) {
-		if (obj->type != "mesh") splitMeshObjects.push_back(obj);
+		if (obj->type != ObjectType::MESH) splitMeshObjects.push_back(obj);
 		else {
 			Mesh* m = (Mesh*)(obj);
 			for (auto& triangle : m->triangles) {
@@ -23,91 +39,335 @@ BVH::BVH(Scene& scene)
 
 	copyWithoutPlanes.clear(); //free up mem
 
+	// every mesh placed by instances gets a BVH in its own space, built before the instances need its bounds
+	std::unordered_map<Mesh*, BVH*> meshBVHOf;
+	for (Object* obj : splitMeshObjects) {
+		if (obj->type != ObjectType::INSTANCE) continue;
+		Instance* instance = (Instance*)obj;
+		BVH*& meshBVH = meshBVHOf[instance->mesh];
+		if (meshBVH == nullptr) {
+			Scene meshScene;
+			meshScene.objects.push_back(instance->mesh);
+			meshBVH = new BVH(meshScene, pool);
+			meshBVHs.push_back(meshBVH);
+		}
+		instance->meshBVH = meshBVH;
+	}
+
 	totalBVHObjects = splitMeshObjects.size();
 
-	auto rootBoundingBox = BVHBoundingBox::constructFromObject(splitMeshObjects, this->axes[0]);
-	auto root = tree.insertRoot(rootBoundingBox);
-	constructBVHTree(splitMeshObjects, root, 0);
+	buildSubtree(splitMeshObjects, nullptr, true, 0);
+	copyLayouts();
+	builtSAHCost = getSAHCost();
 }
 
 /// <summary>
-/// Recursively constructs BVH tree
+/// World space bounds of every object, computed once. Both builders then partition this one array in place.
+/// Unbounded objects are left out.
 /// </summary>
-/// <param name="objects">Objects in parent</param>
-/// <param name="parent">Parent Node in tree of current iteration</param>
+void BVH::computePrimitives(const std::vector<Object*>& objects)
+{
+	primitives.resize(objects.size());
+	auto computeBounds = [this, &objects](const int a, const int b) {
+		for (int i = a; i < b; i++) {
+			Primitive& primitive = primitives[i];
+			primitive.object = objects[i];
+			primitive.position = objectPosition(primitive.object);
+			if (!BVHBoundingBox::getObjectBounds(primitive.object, primitive.bboxMin, primitive.bboxMax)) {
+				primitive.object = nullptr;
+			}
+			primitive.centroid = (primitive.bboxMin + primitive.bboxMax) * 0.5f;
+		}
+	};
+	if (pool != nullptr && (int)primitives.size() >= PARALLEL_SUBTREE_SIZE) pool->parallelize_loop((int)primitives.size(), computeBounds).wait();
+	else computeBounds(0, (int)primitives.size());
+
+	primitives.erase(std::remove_if(primitives.begin(), primitives.end(), [](const Primitive& p) { return p.object == nullptr; }), primitives.end());
+}
+
+/// <summary>
+/// Builds the binary tree over the objects as the left or right child of parent, or as the root when parent is nullptr
+/// </summary>
+/// <param name="depth">= depth of the new subtree's root</param>
+void BVH::buildSubtree(const std::vector<Object*>& objects, BVHBinaryTree::Node* parent, bool isLeft, int depth)
+{
+	computePrimitives(objects);
+
+	if (!primitives.empty()) {
+		constructNode(0, (int)primitives.size(), parent, isLeft, 0, depth, false);
+		if (pool != nullptr) pool->wait_for_tasks();
+	}
+
+	primitives.clear(); //free up mem
+	primitives.shrink_to_fit();
+}
+
+// The flat tree, and the wide tree picked by Globals::BVH_WIDTH, are copies of the binary tree
+void BVH::copyLayouts()
+{
+	flatTree.flatten(tree);
+	if (Globals::BVH_WIDTH == 4) wideTree4.collapse(tree);
+	else if (Globals::BVH_WIDTH == 8) wideTree8.collapse(tree);
+}
+
+size_t BVH::getMemoryBytes()
+{
+	size_t binaryTreeBytes = (size_t)tree.getNodeCount() * (sizeof(BVHBinaryTree::Node) + sizeof(BVHBoundingBox)) + (size_t)totalBVHObjects * sizeof(Object*);
+	size_t bytes = binaryTreeBytes + flatTree.getMemoryBytes() + wideTree4.getMemoryBytes() + wideTree8.getMemoryBytes() + planes.capacity() * sizeof(Object*);
+	for (BVH* meshBVH : meshBVHs) bytes += sizeof(BVH) + meshBVH->getMemoryBytes();
+	return bytes;
+}
+
+/// <summary>
+/// Bounds of a range of primitives and of their centroids
+/// </summary>
+/// <param name="parallel">Split the range into chunks on the pool. Only allowed from a thread outside the pool.</param>
+BVH::RangeBounds BVH::computeRangeBounds(int begin, int end, bool parallel)
+{
+	auto loop = [this](const int a, const int b) {
+		RangeBounds bounds;
+		for (int i = a; i < b; i++) {
+			bounds.bboxMin = glm::min(bounds.bboxMin, primitives[i].bboxMin);
+			bounds.bboxMax = glm::max(bounds.bboxMax, primitives[i].bboxMax);
+			bounds.centroidMin = glm::min(bounds.centroidMin, primitives[i].centroid);
+			bounds.centroidMax = glm::max(bounds.centroidMax, primitives[i].centroid);
+		}
+		return bounds;
+	};
+
+	if (!parallel) return loop(begin, end);
+
+	RangeBounds bounds;
+	for (auto& chunk : pool->parallelize_loop(begin, end, loop).get()) {
+		bounds.bboxMin = glm::min(bounds.bboxMin, chunk.bboxMin);
+		bounds.bboxMax = glm::max(bounds.bboxMax, chunk.bboxMax);
+		bounds.centroidMin = glm::min(bounds.centroidMin, chunk.centroidMin);
+		bounds.centroidMax = glm::max(bounds.centroidMax, chunk.centroidMax);
+	}
+	return bounds;
+}
+
+/// <summary>
+/// Bins the centroids of a range of primitives along all three axes at once
+/// </summary>
+/// <returns>binCount bins for x, followed by the bins for y and z</returns>
+std::vector<BVH::Bin> BVH::computeBins(int begin, int end, const RangeBounds& bounds, int binCount, bool parallel)
+{
+	Vector centroidExtent = bounds.centroidMax - bounds.centroidMin;
+	auto loop = [&](const int a, const int b) {
+		std::vector<Bin> bins(3 * binCount);
+		for (int axis = 0; axis < 3; axis++) {
+			if (centroidExtent[axis] <= 0) continue;
+			float scale = binCount / centroidExtent[axis];
+			for (int i = a; i < b; i++) {
+				int index = glm::min(binCount - 1, (int)((primitives[i].centroid[axis] - bounds.centroidMin[axis]) * scale));
+				Bin& bin = bins[axis * binCount + index];
+				bin.count++;
+				bin.bboxMin = glm::min(bin.bboxMin, primitives[i].bboxMin);
+				bin.bboxMax = glm::max(bin.bboxMax, primitives[i].bboxMax);
+			}
+		}
+		return bins;
+	};
+
+	if (!parallel) return loop(begin, end);
+
+	std::vector<Bin> bins(3 * binCount);
+	for (auto& chunk : pool->parallelize_loop(begin, end, loop).get()) {
+		for (size_t b = 0; b < bins.size(); b++) {
+			bins[b].count += chunk[b].count;
+			bins[b].bboxMin = glm::min(bins[b].bboxMin, chunk[b].bboxMin);
+			bins[b].bboxMax = glm::max(bins[b].bboxMax, chunk[b].bboxMax);
+		}
+	}
+	return bins;
+}
+
+static float surfaceArea(const Vertex& bboxMin, const Vertex& bboxMax) {
+	Vector extent = bboxMax - bboxMin;
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+BVHBinaryTree::Node* BVH::insertNode(BVHBinaryTree::Node* parent, bool isLeft, const RangeBounds& bounds, int axis, int begin, int end, bool leaf)
+{
+	// only leaves keep their objects, interior nodes are never tested against them
+	std::vector<Object*> objects;
+	if (leaf) {
+		for (int i = begin; i < end; i++) objects.push_back(primitives[i].object);
+	}
+	BVHBoundingBox* box = new BVHBoundingBox(axes[axis], objects,
+		bounds.bboxMin.x, bounds.bboxMin.y, bounds.bboxMin.z, bounds.bboxMax.x, bounds.bboxMax.y, bounds.bboxMax.z);
+
+	BVHBinaryTree::Node* node = parent == nullptr ? tree.insertRoot(box) : (isLeft ? tree.insertLeft(parent, box) : tree.insertRight(parent, box));
+	node->builtArea = surfaceArea(bounds.bboxMin, bounds.bboxMax);
+	return node;
+}
+
+void BVH::constructNode(int begin, int end, BVHBinaryTree::Node* parent, bool isLeft, int currAxis, int depth, bool onWorker)
+{
+	if (Globals::BVH_BUILD_METHOD == Globals::BVHBuildMethod::SAH) {
+		constructSAHTree(begin, end, parent, isLeft, depth, onWorker);
+	}
+	else {
+		constructBVHTree(begin, end, parent, isLeft, currAxis, depth, onWorker);
+	}
+}
+
+/// <summary>
+/// Builds both subtrees of node. A large left subtree is handed to the pool while this thread carries on with the right one.
+/// Tasks never wait on each other, the constructor waits for the pool to drain instead.
+/// </summary>
+void BVH::constructChildren(int begin, int mid, int end, BVHBinaryTree::Node* node, int nextAxis, int depth, bool onWorker)
+{
+	if (pool != nullptr && mid - begin >= PARALLEL_SUBTREE_SIZE) {
+		pool->push_task([this, begin, mid, node, nextAxis, depth] { constructNode(begin, mid, node, true, nextAxis, depth + 1, true); });
+	}
+	else {
+		constructNode(begin, mid, node, true, nextAxis, depth + 1, onWorker);
+	}
+	constructNode(mid, end, node, false, nextAxis, depth + 1, onWorker);
+}
+
+/// <summary>
+/// Recursively constructs BVH tree by splitting the primitives at the median of their centers
+/// </summary>
+/// <param name="begin">, end = range of primitives in this node</param>
+/// <param name="parent">Parent Node in tree, nullptr for the root</param>
 /// <param name="currAxis">Axis to sort on</param>
-void BVH::constructBVHTree(std::vector<Object*> objects, BVHBinaryTree::Node* parent, int currAxis)
+/// <param name="onWorker">true when running as a pool task</param>
+void BVH::constructBVHTree(int begin, int end, BVHBinaryTree::Node* parent, bool isLeft, int currAxis, int depth, bool onWorker)
 {
-	if (objects.size() <= 1) {
+	const int count = end - begin;
+	bool parallel = pool != nullptr && !onWorker && count >= PARALLEL_BINNING_SIZE;
+
+	RangeBounds bounds = computeRangeBounds(begin, end, parallel);
+	BVHBinaryTree::Node* node = insertNode(parent, isLeft, bounds, currAxis, begin, end, count <= 1);
+	if (count <= 1) {
 		return;
 	}
 
 	int nextAxisIdx = (currAxis + 1) % 3;
 
-	auto sortedObjs = sortObjectsAlongAxis(objects, axes[currAxis]);
-	std::size_t const half_size = sortedObjs.size() / 2;
-	std::vector<Object*> leftObjs(sortedObjs.begin(), sortedObjs.begin() + half_size);
-	std::vector<Object*> rightObjs(sortedObjs.begin() + half_size, sortedObjs.end());
-	
-	auto leftBoundingBox = BVHBoundingBox::constructFromObject(leftObjs, this->axes[nextAxisIdx]);
-	auto rightBoundingBox = BVHBoundingBox::constructFromObject(rightObjs, this->axes[nextAxisIdx]);
+	std::size_t const half_size = count / 2;
+	int mid = begin + (int)half_size;
+	std::nth_element(primitives.begin() + begin, primitives.begin() + mid, primitives.begin() + end,
+		[currAxis](const Primitive& a, const Primitive& b) { return a.position[currAxis] < b.position[currAxis]; });
 
-	float overlap = BVHBoundingBox::getBoundingBoxOverlapPercentage(*leftBoundingBox, *rightBoundingBox);
-	if (overlap >= 50.0f) {
-		std::cout << std::endl << "Bad BVH Node. Detected overlap of " << overlap  << "% between bounding boxes." << std::endl;
-	}
-	else {
-		std::cout << ".";
+	RangeBounds left = computeRangeBounds(begin, mid, parallel);
+	RangeBounds right = computeRangeBounds(mid, end, parallel);
+	BVHBoundingBox leftBoundingBox(left.bboxMin.x, left.bboxMin.y, left.bboxMin.z, left.bboxMax.x, left.bboxMax.y, left.bboxMax.z);
+	BVHBoundingBox rightBoundingBox(right.bboxMin.x, right.bboxMin.y, right.bboxMin.z, right.bboxMax.x, right.bboxMax.y, right.bboxMax.z);
+
+	// a bad split is only counted, as pool threads build subtrees concurrently
+	if (BVHBoundingBox::getBoundingBoxOverlapPercentage(leftBoundingBox, rightBoundingBox) >= OVERLAP_WARNING_PERCENTAGE) {
+		overlappingNodes++;
 	}
 
-	auto leftNode = tree.insertLeft(parent, leftBoundingBox);
-	auto rightNode = tree.insertRight(parent, rightBoundingBox);
-	
-	constructBVHTree(leftObjs, leftNode, nextAxisIdx);
-	constructBVHTree(rightObjs, rightNode, nextAxisIdx);
+	constructChildren(begin, mid, end, node, nextAxisIdx, depth, onWorker);
 }
 
-std::vector<Object*> BVH::sortObjectsAlongAxis(std::vector<Object*> objects, Vector axis)
+/// <summary>
+/// Recursively constructs the BVH tree using the surface area heuristic, evaluated at Globals::BVH_SAH_BINS
+/// evenly spaced centroid bins per axis. Based on:
+/// Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies", 2007
+/// </summary>
+/// <param name="begin">, end = range of primitives in this node, partitioned in place</param>
+/// <param name="parent">Parent Node in tree, nullptr for the root</param>
+/// <param name="onWorker">true when running as a pool task</param>
+void BVH::constructSAHTree(int begin, int end, BVHBinaryTree::Node* parent, bool isLeft, int depth, bool onWorker)
 {
-	auto mySort = [axis](const Object* a, const Object* b)
-	{
-		Vertex aCenter = a->transformPos;
-		Vertex bCenter = b->transformPos;
+	const int count = end - begin;
+	const int binCount = glm::clamp(Globals::BVH_SAH_BINS, 2, 64);
+	bool parallel = pool != nullptr && !onWorker && count >= PARALLEL_BINNING_SIZE;
 
-		// True if first < second
-		if (axis.x == 1.0f) {
-			return aCenter.x < bCenter.x;
-		}
-		else if (axis.y == 1.0f) {
-			return aCenter.y < bCenter.y;
-		}
-		else if (axis.z == 1.0f) {
-			return aCenter.z < bCenter.z;
-		}
-		else {
-			return false;
+	RangeBounds bounds = computeRangeBounds(begin, end, parallel);
+	Vector centroidExtent = bounds.centroidMax - bounds.centroidMin;
+
+	// find the cheapest split over all axes and bin boundaries
+	float bestCost = std::numeric_limits<float>::infinity();
+	int bestAxis = -1;
+	int bestSplit = 0;
+	float parentArea = surfaceArea(bounds.bboxMin, bounds.bboxMax);
+
+	if (count > 1) {
+		std::vector<Bin> bins = computeBins(begin, end, bounds, binCount, parallel);
+
+		for (int axis = 0; axis < 3; axis++) {
+			if (centroidExtent[axis] <= 0) continue;
+			Bin* axisBins = &bins[axis * binCount];
+
+			// sweep from the right to get the cost of everything right of each boundary
+			std::vector<float> rightCost(binCount, 0);
+			Bin right;
+			for (int b = binCount - 1; b > 0; b--) {
+				right.count += axisBins[b].count;
+				right.bboxMin = glm::min(right.bboxMin, axisBins[b].bboxMin);
+				right.bboxMax = glm::max(right.bboxMax, axisBins[b].bboxMax);
+				rightCost[b] = right.count > 0 ? right.count * surfaceArea(right.bboxMin, right.bboxMax) : 0;
+			}
+
+			Bin left;
+			for (int b = 0; b < binCount - 1; b++) {
+				left.count += axisBins[b].count;
+				left.bboxMin = glm::min(left.bboxMin, axisBins[b].bboxMin);
+				left.bboxMax = glm::max(left.bboxMax, axisBins[b].bboxMax);
+				if (left.count == 0 || left.count == count) continue;
+
+				float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * (left.count * surfaceArea(left.bboxMin, left.bboxMax) + rightCost[b + 1]) / parentArea;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
 		}
-	};
+	}
+
+	float leafCost = SAH_INTERSECTION_COST * count;
+	bool makeLeaf = count == 1 || (count <= SAH_MAX_LEAF_SIZE && bestCost >= leafCost);
+	int mid = begin;
+
+	if (!makeLeaf && (bestAxis < 0 || depth >= BVHFlatTree::MAX_DEPTH - 16)) {
+		// centroids are all the same, or the tree is getting too deep: split in the middle of the longest axis
+		bestAxis = 0;
+		if (centroidExtent.y > centroidExtent[bestAxis]) bestAxis = 1;
+		if (centroidExtent.z > centroidExtent[bestAxis]) bestAxis = 2;
+		mid = begin + count / 2;
+		std::nth_element(primitives.begin() + begin, primitives.begin() + mid, primitives.begin() + end,
+			[bestAxis](const Primitive& a, const Primitive& b) { return a.centroid[bestAxis] < b.centroid[bestAxis]; });
+	}
+	else if (!makeLeaf) {
+		float scale = binCount / centroidExtent[bestAxis];
+		auto midIt = std::partition(primitives.begin() + begin, primitives.begin() + end, [&](const Primitive& p) {
+			return glm::min(binCount - 1, (int)((p.centroid[bestAxis] - bounds.centroidMin[bestAxis]) * scale)) <= bestSplit;
+		});
+		mid = (int)(midIt - primitives.begin());
+	}
+
+	BVHBinaryTree::Node* node = insertNode(parent, isLeft, bounds, makeLeaf ? 0 : bestAxis, begin, end, makeLeaf);
+	if (makeLeaf) return;
 
-	std::sort(objects.begin(), objects.end(), mySort);
-	return objects;
+	constructChildren(begin, mid, end, node, 0, depth, onWorker);
 }
 
-std::tuple<float, Object*, Vector, Vertex> BVH::intersectBVH(const Vertex& e, const Vector& d, float minT, bool pick) {
+std::tuple<float, Object*, Vector, Vertex> BVH::intersectBVH(Ray ray, bool pick) {
 	std::tuple<float, Object*, Vector, Vertex> result;
 	std::get<0>(result) = std::numeric_limits<float>::infinity();
 
-	bool res = this->tree.BVHIntersect(e, d, minT, result, pick);
+	if (!Globals::BVH_FLAT) this->tree.BVHIntersect(ray, result, pick);
+	else if (Globals::BVH_WIDTH == 8 && !this->wideTree8.isEmpty()) this->wideTree8.intersect(ray, result, pick);
+	else if (Globals::BVH_WIDTH == 4 && !this->wideTree4.isEmpty()) this->wideTree4.intersect(ray, result, pick);
+	else this->flatTree.intersect(ray, result, pick);
 
 	// check with inifnite planes
 	if (Globals::BVH_INCLUDE_PLANES) {
+		RT_STATS(statsOps::local().primitiveTests[(int)ObjectType::PLANE] += this->planes.size());
 		for (auto planeObj : this->planes) {
 			Plane* plane = (Plane*)(planeObj);
 			planeOps::PlaneIntersectResult plane_result;
-			if (planeOps::rayIntersects(e, d, plane, plane_result, minT)) {
-				if (plane_result.t > minT && plane_result.t < std::get<0>(result)) {
-					result = { plane_result.t, planeObj, plane_result.normal, plane_result.intersection };
-				}
+			if (planeOps::rayIntersects(ray, plane, plane_result)) {
+				result = { plane_result.t, planeObj, plane_result.normal, plane_result.intersection };
+				ray.tMax = plane_result.t;
 			}
 		}
 	}
@@ -115,6 +375,228 @@ std::tuple<float, Object*, Vector, Vertex> BVH::intersectBVH(const Vertex& e, co
 	return result;
 }
 
+bool BVH::occludedBVH(const Ray& ray, bool ignorePlanes, bool pick) {
+	// planes are one dot product each, so they go before the tree
+	if (Globals::BVH_INCLUDE_PLANES && !ignorePlanes) {
+		RT_STATS(statsOps::Counters& stats = statsOps::local());
+		for (auto planeObj : this->planes) {
+			RT_STATS(statsOps::countPrimitiveTest(stats, ObjectType::PLANE));
+			if (planeOps::rayOccluded(ray, (Plane*)(planeObj))) {
+				if (pick) std::cout << "occluded by a plane" << std::endl;
+				return true;
+			}
+		}
+	}
+
+	if (!Globals::BVH_FLAT) return this->tree.BVHOccluded(ray, pick);
+	else if (Globals::BVH_WIDTH == 8 && !this->wideTree8.isEmpty()) return this->wideTree8.occluded(ray, pick);
+	else if (Globals::BVH_WIDTH == 4 && !this->wideTree4.isEmpty()) return this->wideTree4.occluded(ray, pick);
+	else return this->flatTree.occluded(ray, pick);
+}
+
+void BVH::intersectPacket(RayPacket& packet, std::tuple<float, Object*, Vector, Vertex>* results) {
+	int dirIsNeg[3];
+	if (!Globals::BVH_FLAT || packet.size < PACKET_MIN_RAYS || !packet.sameSigns(dirIsNeg)) {
+		for (int lane = 0; lane < packet.size; lane++) {
+			results[lane] = intersectBVH(packet.ray(lane));
+			if (std::get<1>(results[lane]) != NULL) packet.tMax[lane] = std::get<0>(results[lane]);
+		}
+		return;
+	}
+
+	for (int lane = 0; lane < packet.size; lane++) {
+		std::get<0>(results[lane]) = std::numeric_limits<float>::infinity();
+		std::get<1>(results[lane]) = NULL;
+	}
+	this->flatTree.intersectPacket(packet, results);
+
+	if (Globals::BVH_INCLUDE_PLANES) {
+		RT_STATS(statsOps::local().primitiveTests[(int)ObjectType::PLANE] += this->planes.size() * packet.size);
+		for (int lane = 0; lane < packet.size; lane++) {
+			Ray ray = packet.ray(lane);
+			for (auto planeObj : this->planes) {
+				planeOps::PlaneIntersectResult plane_result;
+				if (planeOps::rayIntersects(ray, (Plane*)(planeObj), plane_result)) {
+					results[lane] = { plane_result.t, planeObj, plane_result.normal, plane_result.intersection };
+					ray.tMax = plane_result.t;
+				}
+			}
+			packet.tMax[lane] = ray.tMax;
+		}
+	}
+}
+
+uint32_t BVH::occludedPacket(const RayPacket& packet, bool ignorePlanes) {
+	int dirIsNeg[3];
+	if (!Globals::BVH_FLAT || packet.size < PACKET_MIN_RAYS || !packet.sameSigns(dirIsNeg)) {
+		uint32_t occluded = 0;
+		for (int lane = 0; lane < packet.size; lane++) {
+			if (occludedBVH(packet.ray(lane), ignorePlanes)) occluded |= 1u << lane;
+		}
+		return occluded;
+	}
+
+	uint32_t occluded = 0;
+	if (Globals::BVH_INCLUDE_PLANES && !ignorePlanes) {
+		RT_STATS(statsOps::Counters& stats = statsOps::local());
+		for (int lane = 0; lane < packet.size; lane++) {
+			Ray ray = packet.ray(lane);
+			for (auto planeObj : this->planes) {
+				RT_STATS(statsOps::countPrimitiveTest(stats, ObjectType::PLANE));
+				if (planeOps::rayOccluded(ray, (Plane*)(planeObj))) {
+					occluded |= 1u << lane;
+					break;
+				}
+			}
+		}
+	}
+	return this->flatTree.occludedPacket(packet, occluded);
+}
+
+/// <summary>
+/// Sets the box of node to the union of its objects' bounds, or of its children's refit boxes
+/// </summary>
+/// <returns>false if nothing under node is bounded any more</returns>
+bool BVH::refitNode(BVHBinaryTree::Node* node, Vertex& bboxMin, Vertex& bboxMax)
+{
+	bboxMin = Vertex(std::numeric_limits<float>::infinity());
+	bboxMax = Vertex(-std::numeric_limits<float>::infinity());
+	bool bounded = false;
+
+	if (node->left == nullptr && node->right == nullptr) {
+		for (Object* object : node->data->get_objects()) {
+			Vertex objectMin, objectMax;
+			if (!BVHBoundingBox::getObjectBounds(object, objectMin, objectMax)) continue;
+			bboxMin = glm::min(bboxMin, objectMin);
+			bboxMax = glm::max(bboxMax, objectMax);
+			bounded = true;
+		}
+	}
+	else {
+		for (BVHBinaryTree::Node* child : { node->left, node->right }) {
+			Vertex childMin, childMax;
+			if (child == nullptr || !refitNode(child, childMin, childMax)) continue;
+			bboxMin = glm::min(bboxMin, childMin);
+			bboxMax = glm::max(bboxMax, childMax);
+			bounded = true;
+		}
+	}
+
+	if (bounded) node->data->set_bounds(bboxMin, bboxMax);
+	return bounded;
+}
+
+void BVH::refit()
+{
+	Vertex bboxMin, bboxMax;
+	if (tree.getRoot() != nullptr) refitNode(tree.getRoot(), bboxMin, bboxMax);
+	copyLayouts();
+}
+
+void BVH::collectObjects(BVHBinaryTree::Node* node, std::vector<Object*>& objects)
+{
+	if (node == nullptr) return;
+	const std::vector<Object*>& leafObjects = node->data->get_objects();
+	objects.insert(objects.end(), leafObjects.begin(), leafObjects.end());
+	collectObjects(node->left, objects);
+	collectObjects(node->right, objects);
+}
+
+// Surface area of a node's box as it is now
+static float nodeArea(const BVHBinaryTree::Node* node) {
+	const BVHBoundingBox* box = node->data;
+	return surfaceArea(Vertex(box->get_x_min(), box->get_y_min(), box->get_z_min()), Vertex(box->get_x_max(), box->get_y_max(), box->get_z_max()));
+}
+
+/// <summary>
+/// What the boxes of node and every node below it grew by since they were built, in the SAH cost of getSAHCost
+/// </summary>
+float BVH::grownCost(const BVHBinaryTree::Node* node, float rootArea) const
+{
+	if (node == nullptr) return 0;
+	bool leaf = node->left == nullptr && node->right == nullptr;
+	float weight = leaf ? SAH_INTERSECTION_COST * node->data->get_objects().size() : SAH_TRAVERSAL_COST;
+	float growth = glm::max(0.0f, nodeArea(node) - node->builtArea) / rootArea * weight;
+	return growth + grownCost(node->left, rootArea) + grownCost(node->right, rootArea);
+}
+
+/// <summary>
+/// Collects the topmost subtrees below node whose box grew more than PARTIAL_REBUILD_AREA_GROWTH times since it was built
+/// </summary>
+/// <returns>the SAH cost a rebuild of them wins back at most: what the nodes under their roots grew by, as their
+/// roots keep the box of their objects</returns>
+float BVH::findGrownSubtrees(BVHBinaryTree::Node* node, int depth, float rootArea, std::vector<GrownSubtree>& grown) const
+{
+	float savings = 0;
+	for (bool isLeft : { true, false }) {
+		BVHBinaryTree::Node* child = isLeft ? node->left : node->right;
+		if (child == nullptr || (child->left == nullptr && child->right == nullptr)) continue;
+		if (nodeArea(child) > PARTIAL_REBUILD_AREA_GROWTH * child->builtArea) {
+			grown.push_back({ node, isLeft, depth + 1 });
+			savings += grownCost(child->left, rootArea) + grownCost(child->right, rootArea);
+		}
+		else {
+			savings += findGrownSubtrees(child, depth + 1, rootArea, grown);
+		}
+	}
+	return savings;
+}
+
+void BVH::rebuild()
+{
+	std::vector<Object*> objects;
+	collectObjects(tree.getRoot(), objects);
+	tree.removeSubtree(nullptr, true);
+	overlappingNodes = 0;
+	buildSubtree(objects, nullptr, true, 0);
+	copyLayouts();
+	builtSAHCost = getSAHCost();
+}
+
+BVH::UpdateStats BVH::update()
+{
+	UpdateStats stats;
+	refit();
+	stats.refitCost = stats.cost = getSAHCost();
+	float maxCost = Globals::BVH_REBUILD_COST_RATIO * builtSAHCost;
+	if (stats.cost <= maxCost) return stats;
+	int overlappingBefore = overlappingNodes;
+
+	// the grown subtrees are only built again if that can bring the cost back down, e.g. not when an object moved
+	// across the scene and stretched every box on its way up to the root
+	BVHBinaryTree::Node* root = tree.getRoot();
+	std::vector<GrownSubtree> grown;
+	float savings = findGrownSubtrees(root, 0, nodeArea(root), grown);
+	if (!grown.empty() && stats.cost - savings <= maxCost) {
+		for (const GrownSubtree& subtree : grown) {
+			BVHBinaryTree::Node* node = subtree.isLeft ? subtree.parent->left : subtree.parent->right;
+			std::vector<Object*> objects;
+			collectObjects(node, objects);
+			tree.removeSubtree(subtree.parent, subtree.isLeft);
+			buildSubtree(objects, subtree.parent, subtree.isLeft, subtree.depth);
+		}
+		copyLayouts();
+		stats.rebuiltSubtrees = (int)grown.size();
+		stats.cost = getSAHCost();
+		stats.overlappingNodes = overlappingNodes - overlappingBefore;
+	}
+	if (stats.cost > maxCost) {
+		rebuild();
+		stats.cost = builtSAHCost;
+		stats.fullRebuild = true;
+		stats.overlappingNodes = overlappingNodes;
+	}
+	return stats;
+}
+
+int BVH::getOverlappingNodeCount() const
+{
+	int count = overlappingNodes;
+	for (const BVH* meshBVH : meshBVHs) count += meshBVH->getOverlappingNodeCount();
+	return count;
+}
+
 BVH::~BVH()
 {
+	for (BVH* meshBVH : meshBVHs) delete meshBVH;
 }
\ No newline at end of file
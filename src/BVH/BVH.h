@@ -1,21 +1,166 @@
 #pragma once
 
+#include <atomic>
 #include "../schema.h"
 #include "BVHBoundingBox.h"
 #include "BVHBinaryTree.h"
+#include "BVHFlatTree.h"
+#include "BVHWideTree.h"
+#include "BS_thread_pool.hpp"
 
 class BVH {
 public:
 	BVHBinaryTree tree = BVHBinaryTree();
+	BVHFlatTree flatTree;
+	// only the layout picked by Globals::BVH_WIDTH is built, the others stay empty
+	BVHWideTree<4> wideTree4;
+	BVHWideTree<8> wideTree8;
 	BVH() {};
-	BVH (Scene& scene);
-	std::tuple<float, Object*, Vector, Vertex> intersectBVH(const Vertex& e, const Vector& d, float minT, bool pick = false);
+
+	/// <summary>
+	/// Builds the BVH over every bounded object in the scene, splitting meshes into their triangles. Instances are
+	/// primitives of this top level BVH, each pointed at a bottom level BVH built once per mesh they place.
+	/// </summary>
+	/// <param name="pool">= when given, subtrees and the binning of large top level nodes are built in parallel</param>
+	BVH (Scene& scene, BS::thread_pool* pool = nullptr);
+	// What update did to keep the BVH fit for objects that moved
+	struct UpdateStats {
+		float refitCost = 0;  // SAH cost right after the refit
+		float cost = 0;       // SAH cost after any rebuild
+		int rebuiltSubtrees = 0;
+		bool fullRebuild = false;
+		int overlappingNodes = 0;  // bad splits made by the median builder while rebuilding
+	};
+
+	/// <summary>
+	/// Recomputes the bounds of every node bottom up from the current bounds of its objects, after their
+	/// transformations changed, without moving any object to another node. The flat and wide layouts are copied from
+	/// the refit tree again. The bottom level BVHs of instanced meshes are left alone, as moving an instance does not
+	/// change its mesh.
+	/// </summary>
+	void refit();
+	/// <summary>
+	/// Refits the BVH, then checks its quality. Once the SAH cost is over Globals::BVH_REBUILD_COST_RATIO times the cost
+	/// after the last full build, the topmost subtrees whose box grew more than PARTIAL_REBUILD_AREA_GROWTH times since
+	/// they were built are built again from their objects, as long as that can bring the cost back under the ratio.
+	/// Otherwise, or if the cost is still too high after the partial rebuild, the whole BVH is built again.
+	/// </summary>
+	UpdateStats update();
+	/// <summary>
+	/// Closest hit inside (ray.tMin, ray.tMax) among the BVH and the infinite planes. t is infinity on a miss.
+	/// </summary>
+	std::tuple<float, Object*, Vector, Vertex> intersectBVH(Ray ray, bool pick = false);
+	/// <summary>
+	/// Any hit query for shadow rays: whether anything is hit inside (ray.tMin, ray.tMax). Never computes normals or intersection points.
+	/// </summary>
+	/// <param name="ignorePlanes">= infinite planes do not occlude, used for directional lights</param>
+	bool occludedBVH(const Ray& ray, bool ignorePlanes = false, bool pick = false);
+	/// <summary>
+	/// Closest hits of a packet of rays, planes included. Coherent packets, whose rays share their direction signs,
+	/// walk the flat tree together; any other packet, or a packet under PACKET_MIN_RAYS rays, falls back to intersectBVH
+	/// one ray at a time.
+	/// </summary>
+	/// <param name="results">= one per lane, t is infinity on a miss</param>
+	void intersectPacket(RayPacket& packet, std::tuple<float, Object*, Vector, Vertex>* results);
+	/// <summary>
+	/// Any hit query for a packet of shadow rays, falling back to occludedBVH like intersectPacket does
+	/// </summary>
+	/// <returns>bit mask of the occluded lanes</returns>
+	uint32_t occludedPacket(const RayPacket& packet, bool ignorePlanes = false);
+	/// <summary>
+	/// Bounds of everything in the BVH but the infinite planes
+	/// </summary>
+	/// <returns>false if the BVH is empty</returns>
+	bool getBounds(Vertex& bboxMin, Vertex& bboxMax) const { return flatTree.getBounds(bboxMin, bboxMax); }
+	float getSAHCost() const { return flatTree.computeSAHCost(SAH_TRAVERSAL_COST, SAH_INTERSECTION_COST); }
+	// the median builder counts nodes whose children overlap this much of their volume as bad splits
+	static constexpr float OVERLAP_WARNING_PERCENTAGE = 50.0f;
+	/// <summary>
+	/// Bad splits, see OVERLAP_WARNING_PERCENTAGE, made by the median builder in this BVH since its last full build and
+	/// in its bottom level BVHs
+	/// </summary>
+	int getOverlappingNodeCount() const;
+	// the SAH cost right after the last full build, which update compares against
+	float getBuiltSAHCost() const { return builtSAHCost; }
+	/// <summary>
+	/// Bytes held by every layout that was built, the binary tree's leaf object lists estimated from the primitive count,
+	/// and by the bottom level BVHs
+	/// </summary>
+	size_t getMemoryBytes();
 	~BVH ();
 private:
+	// A bounded object with its world space bounds, shared in place by both builders
+	struct Primitive {
+		Object* object;
+		Vertex bboxMin;
+		Vertex bboxMax;
+		Vertex centroid;
+		// what the median builder sorts by: the centre of a sphere or cylinder, the mean of a triangle's vertices
+		Vertex position;
+	};
+
+	struct RangeBounds {
+		Vertex bboxMin = Vertex(std::numeric_limits<float>::infinity());
+		Vertex bboxMax = Vertex(-std::numeric_limits<float>::infinity());
+		Vertex centroidMin = Vertex(std::numeric_limits<float>::infinity());
+		Vertex centroidMax = Vertex(-std::numeric_limits<float>::infinity());
+	};
+
+	struct Bin {
+		Vertex bboxMin = Vertex(std::numeric_limits<float>::infinity());
+		Vertex bboxMax = Vertex(-std::numeric_limits<float>::infinity());
+		int count = 0;
+	};
+
+	// a packet shares node visits between its rays, which a single ray cannot
+	static const int PACKET_MIN_RAYS = 2;
+
+	// relative costs of one node visit and one primitive test in the SAH cost model
+	static constexpr float SAH_TRAVERSAL_COST = 1.0f;
+	static constexpr float SAH_INTERSECTION_COST = 1.0f;
+	static const int SAH_MAX_LEAF_SIZE = 8;
+
+	// a subtree whose box grew this many times in surface area by refits is built again once the BVH is due a rebuild
+	static constexpr float PARTIAL_REBUILD_AREA_GROWTH = 1.5f;
+
+	// subtrees with at least this many primitives are handed to another thread
+	static const int PARALLEL_SUBTREE_SIZE = 1024;
+	// nodes with at least this many primitives compute their bounds and bins in parallel chunks
+	static const int PARALLEL_BINNING_SIZE = 64 * 1024;
+
 	Vertex axes[3] = { Vector(1.0f, 0, 0), Vector(0, 1.0f, 0), Vector(0, 0, 1.0f) };
 	std::vector<Object*> planes;
+	// bottom level BVHs over the meshes placed by instances, one per mesh
+	std::vector<BVH*> meshBVHs;
+	std::vector<Primitive> primitives;
+	BS::thread_pool* pool = nullptr;
 	int totalBVHObjects = 0;
+	float builtSAHCost = 0;
+	std::atomic<int> overlappingNodes{ 0 };
+
+	void computePrimitives(const std::vector<Object*>& objects);
+	void buildSubtree(const std::vector<Object*>& objects, BVHBinaryTree::Node* parent, bool isLeft, int depth);
+	void copyLayouts();
+	// The left or right child of parent, to be built again at depth
+	struct GrownSubtree {
+		BVHBinaryTree::Node* parent;
+		bool isLeft;
+		int depth;
+	};
+
+	bool refitNode(BVHBinaryTree::Node* node, Vertex& bboxMin, Vertex& bboxMax);
+	void collectObjects(BVHBinaryTree::Node* node, std::vector<Object*>& objects);
+	float grownCost(const BVHBinaryTree::Node* node, float rootArea) const;
+	float findGrownSubtrees(BVHBinaryTree::Node* node, int depth, float rootArea, std::vector<GrownSubtree>& grown) const;
+	void rebuild();
+
+	BVHBinaryTree::Node* insertNode(BVHBinaryTree::Node* parent, bool isLeft, const RangeBounds& bounds, int axis, int begin, int end, bool leaf);
+	void constructChildren(int begin, int mid, int end, BVHBinaryTree::Node* node, int nextAxis, int depth, bool onWorker);
+	void constructNode(int begin, int end, BVHBinaryTree::Node* parent, bool isLeft, int currAxis, int depth, bool onWorker);
+
+	void constructBVHTree(int begin, int end, BVHBinaryTree::Node* parent, bool isLeft, int currAxis, int depth, bool onWorker);
+	void constructSAHTree(int begin, int end, BVHBinaryTree::Node* parent, bool isLeft, int depth, bool onWorker);
 
-	void constructBVHTree(std::vector<Object*> objects, BVHBinaryTree::Node* parent, int currAxis);
-	std::vector<Object*> sortObjectsAlongAxis(std::vector<Object*> objects, Vector axis);
-};
\ No newline at end of file
+	RangeBounds computeRangeBounds(int begin, int end, bool parallel);
+	std::vector<Bin> computeBins(int begin, int end, const RangeBounds& bounds, int binCount, bool parallel);
+};
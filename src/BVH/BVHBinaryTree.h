@@ -1,11 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <stack>
 #include <stdexcept>
 #include <tuple>
 
 #include "../geometryIntersect.h"
+#include "../stats.h"
 
 class BVHBinaryTree {
 public:
@@ -13,11 +15,14 @@ public:
 		BVHBoundingBox* data;
 		Node* left;
 		Node* right;
+		// surface area of the box when the node was built, which a refit box is compared against
+		float builtArea;
 
 		Node(BVHBoundingBox* data) {
 			this->data = data;
 			this->left = nullptr;
 			this->right = nullptr;
+			this->builtArea = 0;
 		}
 	};
 
@@ -57,48 +62,70 @@ public:
 		return child;
 	}
 
-	bool BVHIntersect(const Vertex& e, const Vector& d, float minT, std::tuple<float, Object*, Vector, Vertex>& result, bool pick) {
+	bool BVHIntersect(Ray& ray, std::tuple<float, Object*, Vector, Vertex>& result, bool pick) {
 		int hitsTests = 0;
 		int totalIntersectionTests = 0;
-		bool intersectResult = _BVHIntersect(this->root, e, d, minT, result, hitsTests, totalIntersectionTests ,pick);
-		if (pick) std::cout << "BVH boxes: "<< nodeCount <<", boxes hit: " << hitsTests << ", Total intersections: " << totalIntersectionTests << ", result: " << (intersectResult ? std::get<1>(result)->type : "miss") << std::endl;
+		bool intersectResult = _BVHIntersect(this->root, ray, result, hitsTests, totalIntersectionTests ,pick);
+		RT_STATS(statsOps::Counters& stats = statsOps::local(); stats.nodeVisits += hitsTests; stats.boxTests += hitsTests);
+		if (pick) std::cout << "BVH boxes: "<< nodeCount <<", boxes hit: " << hitsTests << ", Total intersections: " << totalIntersectionTests << ", result: " << (intersectResult ? toString(std::get<1>(result)->type) : "miss") << std::endl;
 		return intersectResult;
 	}
 
+	/// <summary>
+	/// Any hit query, returns as soon as a primitive is hit inside (ray.tMin, ray.tMax)
+	/// </summary>
+	bool BVHOccluded(const Ray& ray, bool pick) {
+		int hitsTests = 0;
+		bool occluded = _BVHOccluded(this->root, ray, hitsTests);
+		RT_STATS(statsOps::Counters& stats = statsOps::local(); stats.nodeVisits += hitsTests; stats.boxTests += hitsTests);
+		if (pick) std::cout << "BVH boxes: " << nodeCount << ", boxes hit: " << hitsTests << ", result: " << (occluded ? "occluded" : "clear") << std::endl;
+		return occluded;
+	}
+
+	/// <summary>
+	/// Deletes the left or right subtree of parent, or the whole tree when parent is nullptr, so it can be built again
+	/// </summary>
+	void removeSubtree(Node* parent, bool isLeft) {
+		Node*& subtree = parent == nullptr ? this->root : (isLeft ? parent->left : parent->right);
+		nodeCount -= deleteTree(subtree);
+		subtree = nullptr;
+	}
+
 	int getNodeCount() {
 		return nodeCount;
 	};
 
+	Node* getRoot() {
+		return this->root;
+	}
+
 	~BVHBinaryTree() {
 		deleteTree(this->root);
 	}
 private:
 	Node* root;
-	int nodeCount = 0;
+	// subtrees may be inserted from several threads at once
+	std::atomic<int> nodeCount = 0;
 
-	bool _BVHIntersect(Node* node, const Vertex& e, const Vector& d, float minT, std::tuple<float, Object*, Vector, Vertex>& result, int& hitTests, int& totalIntersectionTests, bool pick) {
+	bool _BVHIntersect(Node* node, Ray& ray, std::tuple<float, Object*, Vector, Vertex>& result, int& hitTests, int& totalIntersectionTests, bool pick) {
 		AABBOps::AABBIntersectResult temp_result;
-		bool hit = AABBOps::rayIntersects(e, d, node->data, temp_result, minT);
+		bool hit = AABBOps::rayIntersects(ray, node->data, temp_result);
 		hitTests++;
 		totalIntersectionTests++;
 
 		if (hit) {
-
-			if (temp_result.t > std::get<0>(result)) {
-				return false;
-			}
-
 			bool hitLeft = false;
 			bool hitRight = false;
 			if (node->left != nullptr) {
-				hitLeft = _BVHIntersect(node->left, e, d, minT, result, hitTests, totalIntersectionTests, pick);
+				hitLeft = _BVHIntersect(node->left, ray, result, hitTests, totalIntersectionTests, pick);
 			}
 			if (node->right != nullptr) {
-				hitRight = _BVHIntersect(node->right, e, d, minT, result, hitTests, totalIntersectionTests, pick);
+				hitRight = _BVHIntersect(node->right, ray, result, hitTests, totalIntersectionTests, pick);
 			}
 			
 			if (node->left == nullptr && node->right == nullptr) {
-				auto hitResult = rayIntersectObjects(e, d, node->data->get_objects(), minT);
+				RT_STATS(statsOps::countLeaf(statsOps::local(), (int)node->data->get_objects().size()));
+				auto hitResult = rayIntersectObjects(ray, node->data->get_objects());
 				totalIntersectionTests += node->data->get_objects().size();
 				
 				Object* object = std::get<1>(hitResult);
@@ -109,6 +136,7 @@ private:
 				else if (std::get<0>(hitResult) < std::get<0>(result)) 
 				{
 					result = hitResult;
+					ray.tMax = std::get<0>(hitResult);
 					return true;
 				}
 
@@ -120,14 +148,29 @@ private:
 		return false;
 	}
 
-	void deleteTree(Node* node)
+	bool _BVHOccluded(Node* node, const Ray& ray, int& hitTests) {
+		AABBOps::AABBIntersectResult temp_result;
+		hitTests++;
+		if (!AABBOps::rayIntersects(ray, node->data, temp_result)) return false;
+
+		if (node->left == nullptr && node->right == nullptr) {
+			RT_STATS(statsOps::countLeaf(statsOps::local(), (int)node->data->get_objects().size()));
+			return rayOccluded(ray, node->data->get_objects());
+		}
+		return (node->left != nullptr && _BVHOccluded(node->left, ray, hitTests))
+			|| (node->right != nullptr && _BVHOccluded(node->right, ray, hitTests));
+	}
+
+	// returns the number of nodes deleted
+	int deleteTree(Node* node)
 	{
-		if (node == nullptr) return;
+		if (node == nullptr) return 0;
 
 		/* first delete both subtrees */
-		deleteTree(node->left);
-		deleteTree(node->right);
+		int deleted = deleteTree(node->left) + deleteTree(node->right);
 
+		delete node->data;
 		delete node;
+		return deleted + 1;
 	}
 };
\ No newline at end of file
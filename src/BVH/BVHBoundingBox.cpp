@@ -1,133 +1,89 @@
 #include "BVHBoundingBox.h"
+#include "BVH.h"
 
 // ifinite objects, like planes are not bounded!!!
-BVHBoundingBox* BVHBoundingBox::constructFromObject(std::vector<Object*> objects, Vector BVHSortingAxis)
+bool BVHBoundingBox::getObjectBounds(Object* obj, Vertex& minValues, Vertex& maxValues)
 {
-	constexpr float infinity = std::numeric_limits<float>::infinity();
-	float minX = infinity, minY = infinity, minZ = infinity;
-	float maxX = -infinity, maxY = -infinity, maxZ = -infinity;
-	bool exists = false;
-	glm::mat4 transformations;
-
-	for (auto&& obj : objects) {
-		if (obj->type == "sphere") {
-			exists = true;
-			Sphere* sphere = (Sphere*)(obj);
-			std::vector<Vertex> vertices;
-			transformations = sphere->transformations;
-
-			vertices.push_back(transformations * glm::vec4((Vertex(sphere->radius, sphere->radius, sphere->radius)), 1.0f));
-			vertices.push_back(transformations * glm::vec4((Vertex(-sphere->radius, -sphere->radius, -sphere->radius)), 1.0f));
+	std::vector<Vertex> vertices;
 
-			Vertex minValues = vertices[0];
-			Vertex maxValues = vertices[0];
-			for (auto& vertex : vertices) {
-				minValues.x = glm::min(minValues.x, vertex.x);
-				minValues.y = glm::min(minValues.y, vertex.y);
-				minValues.z = glm::min(minValues.z, vertex.z);
+	if (obj->type == ObjectType::SPHERE) {
+		Sphere* sphere = (Sphere*)(obj);
+		glm::mat4& transformations = sphere->transformations;
 
-				maxValues.x = glm::max(maxValues.x, vertex.x);
-				maxValues.y = glm::max(maxValues.y, vertex.y);
-				maxValues.z = glm::max(maxValues.z, vertex.z);
-			}
-
-			minX = glm::min(minX, minValues.x); minY = glm::min(minY, minValues.y); minZ = glm::min(minZ, minValues.z);
-			maxX = glm::max(maxX, maxValues.x); maxY = glm::max(maxY, maxValues.y); maxZ = glm::max(maxZ, maxValues.z);
+		// all 8 corners of the model space box, so rotations are covered
+		for (int i = 0; i < 8; i++) {
+			Vertex corner = Vertex((i & 1) ? sphere->radius : -sphere->radius, (i & 2) ? sphere->radius : -sphere->radius, (i & 4) ? sphere->radius : -sphere->radius);
+			vertices.push_back(transformations * glm::vec4(corner, 1.0f));
+		}
+	}
+	else if (obj->type == ObjectType::CYLINDER) {
+		Cylinder* cylinder = (Cylinder*)(obj);
+		float halfHeight = cylinder->height / 2.0f;
+		glm::mat4& transformations = cylinder->transformations;
+
+		// Tight Bounding volume for a transformed cylinder:
+		// https://www.iquilezles.org/articles/diskbbox/
+
+		Vertex pa = transformations * glm::vec4(0, halfHeight, 0,1);
+		Vertex pb = transformations * glm::vec4(0, -halfHeight, 0,1);
+
+		Vector a = pb - pa;
+		Vector e = cylinder->radius * sqrt(1.0f - a * a / glm::dot(a, a));
+		vertices.push_back(pa - e);
+		vertices.push_back(pb - e);
+		vertices.push_back(pa + e);
+		vertices.push_back(pb + e);
+	}
+	else if (obj->type == ObjectType::TRIANGLE) {
+		Triangle* triangle = (Triangle*)(obj);
+		glm::mat4& transformations = triangle->parent_mesh->transformations;
 
+		for (int corner = 0; corner < 3; corner++) {
+			vertices.push_back(transformations * glm::vec4(triangle->vertex(corner), 1.0f));
 		}
-		else if (obj->type == "cylinder") {
-			exists = true;
-			Cylinder* cylinder = (Cylinder*)(obj);
-			std::vector<Vertex> vertices;
-			float halfHeight = cylinder->height / 2.0f;
-			transformations = cylinder->transformations;
-
-			// Tight Bounding volume for a transformed cylinder:
-			// https://www.iquilezles.org/articles/diskbbox/
-
-			Vertex pa = transformations * glm::vec4(0, halfHeight, 0,1);
-			Vertex pb = transformations * glm::vec4(0, -halfHeight, 0,1);
-
-			Vector a = pb - pa;
-			Vector e = cylinder->radius * sqrt(1.0f - a * a / glm::dot(a, a));
-			vertices.push_back(glm::vec4(pa - e,1));
-			vertices.push_back(glm::vec4(pb - e,1));
-			vertices.push_back(glm::vec4(pa + e,1));
-			vertices.push_back(glm::vec4(pb + e,1));
-			
-
-			Vertex minValues = vertices[0];
-			Vertex maxValues = vertices[0];
-			for (auto& vertex : vertices) {
-				minValues.x = glm::min(minValues.x, vertex.x);
-				minValues.y = glm::min(minValues.y, vertex.y);
-				minValues.z = glm::min(minValues.z, vertex.z);
-
-				maxValues.x = glm::max(maxValues.x, vertex.x);
-				maxValues.y = glm::max(maxValues.y, vertex.y);
-				maxValues.z = glm::max(maxValues.z, vertex.z);
-			}
-
-			minX = glm::min(minX, minValues.x); minY = glm::min(minY, minValues.y); minZ = glm::min(minZ, minValues.z);
-			maxX = glm::max(maxX, maxValues.x); maxY = glm::max(maxY, maxValues.y); maxZ = glm::max(maxZ, maxValues.z);
+	}
+	else if (obj->type == ObjectType::INSTANCE) {
+		Instance* instance = (Instance*)(obj);
+		Vertex meshMin, meshMax;
+		if (instance->meshBVH == nullptr || !instance->meshBVH->getBounds(meshMin, meshMax)) return false;
+
+		// all 8 corners of the mesh's box, like spheres
+		for (int i = 0; i < 8; i++) {
+			Vertex corner = Vertex((i & 1) ? meshMax.x : meshMin.x, (i & 2) ? meshMax.y : meshMin.y, (i & 4) ? meshMax.z : meshMin.z);
+			vertices.push_back(instance->transformations * glm::vec4(corner, 1.0f));
 		}
-		else if (obj->type == "triangle") {
-			exists = true;
-			Triangle* triangle = (Triangle*)(obj);
-			transformations = triangle->parent_mesh->transformations;
-
-			Vertex minValues = triangle->vertices[0];
-			Vertex maxValues = triangle->vertices[0];
-
-			std::vector<Vertex> transformedVert;
-			for (auto& vertex : triangle->vertices) {
-				transformedVert.push_back(transformations * glm::vec4(vertex, 1.0f));
-			}
+	}
+	else {
+		return false;
+	}
 
-			for (auto& vertex : transformedVert) {
-				minValues.x = glm::min(minValues.x, vertex.x);
-				minValues.y = glm::min(minValues.y, vertex.y);
-				minValues.z = glm::min(minValues.z, vertex.z);
+	minValues = vertices[0];
+	maxValues = vertices[0];
+	for (auto& vertex : vertices) {
+		minValues = glm::min(minValues, vertex);
+		maxValues = glm::max(maxValues, vertex);
+	}
+	return true;
+}
 
-				maxValues.x = glm::max(maxValues.x, vertex.x);
-				maxValues.y = glm::max(maxValues.y, vertex.y);
-				maxValues.z = glm::max(maxValues.z, vertex.z);
-			}
+BVHBoundingBox* BVHBoundingBox::constructFromObject(std::vector<Object*> objects, Vector BVHSortingAxis)
+{
+	constexpr float infinity = std::numeric_limits<float>::infinity();
+	Vertex minBounds = Vertex(infinity);
+	Vertex maxBounds = Vertex(-infinity);
+	bool exists = false;
 
-			minX = glm::min(minX, minValues.x); minY = glm::min(minY, minValues.y); minZ = glm::min(minZ, minValues.z);
-			maxX = glm::max(maxX, maxValues.x); maxY = glm::max(maxY, maxValues.y); maxZ = glm::max(maxZ, maxValues.z);
-		}
-		/*else if (obj->type == "mesh") {
+	for (auto&& obj : objects) {
+		Vertex minValues, maxValues;
+		if (getObjectBounds(obj, minValues, maxValues)) {
 			exists = true;
-			Mesh* mesh = (Mesh*)(obj);
-			std::vector<Vertex> vertices;
-			transformations = mesh->transformations;
-
-			for (auto&& triangle : mesh->triangles) {
-				vertices.push_back(transformations * glm::vec4(triangle.vertices[0], 1));
-				vertices.push_back(transformations * glm::vec4(triangle.vertices[1], 1));
-				vertices.push_back(transformations * glm::vec4(triangle.vertices[2], 1));
-			}
-
-			Vertex minValues = vertices[0];
-			Vertex maxValues = vertices[0];
-			for (auto& vertex : vertices) {
-				minValues.x = glm::min(minValues.x, vertex.x);
-				minValues.y = glm::min(minValues.y, vertex.y);
-				minValues.z = glm::min(minValues.z, vertex.z);
-
-				maxValues.x = glm::max(maxValues.x, vertex.x);
-				maxValues.y = glm::max(maxValues.y, vertex.y);
-				maxValues.z = glm::max(maxValues.z, vertex.z);
-			}
-
-			minX = glm::min(minX, minValues.x); minY = glm::min(minY, minValues.y); minZ = glm::min(minZ, minValues.z);
-			maxX = glm::max(maxX, maxValues.x); maxY = glm::max(maxY, maxValues.y); maxZ = glm::max(maxZ, maxValues.z);
-		}*/
+			minBounds = glm::min(minBounds, minValues);
+			maxBounds = glm::max(maxBounds, maxValues);
+		}
 	}
 
 	if (exists) {
-		return new BVHBoundingBox(BVHSortingAxis, objects, minX, minY, minZ, maxX, maxY, maxZ);
+		return new BVHBoundingBox(BVHSortingAxis, objects, minBounds.x, minBounds.y, minBounds.z, maxBounds.x, maxBounds.y, maxBounds.z);
 	}
 	else {
 		return nullptr;
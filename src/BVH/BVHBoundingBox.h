@@ -26,9 +26,13 @@ public:
 	float get_width() const { return x_max - x_min; }
 	float get_height() const { return y_max - y_min; }
 	float get_depth() const { return z_max - z_min; }
-	std::vector<Object*> get_objects() const { return myObjects; }
+	const std::vector<Object*>& get_objects() const { return myObjects; }
 
 	void set_Axis(Vector axis) { this->sortAxis = axis; }
+	void set_bounds(const Vertex& minValues, const Vertex& maxValues) {
+		x_min = minValues.x; y_min = minValues.y; z_min = minValues.z;
+		x_max = maxValues.x; y_max = maxValues.y; z_max = maxValues.z;
+	}
 
 	std::string toString() {
 		char buff[1024];
@@ -37,6 +41,12 @@ public:
 		return buffAsStdStr;
 	}
 
+	/// <summary>
+	/// World space bounds of a single sphere, cylinder, triangle or instance
+	/// </summary>
+	/// <returns>false for unbounded objects like planes</returns>
+	static bool getObjectBounds(Object* obj, Vertex& minValues, Vertex& maxValues);
+
 	static BVHBoundingBox* constructFromObject(std::vector<Object*> objects, Vector BVHSortingAxis);
 
 	static float getBoundingBoxOverlapPercentage(const BVHBoundingBox& a, const BVHBoundingBox& b);
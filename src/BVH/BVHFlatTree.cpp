@@ -0,0 +1,548 @@
+#include "BVHFlatTree.h"
+#include "../stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BVH_PACKET_SIMD 1
+#include <immintrin.h>
+#endif
+
+void BVHFlatTree::flatten(BVHBinaryTree& tree)
+{
+	nodes.clear();
+	primitives.clear();
+
+	BVHBinaryTree::Node* root = tree.getRoot();
+	if (root == nullptr || root->data == nullptr) return;
+
+	nodes.reserve(tree.getNodeCount());
+	flattenNode(root, 0);
+}
+
+uint32_t BVHFlatTree::flattenNode(BVHBinaryTree::Node* node, int depth)
+{
+	if (depth >= MAX_DEPTH) {
+		throw std::runtime_error("BVH is too deep to flatten.");
+	}
+
+	uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+
+	BVHBoundingBox* box = node->data;
+	Node flat;
+	flat.bboxMin[0] = box->get_x_min(); flat.bboxMin[1] = box->get_y_min(); flat.bboxMin[2] = box->get_z_min();
+	flat.bboxMax[0] = box->get_x_max(); flat.bboxMax[1] = box->get_y_max(); flat.bboxMax[2] = box->get_z_max();
+	flat.pad = 0;
+
+	if (node->left == nullptr && node->right == nullptr) {
+		const std::vector<Object*>& objects = box->get_objects();
+		if (objects.size() > UINT16_MAX) {
+			throw std::runtime_error("BVH leaf has too many primitives to flatten.");
+		}
+		flat.offset = (uint32_t)primitives.size();
+		flat.primitiveCount = (uint16_t)objects.size();
+		flat.axis = 0;
+		primitives.insert(primitives.end(), objects.begin(), objects.end());
+	}
+	else {
+		if (node->left == nullptr || node->right == nullptr) {
+			throw std::runtime_error("BVH interior node is missing a child.");
+		}
+		Vector axis = box->get_sort_Axis();
+		flat.axis = axis.y == 1.0f ? 1 : (axis.z == 1.0f ? 2 : 0);
+		flat.primitiveCount = 0;
+
+		flattenNode(node->left, depth + 1);
+		flat.offset = flattenNode(node->right, depth + 1);
+	}
+
+	nodes[index] = flat;
+	return index;
+}
+
+float BVHFlatTree::computeSAHCost(float traversalCost, float intersectionCost) const
+{
+	if (nodes.empty()) return 0;
+
+	auto surfaceArea = [](const Node& node) {
+		float dx = node.bboxMax[0] - node.bboxMin[0];
+		float dy = node.bboxMax[1] - node.bboxMin[1];
+		float dz = node.bboxMax[2] - node.bboxMin[2];
+		return 2.0f * (dx * dy + dy * dz + dz * dx);
+	};
+
+	float rootArea = surfaceArea(nodes[0]);
+	if (rootArea <= 0) return 0;
+
+	double cost = 0;
+	for (auto& node : nodes) {
+		float relativeArea = surfaceArea(node) / rootArea;
+		cost += node.isLeaf() ? intersectionCost * node.primitiveCount * relativeArea : traversalCost * relativeArea;
+	}
+	return (float)cost;
+}
+
+// Slab test clipped to the [tMin, tMax] interval of the ray, see AABBOps::rayIntersects.
+// The far distance is widened by the rounding error of its computation (Pharr et al., PBRT 3rd ed. 3.9.2),
+// so a hit exactly on the edge of a primitive is never culled by its own box.
+inline bool BVHFlatTree::boxIntersects(const Node& node, const Ray& ray) const
+{
+	const float gamma3 = 3.0f * std::numeric_limits<float>::epsilon() * 0.5f / (1.0f - 3.0f * std::numeric_limits<float>::epsilon() * 0.5f);
+	float tNear = ray.tMin;
+	float tFar = ray.tMax;
+	for (int axis = 0; axis < 3; axis++) {
+		// the ray's direction signs pick the near and far slab, no swap needed
+		float t0 = ((ray.dirIsNeg[axis] ? node.bboxMax[axis] : node.bboxMin[axis]) - ray.origin[axis]) * ray.invDirection[axis];
+		float t1 = ((ray.dirIsNeg[axis] ? node.bboxMin[axis] : node.bboxMax[axis]) - ray.origin[axis]) * ray.invDirection[axis];
+		t1 *= 1.0f + 2.0f * gamma3;
+		tNear = t0 > tNear ? t0 : tNear;
+		tFar = t1 < tFar ? t1 : tFar;
+	}
+	return tNear <= tFar;
+}
+
+bool BVHFlatTree::intersect(Ray& ray, std::tuple<float, Object*, Vector, Vertex>& result, bool pick) const
+{
+	if (nodes.empty()) return false;
+
+	int hitsTests = 0;
+	int totalIntersectionTests = 0;
+	bool hit = false;
+	RT_STATS(statsOps::Counters& stats = statsOps::local());
+
+	uint32_t stack[MAX_DEPTH];
+	int stackSize = 0;
+	uint32_t current = 0;
+
+	while (true) {
+		const Node& node = nodes[current];
+		hitsTests++;
+		totalIntersectionTests++;
+
+		if (boxIntersects(node, ray)) {
+			if (node.isLeaf()) {
+				RT_STATS(statsOps::countLeaf(stats, node.primitiveCount));
+				for (uint32_t i = node.offset; i < node.offset + node.primitiveCount; i++) {
+					float t;
+					Vector normal;
+					Vertex intersection;
+					totalIntersectionTests++;
+					RT_STATS(statsOps::countPrimitiveTest(stats, primitives[i]->type));
+					if (rayIntersectObject(ray, primitives[i], t, normal, intersection)) {
+						result = { t, primitives[i], normal, intersection };
+						ray.tMax = t;
+						hit = true;
+					}
+				}
+				if (stackSize == 0) break;
+				current = stack[--stackSize];
+			}
+			else {
+				// visit the child on the near side of the split first, so the far one can be culled by the closer hit
+				if (ray.dirIsNeg[node.axis]) {
+					stack[stackSize++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+				}
+			}
+		}
+		else {
+			if (stackSize == 0) break;
+			current = stack[--stackSize];
+		}
+	}
+
+	RT_STATS(stats.nodeVisits += hitsTests; stats.boxTests += hitsTests);
+	if (pick) std::cout << "BVH boxes: " << nodes.size() << ", boxes hit: " << hitsTests << ", Total intersections: " << totalIntersectionTests << ", result: " << (hit ? toString(std::get<1>(result)->type) : "miss") << std::endl;
+	return hit;
+}
+
+bool BVHFlatTree::occluded(const Ray& ray, bool pick) const
+{
+	if (nodes.empty()) return false;
+
+	int hitsTests = 0;
+	int totalIntersectionTests = 0;
+	bool hit = false;
+	RT_STATS(statsOps::Counters& stats = statsOps::local());
+
+	uint32_t stack[MAX_DEPTH];
+	int stackSize = 0;
+	uint32_t current = 0;
+
+	while (true) {
+		const Node& node = nodes[current];
+		hitsTests++;
+		totalIntersectionTests++;
+
+		if (boxIntersects(node, ray)) {
+			if (node.isLeaf()) {
+				RT_STATS(statsOps::countLeaf(stats, node.primitiveCount));
+				for (uint32_t i = node.offset; i < node.offset + node.primitiveCount && !hit; i++) {
+					totalIntersectionTests++;
+					RT_STATS(statsOps::countPrimitiveTest(stats, primitives[i]->type));
+					hit = rayOccludedByObject(ray, primitives[i]);
+				}
+				if (hit || stackSize == 0) break;
+				current = stack[--stackSize];
+			}
+			else {
+				// the near child is still the likelier one to hold an occluder
+				if (ray.dirIsNeg[node.axis]) {
+					stack[stackSize++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+				}
+			}
+		}
+		else {
+			if (stackSize == 0) break;
+			current = stack[--stackSize];
+		}
+	}
+
+	RT_STATS(stats.nodeVisits += hitsTests; stats.boxTests += hitsTests);
+	if (pick) std::cout << "BVH boxes: " << nodes.size() << ", boxes hit: " << hitsTests << ", Total intersections: " << totalIntersectionTests << ", result: " << (hit ? "occluded" : "clear") << std::endl;
+	return hit;
+}
+
+// ***************************************************************************************************************** //
+// Packet traversal, after Wald et al., "Ray Tracing Deformable Scenes using Dynamic Bounding Volume Hierarchies", 2007:
+// the packet descends into a node from the first ray that hits its box, and interval arithmetic over the packet's
+// origins and inverse directions culls nodes no ray can hit with a single test.
+// ***************************************************************************************************************** //
+
+// far distances are widened by their rounding error, see boxIntersects
+static const float GAMMA3 = 3.0f * std::numeric_limits<float>::epsilon() * 0.5f / (1.0f - 3.0f * std::numeric_limits<float>::epsilon() * 0.5f);
+static const float FAR_SCALE = 1.0f + 2.0f * GAMMA3;
+
+BVHFlatTree::PacketFrustum BVHFlatTree::packetFrustum(const RayPacket& packet, const int dirIsNeg[3])
+{
+	PacketFrustum frustum;
+	frustum.valid = true;
+	frustum.tMin = std::numeric_limits<float>::infinity();
+	frustum.tMax = -std::numeric_limits<float>::infinity();
+	for (int axis = 0; axis < 3; axis++) {
+		frustum.originMin[axis] = frustum.invMin[axis] = std::numeric_limits<float>::infinity();
+		frustum.originMax[axis] = frustum.invMax[axis] = -std::numeric_limits<float>::infinity();
+		frustum.dirIsNeg[axis] = dirIsNeg[axis];
+	}
+
+	for (int lane = 0; lane < packet.size; lane++) {
+		for (int axis = 0; axis < 3; axis++) {
+			float inv = packet.invDirection[axis][lane];
+			// an axis parallel ray gives infinite distances, and the corner products below could be NaN
+			if (!std::isfinite(inv)) frustum.valid = false;
+			frustum.originMin[axis] = std::min(frustum.originMin[axis], packet.origin[axis][lane]);
+			frustum.originMax[axis] = std::max(frustum.originMax[axis], packet.origin[axis][lane]);
+			frustum.invMin[axis] = std::min(frustum.invMin[axis], inv);
+			frustum.invMax[axis] = std::max(frustum.invMax[axis], inv);
+		}
+		frustum.tMin = std::min(frustum.tMin, packet.tMin[lane]);
+		frustum.tMax = std::max(frustum.tMax, packet.tMax[lane]);
+	}
+	return frustum;
+}
+
+// Whether no ray of the packet can hit the node. Rounded subtraction and multiplication are monotonic, so the
+// smallest entry and the largest exit distance of any ray are found at the corners of the packet's intervals.
+inline bool BVHFlatTree::frustumMisses(const Node& node, const PacketFrustum& frustum)
+{
+	float tNear = frustum.tMin;
+	float tFar = frustum.tMax;
+	for (int axis = 0; axis < 3; axis++) {
+		float nearPlane = frustum.dirIsNeg[axis] ? node.bboxMax[axis] : node.bboxMin[axis];
+		float farPlane = frustum.dirIsNeg[axis] ? node.bboxMin[axis] : node.bboxMax[axis];
+
+		float n0 = nearPlane - frustum.originMax[axis], n1 = nearPlane - frustum.originMin[axis];
+		float t0 = std::min(std::min(n0 * frustum.invMin[axis], n0 * frustum.invMax[axis]), std::min(n1 * frustum.invMin[axis], n1 * frustum.invMax[axis]));
+		float f0 = farPlane - frustum.originMax[axis], f1 = farPlane - frustum.originMin[axis];
+		float t1 = std::max(std::max(f0 * frustum.invMin[axis], f0 * frustum.invMax[axis]), std::max(f1 * frustum.invMin[axis], f1 * frustum.invMax[axis]));
+		t1 *= FAR_SCALE;
+
+		tNear = t0 > tNear ? t0 : tNear;
+		tFar = t1 < tFar ? t1 : tFar;
+	}
+	return tNear > tFar;
+}
+
+// The same arithmetic as boxIntersects, so a ray hits the same boxes alone and in a packet
+inline int BVHFlatTree::packetGroupIntersects(const Node& node, const RayPacket& packet, int group, const int dirIsNeg[3])
+{
+	const int first = group * 4;
+#if defined(BVH_PACKET_SIMD)
+	__m128 vNear = _mm_load_ps(&packet.tMin[first]);
+	__m128 vFar = _mm_load_ps(&packet.tMax[first]);
+	const __m128 farScale = _mm_set1_ps(FAR_SCALE);
+	for (int axis = 0; axis < 3; axis++) {
+		__m128 nearPlane = _mm_set1_ps(dirIsNeg[axis] ? node.bboxMax[axis] : node.bboxMin[axis]);
+		__m128 farPlane = _mm_set1_ps(dirIsNeg[axis] ? node.bboxMin[axis] : node.bboxMax[axis]);
+		__m128 origin = _mm_load_ps(&packet.origin[axis][first]);
+		__m128 invDir = _mm_load_ps(&packet.invDirection[axis][first]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(nearPlane, origin), invDir);
+		__m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(farPlane, origin), invDir), farScale);
+		vNear = _mm_max_ps(t0, vNear);
+		vFar = _mm_min_ps(t1, vFar);
+	}
+	return _mm_movemask_ps(_mm_cmple_ps(vNear, vFar));
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		int lane = first + i;
+		float tNear = packet.tMin[lane];
+		float tFar = packet.tMax[lane];
+		for (int axis = 0; axis < 3; axis++) {
+			float t0 = ((dirIsNeg[axis] ? node.bboxMax[axis] : node.bboxMin[axis]) - packet.origin[axis][lane]) * packet.invDirection[axis][lane];
+			float t1 = ((dirIsNeg[axis] ? node.bboxMin[axis] : node.bboxMax[axis]) - packet.origin[axis][lane]) * packet.invDirection[axis][lane];
+			t1 *= FAR_SCALE;
+			tNear = t0 > tNear ? t0 : tNear;
+			tFar = t1 < tFar ? t1 : tFar;
+		}
+		if (tNear <= tFar) mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+// Moller-Trumbore test of the 4 lanes of a group against a world space triangle, with the operations of
+// triangleOps::rayIntersects in the same order, so every lane finds exactly the t a single ray would
+static int packetGroupIntersectsTriangle(const RayPacket& packet, int group, const Triangle& triangle, float t[4])
+{
+	const int first = group * 4;
+#if defined(BVH_PACKET_SIMD)
+	const Vertex& v0 = triangle.vertex(0);
+	Vector e1 = triangle.vertex(1) - v0;
+	Vector e2 = triangle.vertex(2) - v0;
+	__m128 dx = _mm_load_ps(&packet.direction[0][first]);
+	__m128 dy = _mm_load_ps(&packet.direction[1][first]);
+	__m128 dz = _mm_load_ps(&packet.direction[2][first]);
+	__m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+	__m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+
+	// p = cross(d, e2), det = dot(e1, p)
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	// s = origin - v0, u = dot(s, p) / det
+	__m128 sx = _mm_sub_ps(_mm_load_ps(&packet.origin[0][first]), _mm_set1_ps(v0.x));
+	__m128 sy = _mm_sub_ps(_mm_load_ps(&packet.origin[1][first]), _mm_set1_ps(v0.y));
+	__m128 sz = _mm_sub_ps(_mm_load_ps(&packet.origin[2][first]), _mm_set1_ps(v0.z));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+
+	// q = cross(s, e1), v = dot(d, q) / det, t = dot(e2, q) / det
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(e1y, sz));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(e1z, sx));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(e1x, sy));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	__m128 vt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+	// the scalar test rejects on each comparison being true, so a NaN passes them just the same
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	__m128 miss = _mm_cmpeq_ps(det, zero);
+	miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+	miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+	__m128 inside = _mm_and_ps(_mm_cmpgt_ps(vt, _mm_load_ps(&packet.tMin[first])), _mm_cmplt_ps(vt, _mm_load_ps(&packet.tMax[first])));
+	_mm_storeu_ps(t, vt);
+	return _mm_movemask_ps(_mm_andnot_ps(miss, inside));
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		float u, v;
+		if (first + i < packet.size && triangleOps::rayIntersects(packet.ray(first + i), triangle, t[i], u, v)) mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+// Primitives the packet leaf test handles 4 lanes at a time, the others are tested lane by lane
+static bool isWorldSpaceTriangle(Object* object)
+{
+	return object->type == ObjectType::TRIANGLE && ((Triangle*)object)->parent_mesh->worldSpace;
+}
+
+uint32_t BVHFlatTree::intersectPacket(RayPacket& packet, std::tuple<float, Object*, Vector, Vertex>* results) const
+{
+	int dirIsNeg[3];
+	if (nodes.empty() || !packet.sameSigns(dirIsNeg)) return 0;
+
+	PacketFrustum frustum = packetFrustum(packet, dirIsNeg);
+	const int groups = packet.groupCount();
+	RT_STATS(statsOps::Counters& stats = statsOps::local());
+	uint32_t hitMask = 0;
+
+	struct StackEntry {
+		uint32_t node;
+		int firstGroup;  // the groups before it missed an ancestor
+	};
+	StackEntry stack[MAX_DEPTH];
+	int stackSize = 0;
+	uint32_t current = 0;
+	int firstGroup = 0;
+
+	while (true) {
+		const Node& node = nodes[current];
+		RT_STATS(stats.nodeVisits++);
+
+		int group = groups;
+		int groupMask = 0;
+		if (!frustum.valid || !frustumMisses(node, frustum)) {
+			for (group = firstGroup; group < groups; group++) {
+				RT_STATS(stats.boxTests += 4);
+				groupMask = packetGroupIntersects(node, packet, group, dirIsNeg);
+				if (groupMask != 0) break;
+			}
+		}
+
+		if (group < groups && !node.isLeaf()) {
+			// all rays share the sign along the split axis, so the near child is the same for the whole packet
+			uint32_t nearChild = dirIsNeg[node.axis] ? node.offset : current + 1;
+			uint32_t farChild = dirIsNeg[node.axis] ? current + 1 : node.offset;
+			stack[stackSize++] = { farChild, group };
+			current = nearChild;
+			firstGroup = group;
+			continue;
+		}
+
+		if (group < groups) {
+			int groupMasks[RayPacket::MAX_SIZE / 4] = {};
+			RT_STATS(statsOps::countLeaf(stats, node.primitiveCount); stats.boxTests += 4 * (groups - group - 1));
+			for (int g = group; g < groups; g++) groupMasks[g] = g == group ? groupMask : packetGroupIntersects(node, packet, g, dirIsNeg);
+
+			for (uint32_t p = node.offset; p < node.offset + node.primitiveCount; p++) {
+				Object* primitive = primitives[p];
+				bool simd = isWorldSpaceTriangle(primitive);
+				for (int g = group; g < groups; g++) {
+					if (groupMasks[g] == 0) continue;
+					float groupT[4];
+					RT_STATS(if (simd) stats.primitiveTests[(int)ObjectType::TRIANGLE] += 4);
+					int mask = simd ? groupMasks[g] & packetGroupIntersectsTriangle(packet, g, *(Triangle*)primitive, groupT) : groupMasks[g];
+					for (int i = 0; i < 4; i++) {
+						if ((mask & (1 << i)) == 0) continue;
+						int lane = g * 4 + i;
+						Ray ray = packet.ray(lane);
+						if (simd) {
+							results[lane] = { groupT[i], primitive, ((Triangle*)primitive)->normal(), ray.at(groupT[i]) };
+							packet.tMax[lane] = groupT[i];
+							hitMask |= 1u << lane;
+							continue;
+						}
+						float t;
+						Vector normal;
+						Vertex intersection;
+						RT_STATS(statsOps::countPrimitiveTest(stats, primitive->type));
+						if (rayIntersectObject(ray, primitive, t, normal, intersection)) {
+							results[lane] = { t, primitive, normal, intersection };
+							packet.tMax[lane] = t;
+							hitMask |= 1u << lane;
+						}
+					}
+				}
+			}
+			// the closer hits shrink the frustum for the rest of the traversal
+			if (frustum.valid) {
+				frustum.tMax = -std::numeric_limits<float>::infinity();
+				for (int lane = 0; lane < packet.size; lane++) frustum.tMax = std::max(frustum.tMax, packet.tMax[lane]);
+			}
+		}
+
+		if (stackSize == 0) break;
+		stackSize--;
+		current = stack[stackSize].node;
+		firstGroup = stack[stackSize].firstGroup;
+	}
+	return hitMask;
+}
+
+uint32_t BVHFlatTree::occludedPacket(const RayPacket& packet, uint32_t occluded) const
+{
+	int dirIsNeg[3];
+	const uint32_t allLanes = (1u << packet.size) - 1;
+	if (nodes.empty() || occluded == allLanes || !packet.sameSigns(dirIsNeg)) return occluded;
+
+	PacketFrustum frustum = packetFrustum(packet, dirIsNeg);
+	const int groups = packet.groupCount();
+	RT_STATS(statsOps::Counters& stats = statsOps::local());
+
+	struct StackEntry {
+		uint32_t node;
+		int firstGroup;
+	};
+	StackEntry stack[MAX_DEPTH];
+	int stackSize = 0;
+	uint32_t current = 0;
+	int firstGroup = 0;
+
+	while (true) {
+		const Node& node = nodes[current];
+		RT_STATS(stats.nodeVisits++);
+
+		// lanes already occluded are out of the traversal
+		int group = groups;
+		int groupMask = 0;
+		if (!frustum.valid || !frustumMisses(node, frustum)) {
+			for (group = firstGroup; group < groups; group++) {
+				RT_STATS(stats.boxTests += 4);
+				groupMask = packetGroupIntersects(node, packet, group, dirIsNeg) & ~(occluded >> (4 * group)) & 0xf;
+				if (groupMask != 0) break;
+			}
+		}
+
+		if (group < groups && !node.isLeaf()) {
+			uint32_t nearChild = dirIsNeg[node.axis] ? node.offset : current + 1;
+			uint32_t farChild = dirIsNeg[node.axis] ? current + 1 : node.offset;
+			stack[stackSize++] = { farChild, group };
+			current = nearChild;
+			firstGroup = group;
+			continue;
+		}
+
+		if (group < groups) {
+			int groupMasks[RayPacket::MAX_SIZE / 4] = {};
+			RT_STATS(statsOps::countLeaf(stats, node.primitiveCount); stats.boxTests += 4 * (groups - group - 1));
+			for (int g = group; g < groups; g++) {
+				groupMasks[g] = g == group ? groupMask : packetGroupIntersects(node, packet, g, dirIsNeg) & ~(occluded >> (4 * g)) & 0xf;
+			}
+
+			for (uint32_t p = node.offset; p < node.offset + node.primitiveCount; p++) {
+				Object* primitive = primitives[p];
+				bool simd = isWorldSpaceTriangle(primitive);
+				for (int g = group; g < groups; g++) {
+					if (groupMasks[g] == 0) continue;
+					float groupT[4];
+					int mask = groupMasks[g];
+					RT_STATS(if (simd) stats.primitiveTests[(int)ObjectType::TRIANGLE] += 4);
+					if (simd) mask &= packetGroupIntersectsTriangle(packet, g, *(Triangle*)primitive, groupT);
+					else {
+						for (int i = 0; i < 4; i++) {
+							if ((mask & (1 << i)) == 0) continue;
+							RT_STATS(statsOps::countPrimitiveTest(stats, primitive->type));
+							if (!rayOccludedByObject(packet.ray(g * 4 + i), primitive)) mask &= ~(1 << i);
+						}
+					}
+					occluded |= (uint32_t)mask << (4 * g);
+					groupMasks[g] &= ~mask;
+				}
+			}
+			if (occluded == allLanes) break;
+		}
+
+		if (stackSize == 0) break;
+		stackSize--;
+		current = stack[stackSize].node;
+		firstGroup = stack[stackSize].firstGroup;
+	}
+	return occluded;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <tuple>
+#include <vector>
+
+#include "BVHBinaryTree.h"
+#include "../rayPacket.h"
+
+/// <summary>
+/// Linear, depth-first copy of a BVHBinaryTree. The first child of an interior node is the next node in the array,
+/// the second child is found through an offset, and leaves reference a range of the primitive array.
+/// </summary>
+class BVHFlatTree {
+public:
+	struct Node {
+		float bboxMin[3];
+		float bboxMax[3];
+		uint32_t offset;          // interior: index of the second child, leaf: index of the first primitive
+		uint16_t primitiveCount;  // 0 for interior nodes
+		uint8_t axis;             // split axis of interior nodes, used for near-child-first traversal
+		uint8_t pad;
+
+		bool isLeaf() const { return primitiveCount > 0; }
+	};
+	static_assert(sizeof(Node) == 32, "BVHFlatTree::Node should fit two per cache line");
+
+	// deepest tree the traversal stack can handle
+	static const int MAX_DEPTH = 64;
+
+	/// <summary>
+	/// Rebuilds the flat tree from the given binary tree
+	/// </summary>
+	void flatten(BVHBinaryTree& tree);
+
+	/// <summary>
+	/// Closest hit query. Every hit shrinks ray.tMax, so on return it holds the distance of the closest hit.
+	/// </summary>
+	bool intersect(Ray& ray, std::tuple<float, Object*, Vector, Vertex>& result, bool pick) const;
+
+	/// <summary>
+	/// Any hit query, returns as soon as a primitive is hit inside (ray.tMin, ray.tMax)
+	/// </summary>
+	bool occluded(const Ray& ray, bool pick) const;
+
+	/// <summary>
+	/// Closest hit query for every ray of a packet whose rays share their direction signs (RayPacket::sameSigns).
+	/// The rays walk the tree together: a node is skipped when its box lies outside the frustum around the packet,
+	/// and otherwise visited by the rays from the first one that hits it, so a node costs one fetch for the whole packet.
+	/// Every hit shrinks the tMax of its lane.
+	/// </summary>
+	/// <param name="results">= one per lane, only written for the lanes that hit</param>
+	/// <returns>bit mask of the lanes that hit</returns>
+	uint32_t intersectPacket(RayPacket& packet, std::tuple<float, Object*, Vector, Vertex>* results) const;
+
+	/// <summary>
+	/// Any hit query for every ray of a packet whose rays share their direction signs. Lanes drop out as soon as they
+	/// are occluded, and the traversal stops once all of them are.
+	/// </summary>
+	/// <param name="occluded">= lanes already known to be occluded, e.g. by a plane, which are not traced</param>
+	/// <returns>bit mask of the occluded lanes</returns>
+	uint32_t occludedPacket(const RayPacket& packet, uint32_t occluded = 0) const;
+
+	/// <summary>
+	/// Bounds of the root node
+	/// </summary>
+	/// <returns>false if the tree is empty</returns>
+	bool getBounds(Vertex& bboxMin, Vertex& bboxMax) const {
+		if (nodes.empty()) return false;
+		bboxMin = Vertex(nodes[0].bboxMin[0], nodes[0].bboxMin[1], nodes[0].bboxMin[2]);
+		bboxMax = Vertex(nodes[0].bboxMax[0], nodes[0].bboxMax[1], nodes[0].bboxMax[2]);
+		return true;
+	}
+
+	int getNodeCount() const { return (int)nodes.size(); }
+	size_t getMemoryBytes() const { return nodes.capacity() * sizeof(Node) + primitives.capacity() * sizeof(Object*); }
+
+	/// <summary>
+	/// Expected cost of a random ray hitting the root: the traversal cost of every interior node and the
+	/// intersection cost of every leaf primitive, each weighted by the node's surface area relative to the root.
+	/// </summary>
+	float computeSAHCost(float traversalCost, float intersectionCost) const;
+
+private:
+	std::vector<Node> nodes;
+	std::vector<Object*> primitives;
+
+	// Bounds of a packet's rays for culling whole nodes: every origin lies in [originMin, originMax], every inverse
+	// direction in [invMin, invMax] and every hit interval in [tMin, tMax]. Only valid when no direction component is 0.
+	struct PacketFrustum {
+		float originMin[3], originMax[3];
+		float invMin[3], invMax[3];
+		int dirIsNeg[3];
+		float tMin, tMax;
+		bool valid;
+	};
+
+	uint32_t flattenNode(BVHBinaryTree::Node* node, int depth);
+	bool boxIntersects(const Node& node, const Ray& ray) const;
+
+	static PacketFrustum packetFrustum(const RayPacket& packet, const int dirIsNeg[3]);
+	static bool frustumMisses(const Node& node, const PacketFrustum& frustum);
+	/// <summary>
+	/// Slab test of the 4 lanes of group number group against the node, see boxIntersects
+	/// </summary>
+	/// <returns>bit mask of the lanes of the group that hit</returns>
+	static int packetGroupIntersects(const Node& node, const RayPacket& packet, int group, const int dirIsNeg[3]);
+};
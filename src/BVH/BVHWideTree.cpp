@@ -0,0 +1,368 @@
+#include "BVHWideTree.h"
+#include "../stats.h"
+
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BVH_WIDE_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit AVX instructions in functions compiled for it, MSVC accepts the intrinsics anywhere
+#if defined(BVH_WIDE_SIMD) && defined(__GNUC__) && !defined(__AVX__)
+#define BVH_TARGET_AVX __attribute__((target("avx")))
+#else
+#define BVH_TARGET_AVX
+#endif
+
+// far distances are widened by their rounding error, see BVHFlatTree::boxIntersects
+static const float GAMMA3 = 3.0f * std::numeric_limits<float>::epsilon() * 0.5f / (1.0f - 3.0f * std::numeric_limits<float>::epsilon() * 0.5f);
+static const float FAR_SCALE = 1.0f + 2.0f * GAMMA3;
+
+bool cpuSupportsAVX()
+{
+#if defined(BVH_WIDE_SIMD) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	// the OS also has to save the YMM registers on context switches
+	return osxsave && avx && (_xgetbv(0) & 0x6) == 0x6;
+#elif defined(BVH_WIDE_SIMD) && defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx");
+#else
+	return false;
+#endif
+}
+
+template <int N>
+bool BVHWideTree<N>::simdSupported()
+{
+#if defined(BVH_WIDE_SIMD)
+	// SSE is part of every x86-64 CPU, AVX is not
+	static const bool supported = N == 4 || cpuSupportsAVX();
+	return supported;
+#else
+	return false;
+#endif
+}
+
+template <int N>
+BVHWideTree<N>::BVHWideTree() : useSIMD(simdSupported())
+{
+}
+
+template <int N>
+void BVHWideTree<N>::setSIMD(bool simd)
+{
+	useSIMD = simd && simdSupported();
+}
+
+static float surfaceArea(BVHBoundingBox* box)
+{
+	float dx = box->get_x_max() - box->get_x_min();
+	float dy = box->get_y_max() - box->get_y_min();
+	float dz = box->get_z_max() - box->get_z_min();
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+template <int N>
+void BVHWideTree<N>::collapse(BVHBinaryTree& tree)
+{
+	nodes.clear();
+	primitives.clear();
+
+	BVHBinaryTree::Node* root = tree.getRoot();
+	if (root == nullptr || root->data == nullptr) return;
+
+	collapseNode(root, 0);
+}
+
+template <int N>
+uint32_t BVHWideTree<N>::collapseNode(BVHBinaryTree::Node* node, int depth)
+{
+	if (depth >= MAX_DEPTH) {
+		throw std::runtime_error("BVH is too deep to collapse.");
+	}
+
+	uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	Node& wide = nodes.back();
+	for (int slot = 0; slot < N; slot++) {
+		for (int axis = 0; axis < 3; axis++) {
+			wide.bboxMin[axis][slot] = std::numeric_limits<float>::infinity();
+			wide.bboxMax[axis][slot] = -std::numeric_limits<float>::infinity();
+		}
+		wide.child[slot] = EMPTY;
+		wide.primitiveCount[slot] = 0;
+	}
+
+	BVHBinaryTree::Node* children[N];
+	int childCount = 0;
+	if (node->left == nullptr && node->right == nullptr) {
+		children[childCount++] = node;
+	}
+	else {
+		children[childCount++] = node->left;
+		children[childCount++] = node->right;
+	}
+
+	// open up the largest interior child until the node is full
+	while (childCount < N) {
+		int largest = -1;
+		float largestArea = -1;
+		for (int i = 0; i < childCount; i++) {
+			bool interior = children[i]->left != nullptr || children[i]->right != nullptr;
+			if (interior && surfaceArea(children[i]->data) > largestArea) {
+				largest = i;
+				largestArea = surfaceArea(children[i]->data);
+			}
+		}
+		if (largest < 0) break;
+
+		BVHBinaryTree::Node* opened = children[largest];
+		if (opened->left == nullptr || opened->right == nullptr) {
+			throw std::runtime_error("BVH interior node is missing a child.");
+		}
+		children[largest] = opened->left;
+		children[childCount++] = opened->right;
+	}
+
+	for (int slot = 0; slot < childCount; slot++) {
+		setChild(index, slot, children[slot], depth);
+	}
+	return index;
+}
+
+template <int N>
+void BVHWideTree<N>::setChild(uint32_t nodeIndex, int slot, BVHBinaryTree::Node* child, int depth)
+{
+	BVHBoundingBox* box = child->data;
+	{
+		Node& wide = nodes[nodeIndex];
+		wide.bboxMin[0][slot] = box->get_x_min(); wide.bboxMin[1][slot] = box->get_y_min(); wide.bboxMin[2][slot] = box->get_z_min();
+		wide.bboxMax[0][slot] = box->get_x_max(); wide.bboxMax[1][slot] = box->get_y_max(); wide.bboxMax[2][slot] = box->get_z_max();
+	}
+
+	if (child->left == nullptr && child->right == nullptr) {
+		const std::vector<Object*>& objects = box->get_objects();
+		if (objects.size() > UINT16_MAX || primitives.size() >= LEAF_BIT) {
+			throw std::runtime_error("BVH leaf has too many primitives to collapse.");
+		}
+		nodes[nodeIndex].child[slot] = LEAF_BIT | (uint32_t)primitives.size();
+		nodes[nodeIndex].primitiveCount[slot] = (uint16_t)objects.size();
+		primitives.insert(primitives.end(), objects.begin(), objects.end());
+	}
+	else {
+		// collapseNode grows the node array, so only index into it afterwards
+		uint32_t childIndex = collapseNode(child, depth + 1);
+		nodes[nodeIndex].child[slot] = childIndex;
+	}
+}
+
+template <int N>
+int BVHWideTree<N>::intersectChildrenScalar(const Node& node, const Ray& ray, float tNear[N]) const
+{
+	int mask = 0;
+	for (int slot = 0; slot < N; slot++) {
+		float tn = ray.tMin;
+		float tf = ray.tMax;
+		for (int axis = 0; axis < 3; axis++) {
+			float nearPlane = ray.dirIsNeg[axis] ? node.bboxMax[axis][slot] : node.bboxMin[axis][slot];
+			float farPlane = ray.dirIsNeg[axis] ? node.bboxMin[axis][slot] : node.bboxMax[axis][slot];
+			float t0 = (nearPlane - ray.origin[axis]) * ray.invDirection[axis];
+			float t1 = (farPlane - ray.origin[axis]) * ray.invDirection[axis] * FAR_SCALE;
+			tn = t0 > tn ? t0 : tn;
+			tf = t1 < tf ? t1 : tf;
+		}
+		tNear[slot] = tn;
+		if (tn <= tf) mask |= 1 << slot;
+	}
+	return mask;
+}
+
+#if defined(BVH_WIDE_SIMD)
+// The SIMD tests below match intersectChildrenScalar bit for bit: max/min return their second operand when
+// either is NaN, just like the scalar ternaries, so 0 * inf slabs leave the interval unchanged.
+
+template <>
+int BVHWideTree<4>::intersectChildrenSIMD(const Node& node, const Ray& ray, float tNear[4]) const
+{
+	__m128 vNear = _mm_set1_ps(ray.tMin);
+	__m128 vFar = _mm_set1_ps(ray.tMax);
+	const __m128 farScale = _mm_set1_ps(FAR_SCALE);
+	for (int axis = 0; axis < 3; axis++) {
+		const float* nearPlane = ray.dirIsNeg[axis] ? node.bboxMax[axis] : node.bboxMin[axis];
+		const float* farPlane = ray.dirIsNeg[axis] ? node.bboxMin[axis] : node.bboxMax[axis];
+		__m128 origin = _mm_set1_ps(ray.origin[axis]);
+		__m128 invDir = _mm_set1_ps(ray.invDirection[axis]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearPlane), origin), invDir);
+		__m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farPlane), origin), invDir), farScale);
+		vNear = _mm_max_ps(t0, vNear);
+		vFar = _mm_min_ps(t1, vFar);
+	}
+	_mm_storeu_ps(tNear, vNear);
+	return _mm_movemask_ps(_mm_cmple_ps(vNear, vFar));
+}
+
+template <>
+BVH_TARGET_AVX int BVHWideTree<8>::intersectChildrenSIMD(const Node& node, const Ray& ray, float tNear[8]) const
+{
+	__m256 vNear = _mm256_set1_ps(ray.tMin);
+	__m256 vFar = _mm256_set1_ps(ray.tMax);
+	const __m256 farScale = _mm256_set1_ps(FAR_SCALE);
+	for (int axis = 0; axis < 3; axis++) {
+		const float* nearPlane = ray.dirIsNeg[axis] ? node.bboxMax[axis] : node.bboxMin[axis];
+		const float* farPlane = ray.dirIsNeg[axis] ? node.bboxMin[axis] : node.bboxMax[axis];
+		__m256 origin = _mm256_set1_ps(ray.origin[axis]);
+		__m256 invDir = _mm256_set1_ps(ray.invDirection[axis]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearPlane), origin), invDir);
+		__m256 t1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farPlane), origin), invDir), farScale);
+		vNear = _mm256_max_ps(t0, vNear);
+		vFar = _mm256_min_ps(t1, vFar);
+	}
+	_mm256_storeu_ps(tNear, vNear);
+	return _mm256_movemask_ps(_mm256_cmp_ps(vNear, vFar, _CMP_LE_OQ));
+}
+#else
+template <int N>
+int BVHWideTree<N>::intersectChildrenSIMD(const Node& node, const Ray& ray, float tNear[N]) const
+{
+	return intersectChildrenScalar(node, ray, tNear);
+}
+#endif
+
+template <int N>
+inline int BVHWideTree<N>::intersectChildren(const Node& node, const Ray& ray, float tNear[N]) const
+{
+	return useSIMD ? intersectChildrenSIMD(node, ray, tNear) : intersectChildrenScalar(node, ray, tNear);
+}
+
+template <int N>
+bool BVHWideTree<N>::intersect(Ray& ray, std::tuple<float, Object*, Vector, Vertex>& result, bool pick) const
+{
+	if (nodes.empty()) return false;
+
+	int nodesVisited = 0;
+	int totalIntersectionTests = 0;
+	bool hit = false;
+	RT_STATS(statsOps::Counters& stats = statsOps::local());
+
+	struct StackEntry {
+		uint32_t child;
+		uint16_t primitiveCount;
+		float tNear;
+	};
+	StackEntry stack[MAX_DEPTH * (N - 1) + 1];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, ray.tMin };
+
+	while (stackSize > 0) {
+		StackEntry entry = stack[--stackSize];
+		// a closer hit was found after this entry was pushed
+		if (entry.tNear > ray.tMax) continue;
+
+		if (entry.child & LEAF_BIT) {
+			uint32_t first = entry.child & ~LEAF_BIT;
+			RT_STATS(statsOps::countLeaf(stats, entry.primitiveCount));
+			for (uint32_t i = first; i < first + entry.primitiveCount; i++) {
+				float t;
+				Vector normal;
+				Vertex intersection;
+				totalIntersectionTests++;
+				RT_STATS(statsOps::countPrimitiveTest(stats, primitives[i]->type));
+				if (rayIntersectObject(ray, primitives[i], t, normal, intersection)) {
+					result = { t, primitives[i], normal, intersection };
+					ray.tMax = t;
+					hit = true;
+				}
+			}
+			continue;
+		}
+
+		const Node& node = nodes[entry.child];
+		nodesVisited++;
+		totalIntersectionTests += N;
+
+		float tNear[N];
+		int mask = intersectChildren(node, ray, tNear);
+
+		// sort the children hit from far to near, so the nearest one ends up on top of the stack
+		int order[N];
+		int hits = 0;
+		for (int slot = 0; slot < N; slot++) {
+			if (!(mask & (1 << slot))) continue;
+			int i = hits++;
+			while (i > 0 && tNear[order[i - 1]] < tNear[slot]) {
+				order[i] = order[i - 1];
+				i--;
+			}
+			order[i] = slot;
+		}
+		for (int i = 0; i < hits; i++) {
+			int slot = order[i];
+			stack[stackSize++] = { node.child[slot], node.primitiveCount[slot], tNear[slot] };
+		}
+	}
+
+	RT_STATS(stats.nodeVisits += nodesVisited; stats.boxTests += nodesVisited * N);
+	if (pick) std::cout << "BVH" << N << " nodes: " << nodes.size() << ", nodes visited: " << nodesVisited << ", Total intersections: " << totalIntersectionTests << ", result: " << (hit ? toString(std::get<1>(result)->type) : "miss") << std::endl;
+	return hit;
+}
+
+template <int N>
+bool BVHWideTree<N>::occluded(const Ray& ray, bool pick) const
+{
+	if (nodes.empty()) return false;
+
+	int nodesVisited = 0;
+	int totalIntersectionTests = 0;
+	bool hit = false;
+	RT_STATS(statsOps::Counters& stats = statsOps::local());
+
+	uint32_t stack[MAX_DEPTH * (N - 1) + 1];
+	uint16_t stackCount[MAX_DEPTH * (N - 1) + 1];
+	int stackSize = 0;
+	stack[stackSize] = 0;
+	stackCount[stackSize++] = 0;
+
+	while (stackSize > 0 && !hit) {
+		stackSize--;
+		uint32_t child = stack[stackSize];
+
+		if (child & LEAF_BIT) {
+			uint32_t first = child & ~LEAF_BIT;
+			RT_STATS(statsOps::countLeaf(stats, stackCount[stackSize]));
+			for (uint32_t i = first; i < first + stackCount[stackSize] && !hit; i++) {
+				totalIntersectionTests++;
+				RT_STATS(statsOps::countPrimitiveTest(stats, primitives[i]->type));
+				hit = rayOccludedByObject(ray, primitives[i]);
+			}
+			continue;
+		}
+
+		const Node& node = nodes[child];
+		nodesVisited++;
+		totalIntersectionTests += N;
+
+		// any hit ends the query, so the children are pushed in slot order without sorting
+		float tNear[N];
+		int mask = intersectChildren(node, ray, tNear);
+		for (int slot = 0; slot < N; slot++) {
+			if (!(mask & (1 << slot))) continue;
+			stack[stackSize] = node.child[slot];
+			stackCount[stackSize++] = node.primitiveCount[slot];
+		}
+	}
+
+	RT_STATS(stats.nodeVisits += nodesVisited; stats.boxTests += nodesVisited * N);
+	if (pick) std::cout << "BVH" << N << " nodes: " << nodes.size() << ", nodes visited: " << nodesVisited << ", Total intersections: " << totalIntersectionTests << ", result: " << (hit ? "occluded" : "clear") << std::endl;
+	return hit;
+}
+
+template class BVHWideTree<4>;
+template class BVHWideTree<8>;
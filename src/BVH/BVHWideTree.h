@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <tuple>
+#include <vector>
+
+#include "BVHBinaryTree.h"
+
+/// <summary>
+/// N-wide BVH (N = 4 or 8) collapsed from a BVHBinaryTree. Every node stores the bounds of its N children as
+/// structure of arrays, so one SIMD slab test checks all of them at once: SSE for 4 wide, AVX for 8 wide when the
+/// CPU supports it. Leaves are stored in their parent's child slots and reference a range of the primitive array.
+/// </summary>
+template <int N>
+class BVHWideTree {
+public:
+	static_assert(N == 4 || N == 8, "BVHWideTree supports 4 and 8 wide nodes");
+
+	struct alignas(32) Node {
+		float bboxMin[3][N];
+		float bboxMax[3][N];
+		uint32_t child[N];           // interior child: node index, leaf child: LEAF_BIT | first primitive, unused: EMPTY
+		uint16_t primitiveCount[N];  // leaf children only
+	};
+
+	static const uint32_t LEAF_BIT = 0x80000000u;
+	static const uint32_t EMPTY = 0xffffffffu;
+
+	// deepest binary tree the traversal stack can handle, see BVHFlatTree::MAX_DEPTH
+	static const int MAX_DEPTH = 64;
+
+	BVHWideTree();
+
+	/// <summary>
+	/// Rebuilds the wide tree from the given binary tree. Each node pulls up the grandchildren of its largest
+	/// interior children until it has N children or only leaves are left.
+	/// </summary>
+	void collapse(BVHBinaryTree& tree);
+
+	/// <summary>
+	/// Closest hit query. Every hit shrinks ray.tMax, so on return it holds the distance of the closest hit.
+	/// </summary>
+	bool intersect(Ray& ray, std::tuple<float, Object*, Vector, Vertex>& result, bool pick) const;
+
+	/// <summary>
+	/// Any hit query, returns as soon as a primitive is hit inside (ray.tMin, ray.tMax). Children are not sorted.
+	/// </summary>
+	bool occluded(const Ray& ray, bool pick) const;
+
+	int getNodeCount() const { return (int)nodes.size(); }
+	size_t getMemoryBytes() const { return nodes.capacity() * sizeof(Node) + primitives.capacity() * sizeof(Object*); }
+	bool isEmpty() const { return nodes.empty(); }
+
+	/// <summary>
+	/// Whether the SIMD child test is used. Off on CPUs without the needed instruction set, and can be turned off to compare against scalar.
+	/// </summary>
+	bool getSIMD() const { return useSIMD; }
+	void setSIMD(bool simd);
+
+private:
+	std::vector<Node> nodes;
+	std::vector<Object*> primitives;
+	bool useSIMD;
+
+	static bool simdSupported();
+	uint32_t collapseNode(BVHBinaryTree::Node* node, int depth);
+	void setChild(uint32_t nodeIndex, int slot, BVHBinaryTree::Node* child, int depth);
+
+	/// <summary>
+	/// Slab test of the ray against all children of the node, clipped to [ray.tMin, ray.tMax]
+	/// </summary>
+	/// <param name="tNear">= entry distance of every child</param>
+	/// <returns>bit mask of the children hit</returns>
+	int intersectChildren(const Node& node, const Ray& ray, float tNear[N]) const;
+	int intersectChildrenScalar(const Node& node, const Ray& ray, float tNear[N]) const;
+	int intersectChildrenSIMD(const Node& node, const Ray& ray, float tNear[N]) const;
+};
+
+/// <summary>
+/// True when the CPU and OS support AVX, needed by the 8 wide SIMD test
+/// </summary>
+bool cpuSupportsAVX();
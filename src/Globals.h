@@ -1,6 +1,9 @@
 #pragma once
 
 namespace Globals {
+	enum class BVHBuildMethod { MEDIAN, SAH };
+	enum class SamplerType { RANDOM, SOBOL };
+
 	extern bool AMBIENT;
 	extern bool DIFFUSE;
 	extern bool SPECULAR;
@@ -10,10 +13,32 @@ namespace Globals {
 	extern bool TRANSMISSIVE;
 	extern bool BVH;
 	extern bool BVH_INCLUDE_PLANES;
+	extern bool BVH_FLAT;
+	extern int BVH_WIDTH;
+	extern BVHBuildMethod BVH_BUILD_METHOD;
+	extern int BVH_SAH_BINS;
+	extern float BVH_REBUILD_COST_RATIO;
+	extern bool WORLD_SPACE_TRIANGLES;
+	extern bool SCENE_CACHE;
 	extern bool SCHLICKS_APPROXIMATION;
 	extern bool ANTI_ALIASING;
 	extern bool ANTI_ALIAS_INFINITE_PLANES;
+	extern int ANTI_ALIASING_SAMPLES;
+	extern bool ANTI_ALIASING_ADAPTIVE;
+	extern float ANTI_ALIASING_THRESHOLD;
 	extern bool APPROXIMATE_SHADOWS;
 	extern int APPROXIMATE_SHADOWS_RAY_COUNT;
+	extern bool ADAPTIVE_SHADOWS;
+	extern int ADAPTIVE_SHADOWS_FIRST_BATCH;
+	extern SamplerType SAMPLER;
 	extern int RAYTRACER_DEPTH;
+	extern float RAY_WEIGHT_THRESHOLD;
+	extern bool RUSSIAN_ROULETTE;
+	extern float RUSSIAN_ROULETTE_WEIGHT;
+	extern int RAY_PACKET_SIZE;
+	extern bool WAVEFRONT;
+	extern bool WAVEFRONT_SORT;
+	extern int WAVEFRONT_TILE_SIZE;
+	extern bool HEATMAP;
+	extern int TILE_SIZE;
 }
\ No newline at end of file
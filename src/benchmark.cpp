@@ -0,0 +1,337 @@
+#include "benchmark.h"
+#include "renderer.h"
+#include "json2scene.h"
+#include "Globals.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+static const int RAY_KINDS = (int)statsOps::RayKind::COUNT;
+
+struct BenchmarkOptions {
+	std::vector<std::string> scenes;
+	int width = 256;
+	int height = 256;
+	int repeats = 3;
+	std::string jsonOutput;
+	std::string csvOutput;
+	std::string baseline;
+	double tolerance = 0.1;
+};
+
+// Best time of every phase of one scene, over all repeats
+struct SceneResult {
+	std::string name;
+	double parseMilliseconds = std::numeric_limits<double>::infinity();
+	double conversionMilliseconds = std::numeric_limits<double>::infinity();
+	double bvhBuildMilliseconds = std::numeric_limits<double>::infinity();
+	double traceMilliseconds = std::numeric_limits<double>::infinity();
+	uint64_t rays[RAY_KINDS] = {};
+	statsOps::Counters counters;
+	SceneMemory memory;
+
+	uint64_t totalRays() const { return counters.totalRays(); }
+
+	double raysPerSecond(uint64_t count) const { return count / (traceMilliseconds / 1000.0); }
+};
+
+static void printUsage() {
+	std::cout << "Usage: --benchmark [scene ...] [--width N] [--height N] [--repeats N] [--json results.json] [--csv results.csv]" << std::endl;
+	std::cout << "       [--compare baseline.json] [--tolerance X] [--no-scene-cache]" << std::endl;
+}
+
+static bool parseOptions(int argc, char** argv, BenchmarkOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--width") == 0 && hasValue) {
+			options.width = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--height") == 0 && hasValue) {
+			options.height = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--repeats") == 0 && hasValue) {
+			options.repeats = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--json") == 0 && hasValue) {
+			options.jsonOutput = argv[++i];
+		}
+		else if (strcmp(argv[i], "--csv") == 0 && hasValue) {
+			options.csvOutput = argv[++i];
+		}
+		else if (strcmp(argv[i], "--compare") == 0 && hasValue) {
+			options.baseline = argv[++i];
+		}
+		else if (strcmp(argv[i], "--tolerance") == 0 && hasValue) {
+			options.tolerance = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--no-scene-cache") == 0) {
+			Globals::SCENE_CACHE = false;
+		}
+		else if (argv[i][0] != '-') {
+			options.scenes.push_back(argv[i]);
+		}
+		else {
+			std::cout << "Unknown or incomplete argument " << argv[i] << std::endl;
+			return false;
+		}
+	}
+
+	if (options.width <= 0 || options.height <= 0 || options.repeats <= 0) {
+		std::cout << "Width, height and repeats must be positive" << std::endl;
+		return false;
+	}
+	if (options.tolerance < 0) {
+		std::cout << "Tolerance must not be negative" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Every scenes/*.json, by name
+static std::vector<std::string> findScenes() {
+	std::vector<std::string> scenes;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(PATH, error)) {
+		if (entry.path().extension() == ".json") scenes.push_back(entry.path().stem().string());
+	}
+	std::sort(scenes.begin(), scenes.end());
+	return scenes;
+}
+
+static SceneResult runScene(const std::string& name, const BenchmarkOptions& options) {
+	SceneResult result;
+	result.name = name;
+
+	for (int repeat = 0; repeat < options.repeats; repeat++) {
+		SceneLoadTimes load = choose_scene(name.c_str());
+		result.parseMilliseconds = std::min(result.parseMilliseconds, load.parseMilliseconds);
+		result.conversionMilliseconds = std::min(result.conversionMilliseconds, load.conversionMilliseconds);
+		result.bvhBuildMilliseconds = std::min(result.bvhBuildMilliseconds, load.bvhBuildMilliseconds);
+		result.memory = getSceneMemory();
+
+		setViewport(options.width, options.height);
+		Framebuffer framebuffer(options.width, options.height);
+		auto t0 = std::chrono::high_resolution_clock::now();
+		renderFrame(framebuffer);
+		auto t1 = std::chrono::high_resolution_clock::now();
+		result.traceMilliseconds = std::min(result.traceMilliseconds, std::chrono::duration<double, std::milli>(t1 - t0).count());
+
+		// every repeat traces the same rays
+		result.counters = statsOps::collect();
+		std::copy(result.counters.rays, result.counters.rays + RAY_KINDS, result.rays);
+		unload_scene();
+	}
+	return result;
+}
+
+// The settings that change the work of a frame, so a comparison can tell when the baseline ran something else
+static json settingsToJSON(const BenchmarkOptions& options) {
+	json settings;
+	settings["width"] = options.width;
+	settings["height"] = options.height;
+	settings["repeats"] = options.repeats;
+	settings["threads"] = pool.get_thread_count();
+	settings["bvh"] = !Globals::BVH ? "none" : Globals::BVH_BUILD_METHOD == Globals::BVHBuildMethod::SAH ? "sah" : "median";
+	settings["bvhWidth"] = Globals::BVH_WIDTH;
+	settings["softShadows"] = Globals::APPROXIMATE_SHADOWS ? Globals::APPROXIMATE_SHADOWS_RAY_COUNT : 0;
+	settings["antiAliasing"] = Globals::ANTI_ALIASING ? Globals::ANTI_ALIASING_SAMPLES : 0;
+	settings["maxDepth"] = Globals::RAYTRACER_DEPTH;
+	settings["packets"] = Globals::RAY_PACKET_SIZE;
+	settings["wavefront"] = Globals::WAVEFRONT;
+	settings["sceneCache"] = Globals::SCENE_CACHE;
+	return settings;
+}
+
+static json resultsToJSON(const std::vector<SceneResult>& results, const BenchmarkOptions& options) {
+	json scenes = json::array();
+	for (const SceneResult& result : results) {
+		json scene;
+		scene["name"] = result.name;
+		scene["parseMs"] = result.parseMilliseconds;
+		scene["conversionMs"] = result.conversionMilliseconds;
+		scene["bvhBuildMs"] = result.bvhBuildMilliseconds;
+		scene["traceMs"] = result.traceMilliseconds;
+		for (int kind = 0; kind < RAY_KINDS; kind++) {
+			const char* kindName = statsOps::toString((statsOps::RayKind)kind);
+			scene["rays"][kindName] = result.rays[kind];
+			scene["raysPerSecond"][kindName] = result.raysPerSecond(result.rays[kind]);
+		}
+		scene["raysPerSecond"]["total"] = result.raysPerSecond(result.totalRays());
+		scene["memory"]["triangles"] = result.memory.triangleCount;
+		scene["memory"]["vertices"] = result.memory.vertexCount;
+		scene["memory"]["triangleBytes"] = result.memory.triangleBytes;
+		scene["memory"]["vertexBytes"] = result.memory.vertexBytes;
+		scene["memory"]["objectBytes"] = result.memory.objectBytes;
+		scene["memory"]["materialBytes"] = result.memory.materialBytes;
+		scene["memory"]["bvhBytes"] = result.memory.bvhBytes;
+		scene["memory"]["totalBytes"] = result.memory.totalBytes();
+#if RT_ENABLE_STATS
+		const statsOps::Counters& counters = result.counters;
+		scene["traversal"]["nodeVisits"] = counters.nodeVisits;
+		scene["traversal"]["boxTests"] = counters.boxTests;
+		for (int type = 0; type < statsOps::OBJECT_TYPES; type++) {
+			if (counters.primitiveTests[type] > 0) scene["traversal"]["primitiveTests"][toString((ObjectType)type)] = counters.primitiveTests[type];
+		}
+		scene["traversal"]["leafVisits"] = counters.leafVisits();
+#endif
+		scenes.push_back(scene);
+	}
+
+	json document;
+	document["settings"] = settingsToJSON(options);
+	document["scenes"] = scenes;
+	return document;
+}
+
+static bool writeCSV(const std::string& path, const std::vector<SceneResult>& results) {
+	std::ofstream out(path);
+	if (!out.is_open()) return false;
+
+	out << "scene,parse_ms,conversion_ms,bvh_build_ms,trace_ms";
+	for (int kind = 0; kind < RAY_KINDS; kind++) out << "," << statsOps::toString((statsOps::RayKind)kind) << "_rays";
+	for (int kind = 0; kind < RAY_KINDS; kind++) out << "," << statsOps::toString((statsOps::RayKind)kind) << "_mrays_per_s";
+	out << ",total_mrays_per_s" << std::endl;
+
+	for (const SceneResult& result : results) {
+		out << result.name << "," << result.parseMilliseconds << "," << result.conversionMilliseconds << ","
+			<< result.bvhBuildMilliseconds << "," << result.traceMilliseconds;
+		for (int kind = 0; kind < RAY_KINDS; kind++) out << "," << result.rays[kind];
+		for (int kind = 0; kind < RAY_KINDS; kind++) out << "," << result.raysPerSecond(result.rays[kind]) / 1e6;
+		out << "," << result.raysPerSecond(result.totalRays()) / 1e6 << std::endl;
+	}
+	return true;
+}
+
+static void printResults(const std::vector<SceneResult>& results) {
+	std::cout << std::endl << std::left << std::setw(24) << "scene" << std::right << std::fixed << std::setprecision(2)
+		<< std::setw(10) << "parse ms" << std::setw(12) << "convert ms" << std::setw(10) << "bvh ms" << std::setw(12) << "trace ms";
+	for (int kind = 0; kind < RAY_KINDS; kind++) std::cout << std::setw(12) << statsOps::toString((statsOps::RayKind)kind);
+	std::cout << std::setw(12) << "total" << "   (Mrays/s)" << std::endl;
+
+	for (const SceneResult& result : results) {
+		std::cout << std::left << std::setw(24) << result.name << std::right << std::setw(10) << result.parseMilliseconds
+			<< std::setw(12) << result.conversionMilliseconds << std::setw(10) << result.bvhBuildMilliseconds
+			<< std::setw(12) << result.traceMilliseconds;
+		for (int kind = 0; kind < RAY_KINDS; kind++) std::cout << std::setw(12) << result.raysPerSecond(result.rays[kind]) / 1e6;
+		std::cout << std::setw(12) << result.raysPerSecond(result.totalRays()) / 1e6 << std::endl;
+	}
+	std::cout.unsetf(std::ios::floatfield);
+	std::cout << std::setprecision(6);
+}
+
+/// <summary>
+/// Compares the results with a baseline written by --json and prints every phase that got slower than the tolerance
+/// allows, or faster by as much, and every scene whose ray counts changed
+/// </summary>
+/// <returns>the number of regressions</returns>
+static int compareWithBaseline(const json& baseline, const std::vector<SceneResult>& results, const BenchmarkOptions& options) {
+	if (baseline.find("settings") != baseline.end() && baseline["settings"] != settingsToJSON(options)) {
+		std::cout << "Warning: the baseline was run with other settings: " << baseline["settings"].dump() << std::endl;
+	}
+
+	static const char* phases[] = { "parseMs", "conversionMs", "bvhBuildMs", "traceMs" };
+	const double minimumMilliseconds = 1.0;
+	int regressions = 0;
+
+	std::cout << std::endl << "Compared with " << options.baseline << " (tolerance " << options.tolerance * 100 << "%):" << std::endl;
+	for (const SceneResult& result : results) {
+		const json* baseScene = nullptr;
+		for (const json& scene : baseline["scenes"]) {
+			if (scene.value("name", "") == result.name) baseScene = &scene;
+		}
+		if (baseScene == nullptr) {
+			std::cout << "  " << result.name << ": not in the baseline" << std::endl;
+			continue;
+		}
+
+		double current[] = { result.parseMilliseconds, result.conversionMilliseconds, result.bvhBuildMilliseconds, result.traceMilliseconds };
+		for (int phase = 0; phase < 4; phase++) {
+			double base = baseScene->value(phases[phase], 0.0);
+			double difference = current[phase] - base;
+			if (std::abs(difference) <= std::max(options.tolerance * base, minimumMilliseconds)) continue;
+
+			bool slower = difference > 0;
+			regressions += slower;
+			std::cout << "  " << result.name << ": " << phases[phase] << " " << base << " -> " << current[phase]
+				<< " (" << (slower ? "+" : "") << 100.0 * difference / base << "%)" << (slower ? " REGRESSION" : "") << std::endl;
+		}
+
+		for (int kind = 0; kind < RAY_KINDS; kind++) {
+			const char* kindName = statsOps::toString((statsOps::RayKind)kind);
+			uint64_t base = (*baseScene)["rays"].value(kindName, (uint64_t)0);
+			if (base == result.rays[kind]) continue;
+			regressions++;
+			std::cout << "  " << result.name << ": " << kindName << " rays " << base << " -> " << result.rays[kind] << " REGRESSION" << std::endl;
+		}
+	}
+	std::cout << (regressions == 0 ? "No regressions" : std::to_string(regressions) + " regressions") << std::endl;
+	return regressions;
+}
+
+int runBenchmark(int argc, char** argv) {
+	BenchmarkOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage();
+		return EXIT_FAILURE;
+	}
+
+	// read the baseline first, so a bad path fails before minutes of rendering
+	json baseline;
+	if (!options.baseline.empty()) {
+		std::ifstream in(options.baseline);
+		if (!in.is_open()) {
+			std::cout << "Unable to open baseline " << options.baseline << std::endl;
+			return EXIT_FAILURE;
+		}
+		try {
+			in >> baseline;
+		}
+		catch (const json::exception& e) {
+			std::cout << "Unable to parse baseline " << options.baseline << ": " << e.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (options.scenes.empty()) options.scenes = findScenes();
+	if (options.scenes.empty()) {
+		std::cout << "No scenes found in " << PATH << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<SceneResult> results;
+	for (const std::string& name : options.scenes) {
+		results.push_back(runScene(name, options));
+	}
+
+	std::cout << std::endl << "-----------------------------" << std::endl;
+	std::cout << "Threadpool size: " << pool.get_thread_count() << ", " << options.width << "x" << options.height
+		<< ", best of " << options.repeats << std::endl;
+	printResults(results);
+
+	if (!options.jsonOutput.empty()) {
+		std::ofstream out(options.jsonOutput);
+		if (!out.is_open()) {
+			std::cout << "Unable to write " << options.jsonOutput << std::endl;
+			return EXIT_FAILURE;
+		}
+		out << resultsToJSON(results, options).dump(2) << std::endl;
+	}
+	if (!options.csvOutput.empty() && !writeCSV(options.csvOutput, results)) {
+		std::cout << "Unable to write " << options.csvOutput << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!options.baseline.empty() && compareWithBaseline(baseline, results, options) > 0) {
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
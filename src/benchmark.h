@@ -0,0 +1,19 @@
+#pragma once
+
+/// <summary>
+/// Loads and renders scenes without a window and reports the time of every phase, for regression checks.
+/// Usage: --benchmark [scene ...] [--width N] [--height N] [--repeats N] [--json results.json] [--csv results.csv]
+///        [--compare baseline.json] [--tolerance X] [--no-scene-cache]
+/// Without scene names every scenes/*.json is run. Each scene is loaded and rendered --repeats times (3) at 256x256
+/// by default and the fastest time of every phase is kept: JSON parse, scene conversion, BVH build and tracing.
+/// Once a scene's binary cache exists the parse phase is the time to read it instead, so with more than one repeat
+/// the cached load is what gets reported; --no-scene-cache times the JSON parse every time.
+/// Rays are counted by kind (primary, shadow, reflection, refraction); rays/s of a kind is its count over the
+/// trace time, so the kinds add up to the overall throughput. --json and --csv write the results, the JSON with the
+/// traversal counters of statsOps and the memory held by the scene and its BVH as well. A JSON file written before
+/// can be passed to --compare: a phase taking more than --tolerance (0.1, so 10%) longer than in the baseline, and at
+/// least a millisecond longer, is reported as a regression, as is a changed ray count.
+/// </summary>
+/// <param name="argc">argument count, argv[0] being "--benchmark"</param>
+/// <returns>process exit code, EXIT_FAILURE when --compare found a regression</returns>
+int runBenchmark(int argc, char** argv);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+typedef glm::vec3 colour3;
+
+/// <summary>
+/// In-memory image the ray tracer renders into. Row 0 is the bottom scanline, matching s(x, y).
+/// </summary>
+struct Framebuffer {
+	int width;
+	int height;
+	std::vector<colour3> pixels;
+
+	Framebuffer() : width(0), height(0) {}
+	Framebuffer(int _width, int _height) : width(_width), height(_height), pixels((size_t)_width * _height, colour3(0)) {}
+
+	colour3& at(int x, int y) { return pixels[(size_t)y * width + x]; }
+	const colour3& at(int x, int y) const { return pixels[(size_t)y * width + x]; }
+};
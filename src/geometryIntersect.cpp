@@ -1,90 +1,156 @@
 #include "geometryIntersect.h"
+#include "stats.h"
+#include "BVH/BVH.h"
 #include <tuple>
+#include <limits>
 #include <glm/glm.hpp>
 #include <glm/gtx/quaternion.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtx/string_cast.hpp>
 
-std::tuple<float, Object*, Vector, Vertex> rayIntersectObjects(const Vertex& e, const Vector& d, std::vector<Object*> objects, float minT) {
+bool rayIntersectObject(const Ray& ray, Object* object, float& t, Vector& normal, Vertex& intersection) {
+	switch (object->type) {
+	case ObjectType::TRIANGLE: {
+		Triangle* triangle = (Triangle*)(object);
+		triangleOps::TriangleIntersectResult result;
+		if (triangleOps::rayIntersects(ray, triangle, result)) {
+			t = result.t;
+			normal = result.normal;
+			intersection = result.intersection;
+			return true;
+		}
+		break;
+	}
+	case ObjectType::SPHERE: {
+		Sphere* sphere = (Sphere*)(object);
+		sphereOps::SphereIntersectResult result;
+		if (sphereOps::rayIntersects(ray, sphere, result)) {
+			t = result.t_near;
+			normal = result.normal_near;
+			intersection = result.intersection_near;
+			return true;
+		}
+		break;
+	}
+	case ObjectType::CYLINDER: {
+		Cylinder* cylinder = (Cylinder*)(object);
+		cylinderOps::CylinderIntersectResult result;
+		if (cylinderOps::rayIntersects(ray, cylinder, result)) {
+			t = result.t;
+			normal = result.normal;
+			intersection = result.intersection;
+			return true;
+		}
+		break;
+	}
+	case ObjectType::PLANE: {
+		Plane* plane = (Plane*)(object);
+		planeOps::PlaneIntersectResult result;
+		if (planeOps::rayIntersects(ray, plane, result)) {
+			t = result.t;
+			normal = result.normal;
+			intersection = result.intersection;
+			return true;
+		}
+		break;
+	}
+	case ObjectType::MESH: {
+		Mesh* mesh = (Mesh*)(object);
+		meshOps::MeshRayIntersectResult result;
+		if (meshOps::rayIntersects(ray, mesh, result)) {
+			t = result.t;
+			normal = result.normal;
+			intersection = result.intersection;
+			return true;
+		}
+		break;
+	}
+	case ObjectType::INSTANCE: {
+		Instance* instance = (Instance*)(object);
+		instanceOps::InstanceIntersectResult result;
+		if (instanceOps::rayIntersects(ray, instance, result)) {
+			t = result.t;
+			normal = result.normal;
+			intersection = result.intersection;
+			return true;
+		}
+		break;
+	}
+	}
+	return false;
+}
+
+std::tuple<float, Object*, Vector, Vertex> rayIntersectObjects(Ray ray, const std::vector<Object*>& objects) {
 	float best_t = std::numeric_limits<float>::infinity();
 	Object* bestObj = NULL;
 	Vector bestNormal;
 	Vertex bestIntersectionPoint;
 
+	RT_STATS(statsOps::Counters& stats = statsOps::local());
 	for (auto&& object : objects) {
-		if (object->type == "triangle") {
-			Triangle* triangle = (Triangle*)(object);
-			planeOps::PlaneIntersectResult result;
-			if (planeOps::raytriangleIntersect(e, d, triangle, result, minT)) {
-				if (result.t > minT && result.t < best_t) {
-					best_t = result.t;
-					bestObj = object;
-					bestIntersectionPoint = result.intersection;
-					bestNormal = result.normal;
-				}
-			}
-		}
-		else if (object->type == "sphere") {
-			Sphere* sphere = (Sphere*)(object);
-			sphereOps::SphereIntersectResult result;
-			if (sphereOps::rayIntersects(e, d, sphere, result, minT)) {
-				if (result.t_near > minT && result.t_near < best_t) {
-					best_t = result.t_near;
-					bestObj = object;
-					bestNormal = result.normal_near;
-					bestIntersectionPoint = result.intersection_near;
-				}
-			}
-		}
-		else if (object->type == "cylinder") {
-			Cylinder* cylinder = (Cylinder*)(object);
-			cylinderOps::CylinderIntersectResult result;
-			if (cylinderOps::rayIntersects(e, d, cylinder, result, minT)) {
-				if (result.t > minT && result.t < best_t) {
-					best_t = result.t;
-					bestObj = object;
-					bestNormal = result.normal;
-					bestIntersectionPoint = result.intersection;
-				}
-			}
-		}
-		else if (object->type == "plane") {
-			Plane* plane = (Plane*)(object);
-			planeOps::PlaneIntersectResult result;
-			if (planeOps::rayIntersects(e, d, plane, result, minT)) {
-				if (result.t > minT && result.t < best_t) {
-					best_t = result.t;
-					bestObj = object;
-					bestNormal = result.normal;
-					bestIntersectionPoint = result.intersection;
-				}
-			}
-		}
-		else if (object->type == "mesh") {
-			Mesh* mesh = (Mesh*)(object);
-			meshOps::MeshRayIntersectResult result;
-			if (meshOps::rayIntersects(e, d, mesh, result, minT)) {
-				if (result.t > minT && result.t < best_t) {
-					best_t = result.t;
-					bestObj = object;
-					bestIntersectionPoint = result.intersection;
-					bestNormal = result.normal;
-				}
-			}
+		float t;
+		Vector normal;
+		Vertex intersection;
+		RT_STATS(statsOps::countPrimitiveTest(stats, object->type));
+		if (rayIntersectObject(ray, object, t, normal, intersection)) {
+			best_t = t;
+			ray.tMax = t;
+			bestObj = object;
+			bestNormal = normal;
+			bestIntersectionPoint = intersection;
 		}
 	}
 
 	return { best_t, bestObj, bestNormal, bestIntersectionPoint };
 }
 
+bool rayOccludedByObject(const Ray& ray, Object* object) {
+	switch (object->type) {
+	case ObjectType::TRIANGLE: return triangleOps::rayOccluded(ray, (Triangle*)(object));
+	case ObjectType::SPHERE: return sphereOps::rayOccluded(ray, (Sphere*)(object));
+	case ObjectType::CYLINDER: return cylinderOps::rayOccluded(ray, (Cylinder*)(object));
+	case ObjectType::PLANE: return planeOps::rayOccluded(ray, (Plane*)(object));
+	case ObjectType::MESH: return meshOps::rayOccluded(ray, (Mesh*)(object));
+	case ObjectType::INSTANCE: return instanceOps::rayOccluded(ray, (Instance*)(object));
+	}
+	return false;
+}
+
+bool rayOccluded(const Ray& ray, const std::vector<Object*>& objects, bool ignorePlanes) {
+	RT_STATS(statsOps::Counters& stats = statsOps::local());
+	for (auto&& object : objects) {
+		if (ignorePlanes && object->type == ObjectType::PLANE) continue;
+		RT_STATS(statsOps::countPrimitiveTest(stats, object->type));
+		if (rayOccludedByObject(ray, object)) return true;
+	}
+	return false;
+}
+
 // ***************************************************************************************************************** //
 // Sphere operations
 // ***************************************************************************************************************** //
 
-bool sphereOps::rayIntersects(const Vertex& e, const Vector& d, Sphere* sphere, sphereOps::SphereIntersectResult& result, float minT) {
-	glm::mat4 transformInverse = glm::inverse(sphere->transformations);
-	Vertex transformedRayOrigin = transformInverse * glm::vec4(e, 1.0f);
-	Vector transformedRayDir = transformInverse * glm::vec4(d, 0.0f);
+bool sphereOps::rayOccluded(const Ray& ray, Sphere* sphere) {
+	const glm::mat4& transformInverse = sphere->inverseTransformations;
+	Vertex transformedRayOrigin = transformInverse * glm::vec4(ray.origin, 1.0f);
+	Vector transformedRayDir = transformInverse * glm::vec4(ray.direction, 0.0f);
+
+	float dd = glm::dot(transformedRayDir, transformedRayDir);
+	float b = glm::dot(transformedRayDir, transformedRayOrigin);
+	float discriminant = b * b - dd * (glm::dot(transformedRayOrigin, transformedRayOrigin) - sphere->radius * sphere->radius);
+	if (discriminant < 0) return false;
+
+	float sqrt = glm::sqrt(discriminant);
+	float t0 = (-b - sqrt) / dd;
+	float t1 = (-b + sqrt) / dd;
+	return (t0 > ray.tMin && t0 < ray.tMax) || (t1 > ray.tMin && t1 < ray.tMax);
+}
+
+bool sphereOps::rayIntersects(const Ray& ray, Sphere* sphere, sphereOps::SphereIntersectResult& result) {
+	const glm::mat4& transformInverse = sphere->inverseTransformations;
+	Vertex transformedRayOrigin = transformInverse * glm::vec4(ray.origin, 1.0f);
+	Vector transformedRayDir = transformInverse * glm::vec4(ray.direction, 0.0f);
+	float minT = ray.tMin;
 
 	Vertex c = Vertex(0,0,0);
 	float r = sphere->radius;
@@ -111,9 +177,10 @@ bool sphereOps::rayIntersects(const Vertex& e, const Vector& d, Sphere* sphere,
 			else if (t1 > minT && t1 <= t0) result.t_near = t1;
 			else if (t0 > minT) result.t_near = t0;
 			else result.t_near = t1;
+			if (result.t_near <= minT || result.t_near >= ray.tMax) return false;
 
 			Vertex intersectionModelSpace = transformedRayOrigin + transformedRayDir * result.t_near;
-			Vector normalModelSpace = glm::normalize(sphere->transformations * glm::vec4(intersectionModelSpace, 0));
+			Vector normalModelSpace = glm::normalize(sphere->normalTransformations * intersectionModelSpace);
 			Vertex intersectionWorldSpace = sphere->transformations * glm::vec4(intersectionModelSpace,1);
 
 			result.intersection_near = intersectionWorldSpace;
@@ -128,14 +195,14 @@ bool sphereOps::rayIntersects(const Vertex& e, const Vector& d, Sphere* sphere,
 // Plane operations
 // ***************************************************************************************************************** //
 
-bool planeOps::rayIntersects(const Vertex& e, const Vector& d, Plane* plane, planeOps::PlaneIntersectResult& result, float minT)
+bool planeOps::rayIntersects(const Ray& ray, Plane* plane, planeOps::PlaneIntersectResult& result)
 {
-	float denom = glm::dot(plane->normal, d);
+	float denom = glm::dot(plane->normal, ray.direction);
 	if (denom == 0) return false;
-	float t = glm::dot(plane->normal, plane->position - e) / denom;
+	float t = glm::dot(plane->normal, plane->position - ray.origin) / denom;
 
-	if (t > minT) {
-		result.intersection = e + t * d;
+	if (t > ray.tMin && t < ray.tMax) {
+		result.intersection = ray.at(t);
 		result.normal = plane->normal;
 		result.t = t;
 		return true;
@@ -145,14 +212,22 @@ bool planeOps::rayIntersects(const Vertex& e, const Vector& d, Plane* plane, pla
 	}
 }
 
-bool planeOps::rayIntersects(const Vertex& e, const Vector& d, const Vector& n, const Vertex& a, planeOps::PlaneIntersectResult& result, float minT)
+bool planeOps::rayOccluded(const Ray& ray, Plane* plane)
+{
+	float denom = glm::dot(plane->normal, ray.direction);
+	if (denom == 0) return false;
+	float t = glm::dot(plane->normal, plane->position - ray.origin) / denom;
+	return t > ray.tMin && t < ray.tMax;
+}
+
+bool planeOps::rayIntersects(const Ray& ray, const Vector& n, const Vertex& a, planeOps::PlaneIntersectResult& result)
 {
-	float denom = glm::dot(n, d);
+	float denom = glm::dot(n, ray.direction);
 	if (denom == 0) return false;
-	float t = glm::dot(n, a - e) / denom;
+	float t = glm::dot(n, a - ray.origin) / denom;
 
-	if (t > minT) {
-		result.intersection = e + t * d;
+	if (t > ray.tMin && t < ray.tMax) {
+		result.intersection = ray.at(t);
 		result.normal = n;
 		result.t = t;
 		return true;
@@ -162,104 +237,124 @@ bool planeOps::rayIntersects(const Vertex& e, const Vector& d, const Vector& n,
 	}
 }
 
-bool planeOps::raytriangleIntersect(const Vertex& e, const Vector& d, Triangle* triangle, PlaneIntersectResult& result, float minT)
+// ***************************************************************************************************************** //
+// Triangle operations
+// Moller-Trumbore ray-triangle intersection source:
+// https://www.graphics.cornell.edu/pubs/1997/MT97.pdf
+// ***************************************************************************************************************** //
+
+bool triangleOps::rayIntersects(const Ray& ray, const Triangle& triangle, float& t, float& u, float& v)
 {
-	glm::mat4 transformInverse = glm::inverse(triangle->parent_mesh->transformations);
-	Vertex transformedRayOrigin = transformInverse * glm::vec4(e, 1.0f);
-	Vector transformedRayDir = transformInverse * glm::vec4(d, 0.0f);
+	const Vertex& v0 = triangle.vertex(0);
+	Vector e1 = triangle.vertex(1) - v0;
+	Vector e2 = triangle.vertex(2) - v0;
 
-	Vertex a = triangle->vertices[0];
-	Vertex b = triangle->vertices[1];
-	Vertex c = triangle->vertices[2];
+	Vector p = glm::cross(ray.direction, e2);
+	float det = glm::dot(e1, p);
+	if (det == 0.0f) return false; // ray is parallel to the triangle
 
-	auto normal = -glm::normalize(glm::cross((c - b), (b - a)));
+	float invDet = 1.0f / det;
+	Vector s = ray.origin - v0;
+	u = glm::dot(s, p) * invDet;
+	if (u < 0.0f || u > 1.0f) return false;
 
-	planeOps::PlaneIntersectResult planeResult;
-	if (!planeOps::rayIntersects(transformedRayOrigin, transformedRayDir, normal, a, planeResult, minT)) {
-		return false;
-	}
+	Vector q = glm::cross(s, e1);
+	v = glm::dot(ray.direction, q) * invDet;
+	if (v < 0.0f || u + v > 1.0f) return false;
 
-	float t = planeResult.t;
-	Vertex point = planeResult.intersection;
-	std::vector<double> inTriangleTest =
-	{
-		glm::dot(glm::cross((b - a), (point - a)), normal),
-		glm::dot(glm::cross((c - b), (point - b)), normal),
-		glm::dot(glm::cross((a - c), (point - c)), normal)
-	};
+	t = glm::dot(e2, q) * invDet;
+	return t > ray.tMin && t < ray.tMax;
+}
 
-	if (inTriangleTest[0] > 0 && inTriangleTest[1] > 0 && inTriangleTest[2] > 0) {
-		if (t < minT)
-		{
-			return false;
-		}
-		else {
-			result.t = t;
-			result.normal = triangle->parent_mesh->transformations * glm::vec4(normal,0);
-			result.intersection = triangle->parent_mesh->transformations * glm::vec4(point,1);
-			return true;
-		}
+bool triangleOps::rayIntersects(const Ray& ray, Triangle* triangle, TriangleIntersectResult& result)
+{
+	Mesh* mesh = triangle->parent_mesh;
+	if (mesh->worldSpace) {
+		if (!triangleOps::rayIntersects(ray, *triangle, result.t, result.u, result.v)) return false;
+		result.normal = triangle->normal();
+		result.intersection = ray.at(result.t);
+		return true;
 	}
 
-	return false;
+	Ray transformedRay = ray.transformed(mesh->inverseTransformations);
+	if (!triangleOps::rayIntersects(transformedRay, *triangle, result.t, result.u, result.v)) return false;
+	result.normal = glm::normalize(mesh->normalTransformations * triangle->normal());
+	result.intersection = mesh->transformations * glm::vec4(transformedRay.at(result.t), 1);
+	return true;
+}
+
+bool triangleOps::rayOccluded(const Ray& ray, Triangle* triangle)
+{
+	float t, u, v;
+	Mesh* mesh = triangle->parent_mesh;
+	if (mesh->worldSpace) return triangleOps::rayIntersects(ray, *triangle, t, u, v);
+	return triangleOps::rayIntersects(ray.transformed(mesh->inverseTransformations), *triangle, t, u, v);
 }
 
 // ***************************************************************************************************************** //
 // Mesh operations
 // ***************************************************************************************************************** //
 
-bool meshOps::rayIntersects(const Vertex& e, const Vector& d, Mesh* mesh, meshOps::MeshRayIntersectResult& result, float minT)
+bool meshOps::rayIntersects(const Ray& ray, Mesh* mesh, meshOps::MeshRayIntersectResult& result)
 {
-	glm::mat4 transformInverse = glm::inverse(mesh->transformations);
-	Vertex transformedRayOrigin = transformInverse * glm::vec4(e, 1.0f);
-	Vector transformedRayDir = transformInverse * glm::vec4(d, 0.0f);
+	Ray transformedRay = ray.transformed(mesh->inverseTransformations);
 
 	bool intersects = false;
 	float bestMeshTriangleT = std::numeric_limits<float>::infinity();
-	Vector bestMeshTriangleN;
+	const Triangle* bestMeshTriangle = nullptr;
 	Vertex bestMeshTriangleIntersection;
 
 	for (auto&& triangle : mesh->triangles)
 	{
-		Vertex a = triangle.vertices[0];
-		Vertex b = triangle.vertices[1];
-		Vertex c = triangle.vertices[2];
-
-		auto normal = -glm::normalize(glm::cross((c - b), (b - a)));
-
-		planeOps::PlaneIntersectResult planeResult;
-		if (!planeOps::rayIntersects(transformedRayOrigin, transformedRayDir, normal, a, planeResult, minT)) {
-			continue;
-		}
-		float t = planeResult.t;
-		Vertex point = planeResult.intersection;
-
-		std::vector<double> inTriangleTest =
-		{
-			glm::dot(glm::cross((b - a), (point - a)), normal),
-			glm::dot(glm::cross((c - b), (point - b)), normal),
-			glm::dot(glm::cross((a - c), (point - c)), normal)
-		};
-
-		if (inTriangleTest[0] > 0 && inTriangleTest[1] > 0 && inTriangleTest[2] > 0) {
-			if (t < minT || t > bestMeshTriangleT)
-			{
-				continue;
-			}
-			else {
-				intersects = true;
-				bestMeshTriangleT = t;
-				bestMeshTriangleN = normal;
-				bestMeshTriangleIntersection = point;
-			}
+		float t, u, v;
+		if (triangleOps::rayIntersects(transformedRay, triangle, t, u, v)) {
+			intersects = true;
+			bestMeshTriangleT = t;
+			transformedRay.tMax = t;
+			bestMeshTriangle = &triangle;
 		}
 	}
+	if (!intersects) return false;
+	bestMeshTriangleIntersection = transformedRay.at(bestMeshTriangleT);
 
-	result.normal = mesh->transformations * glm::vec4(bestMeshTriangleN,0);
+	result.normal = glm::normalize(mesh->normalTransformations * bestMeshTriangle->normal());
 	result.intersection = mesh->transformations * glm::vec4(bestMeshTriangleIntersection,1);
 	result.t = bestMeshTriangleT;
 
-	return intersects;
+	return true;
+}
+
+bool meshOps::rayOccluded(const Ray& ray, Mesh* mesh)
+{
+	Ray transformedRay = ray.transformed(mesh->inverseTransformations);
+	for (auto&& triangle : mesh->triangles)
+	{
+		float t, u, v;
+		if (triangleOps::rayIntersects(transformedRay, triangle, t, u, v)) return true;
+	}
+	return false;
+}
+
+// ***************************************************************************************************************** //
+// Instance operations
+// ***************************************************************************************************************** //
+
+bool instanceOps::rayIntersects(const Ray& ray, Instance* instance, instanceOps::InstanceIntersectResult& result)
+{
+	// t carries over between the spaces, so the closest hit found in the mesh's BVH is the closest in world space
+	Ray transformedRay = ray.transformed(instance->inverseTransformations);
+	std::tuple<float, Object*, Vector, Vertex> hit = instance->meshBVH->intersectBVH(transformedRay);
+	if (std::get<1>(hit) == nullptr) return false;
+
+	result.t = std::get<0>(hit);
+	result.normal = glm::normalize(instance->normalTransformations * std::get<2>(hit));
+	result.intersection = instance->transformations * glm::vec4(std::get<3>(hit), 1);
+	return true;
+}
+
+bool instanceOps::rayOccluded(const Ray& ray, Instance* instance)
+{
+	return instance->meshBVH->occludedBVH(ray.transformed(instance->inverseTransformations));
 }
 
 // ***************************************************************************************************************** //
@@ -268,11 +363,17 @@ bool meshOps::rayIntersects(const Vertex& e, const Vector& d, Mesh* mesh, meshOp
 // https://www.cl.cam.ac.uk/teaching/1999/AGraphHCI/SMAG/node2.html#eqn:rectray
 // ***************************************************************************************************************** //
 
-bool cylinderOps::rayIntersects(const Vertex& e, const Vector& d, Cylinder* cylinder, CylinderIntersectResult& result, float mint) 
+// Which surface of the cylinder a hit is on
+enum class CylinderSurface { BODY, TOP_CAP, BOTTOM_CAP };
+
+// Nearest hit of a model space ray with the cylinder, shared by the closest hit and occlusion queries.
+// The point is in model space, t is infinity on a miss.
+static float cylinderNearestHit(const Ray& transformedray, Cylinder* cylinder, Vertex& point, CylinderSurface& surface)
 {
-	glm::mat4 transforminverse = glm::inverse(cylinder->transformations);
-	Vertex transformedrayorigin = transforminverse * glm::vec4(e, 1.0f);
-	Vector transformedraydir = transforminverse  * glm::vec4(d, 0.0f);
+	const Vertex& transformedrayorigin = transformedray.origin;
+	const Vector& transformedraydir = transformedray.direction;
+	float mint = transformedray.tMin;
+	const float miss = std::numeric_limits<float>::infinity();
 
 	// calculate the quadratic coefficients for the intersection equation
 	float a = glm::pow(transformedraydir.x, 2.0f) + glm::pow(transformedraydir.z, 2.0f);
@@ -282,14 +383,14 @@ bool cylinderOps::rayIntersects(const Vertex& e, const Vector& d, Cylinder* cyli
 	// solve the quadratic equation to find the intersection points
 	float discriminant = b * b - 4.0f * a * c;
 	
-	if (discriminant < 0.0f) return false; //no solution
+	if (discriminant < 0.0f) return miss; //no solution
 
 	float sqrtdiscriminant = glm::sqrt(discriminant);
 	float t1 = (-b - sqrtdiscriminant) / (2.0f * a);
 	float t2 = (-b + sqrtdiscriminant) / (2.0f * a);
 
 	if (t1 < mint && t2 < mint) {
-		return false;
+		return miss;
 	}
 	if (t1 < mint || t2 < mint) {
 		float maxt = glm::max(t1, t2);
@@ -297,7 +398,8 @@ bool cylinderOps::rayIntersects(const Vertex& e, const Vector& d, Cylinder* cyli
 		t2 = maxt;
 	}
 
-	result.t = std::numeric_limits<float>::infinity();
+	float t;
+	surface = CylinderSurface::BODY;
 
 	// check if the intersection points are within the height of the cylinder
 	float miny = -cylinder->height / 2.0f; float maxy = cylinder->height / 2.0f;
@@ -310,57 +412,80 @@ bool cylinderOps::rayIntersects(const Vertex& e, const Vector& d, Cylinder* cyli
 		if (p2.y <= miny || p2.y >= maxy)
 		{
 			// both body intersection points are outside the height of the cylinder
-			return false;
+			return miss;
 		}
 		else {
-			result.t = t2;
-			result.intersection = cylinder->transformations * glm::vec4(p2, 1);
-			result.normal = glm::normalize(cylinder->transformations * glm::vec4(p2.x, 0.0f, p2.z, 0.0f));
+			t = t2;
+			point = p2;
 		}
 	}
 	else {
-		result.t = t1;
-		result.intersection = cylinder->transformations * glm::vec4(p1, 1);
-		result.normal = glm::normalize(cylinder->transformations * glm::vec4(p1.x, 0.0f, p1.z, 0.0f));
+		t = t1;
+		point = p1;
 	}
 
 	Vector topcapnormal = Vector(0.0f, 1.0f, 0.0f), bottomcapnormal = Vector(0.0f, -1.0f, 0.0f);
 	planeOps::PlaneIntersectResult planeresulttop, planeresultbot;
 
 	// check if the intersection points with the caps are within the radius of the cylinder
-	if (planeOps::rayIntersects(transformedrayorigin, transformedraydir, topcapnormal, Vertex(0, cylinder->height / 2.0f, 0), planeresulttop, mint))
+	if (planeOps::rayIntersects(transformedray, topcapnormal, Vertex(0, cylinder->height / 2.0f, 0), planeresulttop))
 	{
-		if (glm::length(glm::vec2(planeresulttop.intersection.x, planeresulttop.intersection.z)) <= cylinder->radius && planeresulttop.t < result.t)
+		if (glm::length(glm::vec2(planeresulttop.intersection.x, planeresulttop.intersection.z)) <= cylinder->radius && planeresulttop.t < t)
 		{
 			// the intersection point with the top cap is within the radius of the cylinder
-			result.t = planeresulttop.t;
-			result.intersection = cylinder->transformations * glm::vec4(planeresulttop.intersection, 1);
-			result.normal = cylinder->transformations * glm::vec4(topcapnormal, 0.0f);
+			t = planeresulttop.t;
+			point = planeresulttop.intersection;
+			surface = CylinderSurface::TOP_CAP;
 		}
 	}
-	if (planeOps::rayIntersects(transformedrayorigin, transformedraydir, bottomcapnormal, Vertex(0, -cylinder->height / 2.0f, 0), planeresultbot, mint))
+	if (planeOps::rayIntersects(transformedray, bottomcapnormal, Vertex(0, -cylinder->height / 2.0f, 0), planeresultbot))
 	{
-		if (glm::length(glm::vec2(planeresultbot.intersection.x, planeresultbot.intersection.z)) <= cylinder->radius && planeresultbot.t < result.t)
+		if (glm::length(glm::vec2(planeresultbot.intersection.x, planeresultbot.intersection.z)) <= cylinder->radius && planeresultbot.t < t)
 		{
 			// the intersection point with the bottom cap is within the radius of the cylinder
-			result.t = planeresultbot.t;
-			result.intersection = cylinder->transformations * glm::vec4(planeresultbot.intersection, 1);
-			result.normal = cylinder->transformations * glm::vec4(bottomcapnormal, 0.0f);
+			t = planeresultbot.t;
+			point = planeresultbot.intersection;
+			surface = CylinderSurface::BOTTOM_CAP;
 		}
 	}
 
+	return t;
+}
+
+bool cylinderOps::rayIntersects(const Ray& ray, Cylinder* cylinder, CylinderIntersectResult& result) 
+{
+	Vertex point;
+	CylinderSurface surface;
+	result.t = cylinderNearestHit(ray.transformed(cylinder->inverseTransformations), cylinder, point, surface);
+	if (!(result.t > ray.tMin && result.t < ray.tMax)) return false;
+
+	Vector normal = surface == CylinderSurface::TOP_CAP ? Vector(0.0f, 1.0f, 0.0f)
+		: surface == CylinderSurface::BOTTOM_CAP ? Vector(0.0f, -1.0f, 0.0f)
+		: Vector(point.x, 0.0f, point.z);
+	result.intersection = cylinder->transformations * glm::vec4(point, 1);
+	result.normal = glm::normalize(cylinder->normalTransformations * normal);
 	return true;
 }
 
+bool cylinderOps::rayOccluded(const Ray& ray, Cylinder* cylinder)
+{
+	Vertex point;
+	CylinderSurface surface;
+	float t = cylinderNearestHit(ray.transformed(cylinder->inverseTransformations), cylinder, point, surface);
+	return t > ray.tMin && t < ray.tMax;
+}
+
 
 // ***************************************************************************************************************** //
 // AABB operations
 // AA Box intersection source:
 // ***************************************************************************************************************** //
 //https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-box-intersection.html
-bool AABBOps::rayIntersects(const Vertex& e, const Vector& d, BVHBoundingBox* bbox, AABBIntersectResult& result, float minT)
+bool AABBOps::rayIntersects(const Ray& ray, BVHBoundingBox* bbox, AABBIntersectResult& result)
 {
-	Vector invRayDir = 1.0f / d;
+	const Vertex& e = ray.origin;
+	const Vector& invRayDir = ray.invDirection;
+	float minT = ray.tMin;
 
 	// Compute t-values for intersection with each face of AABB
 	Vertex aabbMin = Vertex(bbox->get_x_min(), bbox->get_y_min(), bbox->get_z_min());
@@ -376,9 +501,12 @@ bool AABBOps::rayIntersects(const Vertex& e, const Vector& d, BVHBoundingBox* bb
 	float tNear = glm::max(glm::max(t1.x, t1.y), t1.z);
 
 	// Find the minimum of the maximum t-values
-	float tFar = glm::min(glm::min(t2.x, t2.y), t2.z);
+	// widened by its rounding error like BVHFlatTree::boxIntersects, so a hit on the edge of a primitive is not culled by its own box
+	const float gamma3 = 3.0f * std::numeric_limits<float>::epsilon() * 0.5f / (1.0f - 3.0f * std::numeric_limits<float>::epsilon() * 0.5f);
+	float tFar = glm::min(glm::min(t2.x, t2.y), t2.z) * (1.0f + 2.0f * gamma3);
 
-	if (tFar < tNear || (tNear < minT && tFar < minT))
+	// the box is missed, behind the ray, or past the closest hit found so far
+	if (tFar < tNear || (tNear < minT && tFar < minT) || tNear > ray.tMax)
 	{
 		return false;
 	}
@@ -392,7 +520,7 @@ bool AABBOps::rayIntersects(const Vertex& e, const Vector& d, BVHBoundingBox* bb
 		result.t = tNear;
 	}
 
-	result.intersection = e + result.t * d;
+	result.intersection = ray.at(result.t);
 
 	return true;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <iostream>
 
 #include "schema.h"
+#include "ray.h"
 #include "BVH/BVHBoundingBox.h"
 
 typedef glm::vec3 point3;
@@ -12,10 +13,8 @@ typedef glm::vec3 colour3;
 /// <summary>
 /// Find if this ray intersects with any objects in the scene and returns any relavant information
 /// </summary>
-/// <param name="e">= Ray origin</param>
-/// <param name="d">= Ray directional vector</param>
-/// <param name="scene">= Scene with objects</param>
-/// <param name="minT"> = t values below this will not be considered intersections</param>
+/// <param name="ray">= Ray, only hits inside (ray.tMin, ray.tMax) are considered</param>
+/// <param name="objects">= Objects to test</param>
 /// <returns>
 /// A tuple containing the following values from index 0 to 3: 
 /// float t value, 
@@ -23,11 +22,31 @@ typedef glm::vec3 colour3;
 /// Vector intersection normal, 
 /// Vertex intersection point.
 /// </returns>
-std::tuple<float, Object*, Vector, Vertex> rayIntersectObjects(const Vertex& e, const Vector& d, std::vector<Object*> obects, float minT);
+std::tuple<float, Object*, Vector, Vertex> rayIntersectObjects(Ray ray, const std::vector<Object*>& objects);
+
+/// <summary>
+/// Intersects the ray with a single object of any type. The test is not counted, callers count it with
+/// statsOps::countPrimitiveTest on the counters they fetched for the whole query.
+/// </summary>
+/// <param name="t">, normal, intersection = filled in only when the object is hit inside (ray.tMin, ray.tMax)</param>
+/// <returns>true if the object is hit inside (ray.tMin, ray.tMax)</returns>
+bool rayIntersectObject(const Ray& ray, Object* object, float& t, Vector& normal, Vertex& intersection);
+
+/// <summary>
+/// Any hit query for shadow rays: stops at the first object hit inside (ray.tMin, ray.tMax), and never computes normals or intersection points
+/// </summary>
+/// <param name="ignorePlanes">= infinite planes do not occlude, used for directional lights</param>
+/// <returns>true if any of the objects is hit inside (ray.tMin, ray.tMax)</returns>
+bool rayOccluded(const Ray& ray, const std::vector<Object*>& objects, bool ignorePlanes = false);
+
+/// <summary>
+/// Any hit query against a single object of any type, see rayOccluded. Not counted, see rayIntersectObject.
+/// </summary>
+bool rayOccludedByObject(const Ray& ray, Object* object);
 
 struct IntersectionResult {
-    std::string type;
-    IntersectionResult(std::string str): type(str){}
+    const char* type;
+    IntersectionResult(const char* str): type(str){}
 };
 
 namespace AABBOps {
@@ -40,7 +59,7 @@ namespace AABBOps {
         {}
     };
 
-    bool rayIntersects(const Vertex& e, const Vector& d, BVHBoundingBox* bbox, AABBIntersectResult& result, float minT);
+    bool rayIntersects(const Ray& ray, BVHBoundingBox* bbox, AABBIntersectResult& result);
 }
 
 namespace cylinderOps {
@@ -54,7 +73,8 @@ namespace cylinderOps {
         {}
     };
 
-    bool rayIntersects(const Vertex& e, const Vector& d, Cylinder* cylinder, CylinderIntersectResult& result, float minT);
+    bool rayIntersects(const Ray& ray, Cylinder* cylinder, CylinderIntersectResult& result);
+    bool rayOccluded(const Ray& ray, Cylinder* cylinder);
 }
 
 namespace sphereOps {
@@ -68,7 +88,8 @@ namespace sphereOps {
         {}
     };
 
-    bool rayIntersects(const Vertex& e, const Vector& d, Sphere* sphere, SphereIntersectResult& result, float minT);
+    bool rayIntersects(const Ray& ray, Sphere* sphere, SphereIntersectResult& result);
+    bool rayOccluded(const Ray& ray, Sphere* sphere);
 }
 
 namespace planeOps {
@@ -82,9 +103,38 @@ namespace planeOps {
         {}
     };
 
-    bool rayIntersects(const Vertex& e, const Vector& d, Plane* plane, PlaneIntersectResult& result, float minT);
-    bool rayIntersects(const Vertex& e, const Vector& d, const Vector& n, const Vertex& a, PlaneIntersectResult& result, float minT);
-    bool raytriangleIntersect(const Vertex& e, const Vector& d, Triangle* triangle, PlaneIntersectResult& result, float minT);
+    bool rayIntersects(const Ray& ray, Plane* plane, PlaneIntersectResult& result);
+    bool rayIntersects(const Ray& ray, const Vector& n, const Vertex& a, PlaneIntersectResult& result);
+    bool rayOccluded(const Ray& ray, Plane* plane);
+}
+
+namespace triangleOps {
+    struct TriangleIntersectResult : IntersectionResult
+    {
+        Vertex intersection;
+        Vector normal;
+        float t;
+        // barycentric weights of vertices[1] and vertices[2]
+        float u;
+        float v;
+
+        TriangleIntersectResult() : IntersectionResult("triangle"), t(-1), u(0), v(0)
+        {}
+    };
+
+    /// <summary>
+    /// Allocation free Moller-Trumbore test against the triangle's precomputed edges, in the space of its vertices.
+    /// Both sides of the triangle are hit.
+    /// </summary>
+    /// <param name="t">, u, v = ray parameter and barycentric weights of vertices[1] and vertices[2]</param>
+    /// <returns>true if the triangle is hit inside (ray.tMin, ray.tMax)</returns>
+    bool rayIntersects(const Ray& ray, const Triangle& triangle, float& t, float& u, float& v);
+
+    /// <summary>
+    /// World space ray against a triangle, transformed into its mesh's space unless the mesh is baked into world space
+    /// </summary>
+    bool rayIntersects(const Ray& ray, Triangle* triangle, TriangleIntersectResult& result);
+    bool rayOccluded(const Ray& ray, Triangle* triangle);
 }
 
 
@@ -99,5 +149,24 @@ namespace meshOps {
         {}
     };
 
-	bool rayIntersects(const Vertex& e, const Vector& d, Mesh* mesh, MeshRayIntersectResult& result, float minT);
+	bool rayIntersects(const Ray& ray, Mesh* mesh, MeshRayIntersectResult& result);
+	bool rayOccluded(const Ray& ray, Mesh* mesh);
+}
+
+namespace instanceOps {
+    struct InstanceIntersectResult : IntersectionResult
+    {
+        Vertex intersection;
+        Vector normal;
+        float t;
+
+        InstanceIntersectResult() : IntersectionResult("instance"), t(-1)
+        {}
+    };
+
+    /// <summary>
+    /// World space ray against the BVH of the instance's mesh, taken into the mesh's space by the inverse transformations
+    /// </summary>
+    bool rayIntersects(const Ray& ray, Instance* instance, InstanceIntersectResult& result);
+    bool rayOccluded(const Ray& ray, Instance* instance);
 }
\ No newline at end of file
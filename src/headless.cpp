@@ -0,0 +1,490 @@
+#include "headless.h"
+#include "renderer.h"
+#include "imageWriter.h"
+#include "Globals.h"
+#include "BVH/BVH.h"
+#include "lightingOperations.h"
+#include "wavefront.h"
+#include "stats.h"
+#include "heatmap.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include <glm/gtc/constants.hpp>
+
+struct HeadlessOptions {
+	const char* scene = NULL;
+	int width = 512;
+	int height = 512;
+	std::string output;
+	std::string tileStats;
+	int frames = 1;
+	bool bvhBenchmark = false;
+};
+
+static void printUsage() {
+	std::cout << "Usage: --headless <scene> [--width N] [--height N] [--output file.png|.ppm|.exr]" << std::endl;
+	std::cout << "       [--tile-size N] [--tile-stats timings.csv] [--bvh median|sah] [--sah-bins N] [--bvh-width 2|4|8]" << std::endl;
+	std::cout << "       [--soft-shadows N] [--adaptive-shadows N] [--aa N] [--aa-mode adaptive|full] [--aa-threshold X] [--sampler random|sobol]" << std::endl;
+	std::cout << "       [--max-depth N] [--ray-weight X] [--russian-roulette] [--packets 0|4|8|16]" << std::endl;
+	std::cout << "       [--wavefront sorted|unsorted] [--heatmap] [--no-scene-cache] [--frames N] [--bvh-rebuild-ratio X] [--bvh-benchmark]" << std::endl;
+}
+
+static bool parseOptions(int argc, char** argv, HeadlessOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--width") == 0 && hasValue) {
+			options.width = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--height") == 0 && hasValue) {
+			options.height = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--output") == 0 && hasValue) {
+			options.output = argv[++i];
+		}
+		else if (strcmp(argv[i], "--tile-size") == 0 && hasValue) {
+			Globals::TILE_SIZE = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--tile-stats") == 0 && hasValue) {
+			options.tileStats = argv[++i];
+		}
+		else if (strcmp(argv[i], "--bvh") == 0 && hasValue) {
+			i++;
+			if (strcmp(argv[i], "median") == 0) Globals::BVH_BUILD_METHOD = Globals::BVHBuildMethod::MEDIAN;
+			else if (strcmp(argv[i], "sah") == 0) Globals::BVH_BUILD_METHOD = Globals::BVHBuildMethod::SAH;
+			else {
+				std::cout << "Unknown BVH builder " << argv[i] << std::endl;
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "--sah-bins") == 0 && hasValue) {
+			Globals::BVH_SAH_BINS = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--bvh-width") == 0 && hasValue) {
+			Globals::BVH_WIDTH = atoi(argv[++i]);
+			if (Globals::BVH_WIDTH != 2 && Globals::BVH_WIDTH != 4 && Globals::BVH_WIDTH != 8) {
+				std::cout << "BVH width must be 2, 4 or 8" << std::endl;
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "--soft-shadows") == 0 && hasValue) {
+			Globals::APPROXIMATE_SHADOWS = true;
+			Globals::APPROXIMATE_SHADOWS_RAY_COUNT = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--adaptive-shadows") == 0 && hasValue) {
+			Globals::ADAPTIVE_SHADOWS_FIRST_BATCH = atoi(argv[++i]);
+			Globals::ADAPTIVE_SHADOWS = Globals::ADAPTIVE_SHADOWS_FIRST_BATCH > 0;
+		}
+		else if (strcmp(argv[i], "--aa") == 0 && hasValue) {
+			Globals::ANTI_ALIASING = true;
+			Globals::ANTI_ALIASING_SAMPLES = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--aa-mode") == 0 && hasValue) {
+			i++;
+			if (strcmp(argv[i], "adaptive") == 0) Globals::ANTI_ALIASING_ADAPTIVE = true;
+			else if (strcmp(argv[i], "full") == 0) Globals::ANTI_ALIASING_ADAPTIVE = false;
+			else {
+				std::cout << "Unknown anti-aliasing mode " << argv[i] << std::endl;
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "--aa-threshold") == 0 && hasValue) {
+			Globals::ANTI_ALIASING_THRESHOLD = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--sampler") == 0 && hasValue) {
+			i++;
+			if (strcmp(argv[i], "random") == 0) Globals::SAMPLER = Globals::SamplerType::RANDOM;
+			else if (strcmp(argv[i], "sobol") == 0) Globals::SAMPLER = Globals::SamplerType::SOBOL;
+			else {
+				std::cout << "Unknown sampler " << argv[i] << std::endl;
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "--max-depth") == 0 && hasValue) {
+			Globals::RAYTRACER_DEPTH = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--ray-weight") == 0 && hasValue) {
+			Globals::RAY_WEIGHT_THRESHOLD = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--russian-roulette") == 0) {
+			Globals::RUSSIAN_ROULETTE = true;
+		}
+		else if (strcmp(argv[i], "--packets") == 0 && hasValue) {
+			Globals::RAY_PACKET_SIZE = atoi(argv[++i]);
+			if (Globals::RAY_PACKET_SIZE != 0 && Globals::RAY_PACKET_SIZE != 4 && Globals::RAY_PACKET_SIZE != 8 && Globals::RAY_PACKET_SIZE != 16) {
+				std::cout << "Ray packets must hold 4, 8 or 16 rays, or 0 to trace single rays" << std::endl;
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "--wavefront") == 0 && hasValue) {
+			i++;
+			Globals::WAVEFRONT = true;
+			if (strcmp(argv[i], "sorted") == 0) Globals::WAVEFRONT_SORT = true;
+			else if (strcmp(argv[i], "unsorted") == 0) Globals::WAVEFRONT_SORT = false;
+			else {
+				std::cout << "Unknown wavefront mode " << argv[i] << std::endl;
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "--heatmap") == 0) {
+			Globals::HEATMAP = true;
+		}
+		else if (strcmp(argv[i], "--no-scene-cache") == 0) {
+			Globals::SCENE_CACHE = false;
+		}
+		else if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+			options.frames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--bvh-rebuild-ratio") == 0 && hasValue) {
+			Globals::BVH_REBUILD_COST_RATIO = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--bvh-benchmark") == 0) {
+			options.bvhBenchmark = true;
+		}
+		else if (argv[i][0] != '-' && options.scene == NULL) {
+			options.scene = argv[i];
+		}
+		else {
+			std::cout << "Unknown or incomplete argument " << argv[i] << std::endl;
+			return false;
+		}
+	}
+
+	if (options.width <= 0 || options.height <= 0 || options.frames <= 0) {
+		std::cout << "Width, height and frames must be positive" << std::endl;
+		return false;
+	}
+	if (Globals::APPROXIMATE_SHADOWS_RAY_COUNT <= 0 || Globals::ANTI_ALIASING_SAMPLES < 0) {
+		std::cout << "Soft shadow rays must be positive and anti-aliasing samples not negative" << std::endl;
+		return false;
+	}
+	if (options.output.empty()) {
+		options.output = std::string(options.scene != NULL ? options.scene : "render") + ".png";
+	}
+	return true;
+}
+
+// Output path of one frame of an animation, the frame number going before the extension: c_0003.png for c.png
+static std::string framePath(const std::string& path, int frame) {
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+	char number[16];
+	snprintf(number, sizeof(number), "_%04d", frame);
+	return path.substr(0, dot) + number + path.substr(dot);
+}
+
+/// <summary>
+/// Closest hit queries for the camera rays of the viewport, followed by one cosine weighted bounce off every
+/// primary hit. The bounces make up the incoherent half of the workload.
+/// </summary>
+static std::vector<Ray> generateBenchmarkRays() {
+	std::vector<Ray> rays;
+	for (int y = 0; y < vp_height; y++) {
+		for (int x = 0; x < vp_width; x++) {
+			rays.push_back(Ray(eye, s(x, y) - eye, 1.0f));
+		}
+	}
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	size_t primaryCount = rays.size();
+	for (size_t i = 0; i < primaryCount; i++) {
+		auto result = bvh->intersectBVH(rays[i]);
+		if (std::get<1>(result) == NULL) continue;
+
+		Vector normal = glm::normalize(std::get<2>(result));
+		if (glm::dot(normal, rays[i].direction) > 0) normal = -normal;
+		Vector tangent = glm::normalize(glm::abs(normal.x) > 0.9f ? glm::cross(normal, Vector(0, 1, 0)) : glm::cross(normal, Vector(1, 0, 0)));
+		Vector bitangent = glm::cross(normal, tangent);
+		float r = glm::sqrt(uniform(rng));
+		float phi = 2.0f * glm::pi<float>() * uniform(rng);
+		Vector direction = r * glm::cos(phi) * tangent + r * glm::sin(phi) * bitangent + glm::sqrt(1.0f - r * r) * normal;
+		rays.push_back(Ray(std::get<3>(result), direction, 0.001f));
+	}
+	return rays;
+}
+
+/// <summary>
+/// Traces the benchmark rays through every BVH layout on the pool and prints the throughput of each,
+/// along with the number of rays whose closest hit differs from the flat binary tree.
+/// </summary>
+static void runBVHBenchmark() {
+	bvh->flatTree.flatten(bvh->tree);
+	if (bvh->wideTree4.isEmpty()) bvh->wideTree4.collapse(bvh->tree);
+	if (bvh->wideTree8.isEmpty()) bvh->wideTree8.collapse(bvh->tree);
+
+	std::vector<Ray> rays = generateBenchmarkRays();
+	std::cout << "BVH benchmark: " << rays.size() << " rays, binary nodes: " << bvh->flatTree.getNodeCount()
+		<< ", 4 wide nodes: " << bvh->wideTree4.getNodeCount() << ", 8 wide nodes: " << bvh->wideTree8.getNodeCount()
+		<< ", AVX: " << (cpuSupportsAVX() ? "yes" : "no") << std::endl;
+
+	typedef std::tuple<float, Object*, Vector, Vertex> Hit;
+	auto traceAll = [&rays](const char* name, std::function<void(Ray&, Hit&)> query, std::vector<Hit>& hits) {
+		hits.assign(rays.size(), Hit());
+		const int repeats = 3;
+		double bestSeconds = std::numeric_limits<double>::infinity();
+		for (int repeat = 0; repeat < repeats; repeat++) {
+			auto t0 = std::chrono::high_resolution_clock::now();
+			pool.parallelize_loop((int)rays.size(), [&](const int a, const int b) {
+				for (int i = a; i < b; i++) {
+					std::get<0>(hits[i]) = std::numeric_limits<float>::infinity();
+					std::get<1>(hits[i]) = NULL;
+					// intersect shrinks tMax, so every query gets a fresh copy
+					Ray ray = rays[i];
+					query(ray, hits[i]);
+				}
+			}).wait();
+			auto t1 = std::chrono::high_resolution_clock::now();
+			bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(t1 - t0).count());
+		}
+		std::cout << "  " << name << ": " << (rays.size() / bestSeconds) / 1e6 << " Mrays/s";
+	};
+
+	std::vector<Hit> reference, hits;
+	traceAll("flat binary", [](Ray& ray, Hit& hit) { bvh->flatTree.intersect(ray, hit, false); }, reference);
+	std::cout << std::endl;
+
+	auto compare = [&]() {
+		int mismatches = 0;
+		for (size_t i = 0; i < rays.size(); i++) {
+			if (std::get<1>(hits[i]) != std::get<1>(reference[i])) mismatches++;
+		}
+		std::cout << ", differing hits: " << mismatches << std::endl;
+	};
+
+	traceAll("BVHBinaryTree", [](Ray& ray, Hit& hit) { bvh->tree.BVHIntersect(ray, hit, false); }, hits);
+	compare();
+	traceAll("4 wide SSE", [](Ray& ray, Hit& hit) { bvh->wideTree4.intersect(ray, hit, false); }, hits);
+	compare();
+	traceAll(bvh->wideTree8.getSIMD() ? "8 wide AVX" : "8 wide (no AVX, scalar)", [](Ray& ray, Hit& hit) { bvh->wideTree8.intersect(ray, hit, false); }, hits);
+	compare();
+
+	bool simd = bvh->wideTree8.getSIMD();
+	bvh->wideTree8.setSIMD(false);
+	traceAll("8 wide scalar", [](Ray& ray, Hit& hit) { bvh->wideTree8.intersect(ray, hit, false); }, hits);
+	compare();
+	bvh->wideTree8.setSIMD(simd);
+}
+
+/// <summary>
+/// Camera rays in blocks of pixels like tracePacketTile groups them, as packets of packetSize rays
+/// </summary>
+static std::vector<RayPacket> generateCameraPackets(int packetSize) {
+	const int blockWidth = packetSize >= 8 ? 4 : 2;
+	const int blockHeight = packetSize / blockWidth;
+	std::vector<RayPacket> packets;
+	for (int by = 0; by < vp_height; by += blockHeight) {
+		for (int bx = 0; bx < vp_width; bx += blockWidth) {
+			RayPacket packet;
+			for (int y = by; y < std::min(by + blockHeight, vp_height); y++) {
+				for (int x = bx; x < std::min(bx + blockWidth, vp_width); x++) packet.add(Ray(eye, s(x, y) - eye, 1.0f));
+			}
+			packets.push_back(packet);
+		}
+	}
+	return packets;
+}
+
+/// <summary>
+/// Hard shadow rays from the closest hit of every ray of the packets towards the light, in the same packets
+/// </summary>
+static std::vector<RayPacket> generateShadowPackets(const std::vector<RayPacket>& cameraPackets, Light* light) {
+	std::vector<RayPacket> packets;
+	for (const RayPacket& cameraPacket : cameraPackets) {
+		RayPacket packet;
+		for (int lane = 0; lane < cameraPacket.size; lane++) {
+			Ray ray = cameraPacket.ray(lane);
+			std::tuple<float, Object*, Vector, Vertex> hit;
+			if (!bvh->flatTree.intersect(ray, hit, false)) continue;
+
+			Vertex point = std::get<3>(hit);
+			if (light->type == LightType::DIRECTIONAL) packet.add(Ray(point, -((DirectionalLight*)light)->direction, 0.001f));
+			else packet.add(Ray(point, (light->type == LightType::POINT ? ((PointLight*)light)->position : ((SpotLight*)light)->position) - point, 0.001f, 1.0f));
+		}
+		if (packet.size > 0) packets.push_back(packet);
+	}
+	return packets;
+}
+
+/// <summary>
+/// Traces the camera rays, and the hard shadow rays from their hits to the first light that casts shadows, one at
+/// a time through the flat binary and the 8 wide tree, then in packets of 4, 8 and 16 through the flat tree.
+/// Packets whose rays do not share their direction signs fall back to single rays, as in the renderer.
+/// Prints the throughput of each, and the number of rays whose result differs from single rays.
+/// </summary>
+static void runPacketBenchmark() {
+	Light* light = nullptr;
+	for (Light* sceneLight : scene.lights) {
+		if (sceneLight->type != LightType::AMBIENT) {
+			light = sceneLight;
+			break;
+		}
+	}
+
+	auto measure = [](const char* name, int rayCount, int itemCount, std::function<void(int)> traceItem) {
+		const int repeats = 3;
+		double bestSeconds = std::numeric_limits<double>::infinity();
+		for (int repeat = 0; repeat < repeats; repeat++) {
+			auto t0 = std::chrono::high_resolution_clock::now();
+			pool.parallelize_loop(itemCount, [&](const int a, const int b) {
+				for (int i = a; i < b; i++) traceItem(i);
+			}).wait();
+			auto t1 = std::chrono::high_resolution_clock::now();
+			bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(t1 - t0).count());
+		}
+		std::cout << "  " << name << ": " << (rayCount / bestSeconds) / 1e6 << " Mrays/s";
+		return rayCount / bestSeconds;
+	};
+
+	for (int pass = 0; pass < 2; pass++) {
+		bool shadows = pass == 1;
+		if (shadows && light == nullptr) break;
+
+		// single rays, in the order of the 16 ray packets
+		std::vector<RayPacket> reference = generateCameraPackets(16);
+		if (shadows) reference = generateShadowPackets(reference, light);
+		std::vector<Ray> rays;
+		for (const RayPacket& packet : reference) {
+			for (int lane = 0; lane < packet.size; lane++) rays.push_back(packet.ray(lane));
+		}
+		std::cout << (shadows ? "Shadow rays to light " : "Camera rays") << (shadows ? toString(light->type) : "") << ": " << rays.size() << " rays" << std::endl;
+
+		auto traceSingle = [&](const char* name, bool wide) {
+			return measure(name, (int)rays.size(), (int)rays.size(), [&](int i) {
+				Ray ray = rays[i];
+				if (shadows) {
+					if (wide) bvh->wideTree8.occluded(ray, false);
+					else bvh->flatTree.occluded(ray, false);
+					return;
+				}
+				std::tuple<float, Object*, Vector, Vertex> hit;
+				if (wide) bvh->wideTree8.intersect(ray, hit, false);
+				else bvh->flatTree.intersect(ray, hit, false);
+			});
+		};
+		double singleSpeed = traceSingle("flat binary", false);
+		std::cout << std::endl;
+		traceSingle(bvh->wideTree8.getSIMD() ? "8 wide AVX" : "8 wide scalar", true);
+		std::cout << std::endl;
+
+		for (int packetSize : { 4, 8, 16 }) {
+			std::vector<RayPacket> packets = generateCameraPackets(packetSize);
+			if (shadows) packets = generateShadowPackets(packets, light);
+
+			int coherent = 0;
+			int dirIsNeg[3];
+			for (const RayPacket& packet : packets) coherent += packet.sameSigns(dirIsNeg);
+
+			std::vector<std::vector<Object*>> packetHits(packets.size());
+			std::vector<uint32_t> packetOccluded(packets.size());
+			std::string name = std::to_string(packetSize) + " ray packets";
+			double packetSpeed = measure(name.c_str(), (int)rays.size(), (int)packets.size(), [&](int i) {
+				RayPacket packet = packets[i];
+				int signs[3];
+				bool together = packet.sameSigns(signs);
+				if (shadows) {
+					uint32_t occluded = 0;
+					if (together) occluded = bvh->flatTree.occludedPacket(packet);
+					else for (int lane = 0; lane < packet.size; lane++) occluded |= (uint32_t)bvh->flatTree.occluded(packet.ray(lane), false) << lane;
+					packetOccluded[i] = occluded;
+					return;
+				}
+				std::tuple<float, Object*, Vector, Vertex> hits[RayPacket::MAX_SIZE];
+				for (int lane = 0; lane < packet.size; lane++) std::get<1>(hits[lane]) = NULL;
+				if (together) bvh->flatTree.intersectPacket(packet, hits);
+				else for (int lane = 0; lane < packet.size; lane++) {
+					Ray ray = packet.ray(lane);
+					bvh->flatTree.intersect(ray, hits[lane], false);
+				}
+				packetHits[i].resize(packet.size);
+				for (int lane = 0; lane < packet.size; lane++) packetHits[i][lane] = std::get<1>(hits[lane]);
+			});
+
+			int mismatches = 0;
+			for (size_t i = 0; i < packets.size(); i++) {
+				for (int lane = 0; lane < packets[i].size; lane++) {
+					Ray ray = packets[i].ray(lane);
+					if (shadows) {
+						mismatches += bvh->flatTree.occluded(ray, false) != (((packetOccluded[i] >> lane) & 1) != 0);
+						continue;
+					}
+					std::tuple<float, Object*, Vector, Vertex> hit;
+					std::get<1>(hit) = NULL;
+					bvh->flatTree.intersect(ray, hit, false);
+					mismatches += std::get<1>(hit) != packetHits[i][lane];
+				}
+			}
+
+			std::cout << ", " << packetSpeed / singleSpeed << "x flat binary, " << 100.0 * coherent / packets.size()
+				<< "% of packets coherent, differing results: " << mismatches << std::endl;
+		}
+	}
+}
+
+int runHeadless(int argc, char** argv) {
+	HeadlessOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage();
+		return EXIT_FAILURE;
+	}
+
+	auto t0 = std::chrono::high_resolution_clock::now();
+	choose_scene(options.scene);
+	auto t1 = std::chrono::high_resolution_clock::now();
+
+	std::cout << "-----------------------------" << std::endl;
+	std::cout << "Threadpool size: " << pool.get_thread_count() << std::endl;
+
+	if (options.bvhBenchmark) {
+		setViewport(options.width, options.height);
+		runBVHBenchmark();
+		runPacketBenchmark();
+		return EXIT_SUCCESS;
+	}
+	auto load_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0);
+	setViewport(options.width, options.height);
+	for (int frame = 0; frame < options.frames; frame++) {
+		// later frames move the spinning objects first, which prints its own time
+		if (frame > 0) animate_scene(frame);
+		std::string output = options.frames > 1 ? framePath(options.output, frame) : options.output;
+		std::cout << "Rendering " << options.width << "x" << options.height << " to " << output << std::endl;
+
+		auto t2 = frame > 0 ? std::chrono::high_resolution_clock::now() : t1;
+		Framebuffer framebuffer(options.width, options.height);
+		const TileScheduler* tiles = renderFrame(framebuffer);
+		auto t3 = std::chrono::high_resolution_clock::now();
+
+		auto render_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t3 - t2);
+		if (frame == 0) std::cout << "Load time: " << load_ms.count() << " ms" << std::endl;
+		std::cout << "Render time: " << render_ms.count() << " ms" << std::endl;
+		tiles->printTimings();
+		lightingOps::printShadowStats(scene);
+		printAntiAliasingStats();
+		statsOps::printStats(statsOps::collect());
+		wavefrontOps::printStats();
+
+		std::string tileStats = options.frames > 1 ? framePath(options.tileStats, frame) : options.tileStats;
+		if (!options.tileStats.empty() && !tiles->writeTimingsCSV(tileStats)) {
+			std::cout << "Unable to write tile timings " << tileStats << std::endl;
+		}
+
+		if (!imageWriter::writeImage(output, framebuffer)) {
+			std::cout << "Unable to write image " << output << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (Globals::HEATMAP && !heatmapOps::writeHeatmaps(output)) {
+			std::cout << "Unable to write the heatmaps next to " << output << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
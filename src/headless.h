@@ -0,0 +1,35 @@
+#pragma once
+
+/// <summary>
+/// Renders a scene without opening a window and writes the image to disk.
+/// Usage: --headless &lt;scene&gt; [--width N] [--height N] [--output file.png|.ppm|.exr]
+///        [--tile-size N] [--tile-stats timings.csv] [--bvh median|sah] [--sah-bins N] [--bvh-width 2|4|8]
+///        [--soft-shadows N] [--adaptive-shadows N] [--aa N] [--aa-mode adaptive|full] [--aa-threshold X] [--sampler random|sobol]
+///        [--max-depth N] [--ray-weight X] [--russian-roulette] [--packets 0|4|8|16] [--wavefront sorted|unsorted] [--heatmap] [--no-scene-cache]
+///        [--frames N] [--bvh-rebuild-ratio X] [--bvh-benchmark]
+/// --soft-shadows N turns on soft shadows with N shadow rays per light, --aa N turns on anti-aliasing with N extra
+/// samples per pixel. By default only pixels on an edge get the extra samples, --aa-mode full gives them to every pixel
+/// that hit something. --aa-threshold X is the colour difference to a neighbour, per channel in [0, 1], that marks an edge. Both draw their samples from a scrambled Sobol sequence unless --sampler random is given.
+/// Soft shadows cast a first batch of 4 rays per light and only cast the rest when the batch disagrees;
+/// --adaptive-shadows N changes the batch size, and 0 always casts every ray.
+/// Reflection and transmission rays stop at depth --max-depth (4) and are dropped once their weight, their largest
+/// possible change to the pixel, falls under --ray-weight (half a step of 8 bit colour). --russian-roulette also drops
+/// low weight rays at random, scaling up the ones that survive.
+/// --packets N traces the camera rays and their hard shadow rays in packets of N (16), 0 traces every ray on its own.
+/// --wavefront traces each tile's ray trees one depth at a time as ray streams, sorting the reflection and
+/// transmission streams unless unsorted is given, and prints the time spent in each stage.
+/// --heatmap also writes colour mapped images of the BVH nodes visited, the primitives tested and the time spent per
+/// pixel next to the output, e.g. c_nodes.png, c_primitives.png and c_time.png for c.png.
+/// Scenes are read from a binary cache next to their JSON, e.g. scenes/c.rtscene for scenes/c.json, written on the
+/// first load and used as long as the JSON is unchanged. --no-scene-cache always parses the JSON and writes no cache.
+/// --frames N renders N frames, c_0000.png to c_0003.png for c.png and 4 frames, turning the objects with a "spin"
+/// further every frame. Between frames the BVH is refit, and rebuilt in part or in full once its SAH cost is over
+/// --bvh-rebuild-ratio (1.3) times its cost when last built; 0 rebuilds it every frame. The --tile-stats file of each
+/// frame is numbered like its image.
+/// With --bvh-benchmark no image is written. Instead the camera rays and one diffuse bounce per hit are traced
+/// through every BVH layout and the throughput of each is printed in Mrays/s, followed by the camera rays and the
+/// shadow rays to the first light traced alone and in packets of 4, 8 and 16.
+/// </summary>
+/// <param name="argc">argument count, argv[0] being "--headless"</param>
+/// <returns>process exit code</returns>
+int runHeadless(int argc, char** argv);
@@ -0,0 +1,102 @@
+#include "heatmap.h"
+#include "framebuffer.h"
+#include "imageWriter.h"
+#include "Globals.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// Work summed over every pass of a pixel
+struct PixelCost {
+	uint64_t nodeVisits = 0;
+	uint64_t primitiveTests = 0;
+	double nanoseconds = 0;
+};
+
+static int costWidth = 0;
+static int costHeight = 0;
+static std::vector<PixelCost> costs;
+
+void heatmapOps::beginFrame(int width, int height) {
+	if (!Globals::HEATMAP) return;
+	costWidth = width;
+	costHeight = height;
+	costs.assign((size_t)width * height, PixelCost());
+}
+
+heatmapOps::PixelStart heatmapOps::beginPixel() {
+	PixelStart start;
+	if (!Globals::HEATMAP) return start;
+
+	const statsOps::Counters& counters = statsOps::local();
+	start.nodeVisits = counters.nodeVisits;
+	start.primitiveTests = counters.totalPrimitiveTests();
+	start.time = std::chrono::steady_clock::now();
+	return start;
+}
+
+void heatmapOps::endPixel(int x, int y, const PixelStart& start) {
+	if (!Globals::HEATMAP) return;
+
+	auto now = std::chrono::steady_clock::now();
+	const statsOps::Counters& counters = statsOps::local();
+	PixelCost& cost = costs[(size_t)y * costWidth + x];
+	cost.nodeVisits += counters.nodeVisits - start.nodeVisits;
+	cost.primitiveTests += counters.totalPrimitiveTests() - start.primitiveTests;
+	cost.nanoseconds += std::chrono::duration<double, std::nano>(now - start.time).count();
+}
+
+// Polynomial fit of the Turbo colour map (Mikhailov, "Turbo, An Improved Rainbow Colormap for Visualization", 2019),
+// after the approximation by Ruofei Du
+static colour3 turbo(float x) {
+	x = glm::clamp(x, 0.0f, 1.0f);
+	glm::vec4 v4(1.0f, x, x * x, x * x * x);
+	glm::vec2 v2(v4.z * v4.z, v4.w * v4.z);
+	return glm::clamp(colour3(
+		glm::dot(v4, glm::vec4(0.13572138f, 4.61539260f, -42.66032258f, 132.13108234f)) + glm::dot(v2, glm::vec2(-152.94239396f, 59.28637943f)),
+		glm::dot(v4, glm::vec4(0.09140261f, 2.19418839f, 4.84296658f, -14.18503333f)) + glm::dot(v2, glm::vec2(4.27729857f, 2.82956604f)),
+		glm::dot(v4, glm::vec4(0.10667330f, 12.64194608f, -60.58204836f, 110.36276771f)) + glm::dot(v2, glm::vec2(-89.90310912f, 27.34824973f))),
+		0.0f, 1.0f);
+}
+
+// Colour maps one value of every pixel and writes it, see writeHeatmaps
+static bool writeHeatmap(const std::string& path, const char* name, const char* unit, double (*value)(const PixelCost&)) {
+	std::vector<double> values(costs.size());
+	for (size_t i = 0; i < costs.size(); i++) values[i] = value(costs[i]);
+
+	std::vector<double> sorted = values;
+	size_t percentile = (sorted.size() * 99) / 100;
+	std::nth_element(sorted.begin(), sorted.begin() + percentile, sorted.end());
+	double scale = sorted[percentile];
+	double maximum = *std::max_element(values.begin(), values.end());
+	if (scale <= 0) scale = maximum > 0 ? maximum : 1.0;
+
+	Framebuffer framebuffer(costWidth, costHeight);
+	for (size_t i = 0; i < values.size(); i++) framebuffer.pixels[i] = turbo((float)(values[i] / scale));
+
+	std::cout << "  " << name << ": " << path << ", top colour " << scale << " " << unit << " (99th percentile), max " << maximum << " " << unit << std::endl;
+	return imageWriter::writeImage(path, framebuffer);
+}
+
+bool heatmapOps::writeHeatmaps(const std::string& path) {
+	if (costs.empty()) return false;
+
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+	std::string stem = path.substr(0, dot);
+	std::string extension = path.substr(dot);
+
+	std::cout << "Heatmaps:" << std::endl;
+	bool written = true;
+#if RT_ENABLE_STATS
+	written &= writeHeatmap(stem + "_nodes" + extension, "BVH nodes visited", "nodes", [](const PixelCost& cost) { return (double)cost.nodeVisits; });
+	written &= writeHeatmap(stem + "_primitives" + extension, "primitives tested", "tests", [](const PixelCost& cost) { return (double)cost.primitiveTests; });
+#else
+	std::cout << "  node and primitive maps need RT_ENABLE_STATS, only the time map is written" << std::endl;
+#endif
+	written &= writeHeatmap(stem + "_time" + extension, "time", "us", [](const PixelCost& cost) { return cost.nanoseconds / 1000.0; });
+	return written;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/// <summary>
+/// Per pixel cost of a frame when Globals::HEATMAP is on: the BVH nodes visited, the primitives tested and the wall
+/// time spent on the pixel, anti-aliasing samples and every reflection, refraction and shadow ray included.
+/// Costs are the difference of the thread's statsOps counters across the pixel, so heatmap frames trace every pixel
+/// on its own rather than in packets or wavefront batches, and node and primitive counts need RT_ENABLE_STATS.
+/// </summary>
+namespace heatmapOps {
+	// The counters and the clock when the calling thread started a pixel
+	struct PixelStart {
+		uint64_t nodeVisits = 0;
+		uint64_t primitiveTests = 0;
+		std::chrono::steady_clock::time_point time;
+	};
+
+	/// <summary>
+	/// Clears the costs for a frame of the given size. Does nothing when Globals::HEATMAP is off.
+	/// </summary>
+	void beginFrame(int width, int height);
+
+	/// <summary>
+	/// Marks the start of the work on a pixel by the calling thread
+	/// </summary>
+	PixelStart beginPixel();
+
+	/// <summary>
+	/// Adds the work since start to pixel (x, y). A pixel traced in several passes sums the cost of all of them.
+	/// </summary>
+	void endPixel(int x, int y, const PixelStart& start);
+
+	/// <summary>
+	/// Writes the node visit, primitive test and time maps of the last frame next to the image at path, as
+	/// &lt;name&gt;_nodes, &lt;name&gt;_primitives and &lt;name&gt;_time with the same extension. Values are mapped
+	/// to colours from dark blue to red, linearly up to the 99th percentile so a few outliers do not wash out the rest.
+	/// Prints the value of the top colour of every map.
+	/// </summary>
+	/// <returns>false if no heatmap frame was traced or a file could not be written</returns>
+	bool writeHeatmaps(const std::string& path);
+}
@@ -0,0 +1,242 @@
+#include "imageWriter.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+
+// All writers below assume a little-endian host, which covers every platform we build on.
+
+static unsigned char toByte(float c) {
+	return (unsigned char)(glm::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// Image files store the top scanline first, the framebuffer stores the bottom one first.
+static std::vector<unsigned char> toRGB8(const Framebuffer& framebuffer) {
+	std::vector<unsigned char> rgb((size_t)framebuffer.width * framebuffer.height * 3);
+	size_t i = 0;
+	for (int y = framebuffer.height - 1; y >= 0; y--) {
+		for (int x = 0; x < framebuffer.width; x++) {
+			const colour3& c = framebuffer.at(x, y);
+			rgb[i++] = toByte(c.r);
+			rgb[i++] = toByte(c.g);
+			rgb[i++] = toByte(c.b);
+		}
+	}
+	return rgb;
+}
+
+bool imageWriter::writePPM(const std::string& path, const Framebuffer& framebuffer)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out.is_open()) return false;
+
+	out << "P6\n" << framebuffer.width << " " << framebuffer.height << "\n255\n";
+	auto rgb = toRGB8(framebuffer);
+	out.write((const char*)rgb.data(), rgb.size());
+	return out.good();
+}
+
+// ***************************************************************************************************************** //
+// PNG
+// The image data is written as "stored" (uncompressed) deflate blocks, so no zlib dependency is needed.
+// https://www.w3.org/TR/png/
+// ***************************************************************************************************************** //
+
+static uint32_t crc32(const unsigned char* data, size_t length, uint32_t crc = 0)
+{
+	static uint32_t table[256];
+	static bool tableReady = false;
+	if (!tableReady) {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		tableReady = true;
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void putBigEndian32(std::vector<unsigned char>& buffer, uint32_t value) {
+	buffer.push_back((value >> 24) & 0xFF);
+	buffer.push_back((value >> 16) & 0xFF);
+	buffer.push_back((value >> 8) & 0xFF);
+	buffer.push_back(value & 0xFF);
+}
+
+static void writePNGChunk(std::ofstream& out, const char* type, const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> chunk;
+	putBigEndian32(chunk, (uint32_t)data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	putBigEndian32(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+	out.write((const char*)chunk.data(), chunk.size());
+}
+
+bool imageWriter::writePNG(const std::string& path, const Framebuffer& framebuffer)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out.is_open()) return false;
+
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.write((const char*)signature, 8);
+
+	std::vector<unsigned char> header;
+	putBigEndian32(header, framebuffer.width);
+	putBigEndian32(header, framebuffer.height);
+	header.push_back(8); // bit depth
+	header.push_back(2); // colour type: RGB
+	header.push_back(0); // compression
+	header.push_back(0); // filter
+	header.push_back(0); // interlace
+	writePNGChunk(out, "IHDR", header);
+
+	// every scanline is prefixed with filter type 0 (none)
+	auto rgb = toRGB8(framebuffer);
+	size_t rowBytes = (size_t)framebuffer.width * 3;
+	std::vector<unsigned char> raw;
+	raw.reserve((rowBytes + 1) * framebuffer.height);
+	for (int y = 0; y < framebuffer.height; y++) {
+		raw.push_back(0);
+		raw.insert(raw.end(), rgb.begin() + y * rowBytes, rgb.begin() + (y + 1) * rowBytes);
+	}
+
+	std::vector<unsigned char> zlib = { 0x78, 0x01 };
+	uint32_t adlerA = 1, adlerB = 0;
+	for (unsigned char byte : raw) {
+		adlerA = (adlerA + byte) % 65521;
+		adlerB = (adlerB + adlerA) % 65521;
+	}
+
+	size_t offset = 0;
+	do {
+		size_t blockSize = std::min<size_t>(65535, raw.size() - offset);
+		bool last = offset + blockSize == raw.size();
+		zlib.push_back(last ? 1 : 0);
+		zlib.push_back(blockSize & 0xFF);
+		zlib.push_back((blockSize >> 8) & 0xFF);
+		zlib.push_back(~blockSize & 0xFF);
+		zlib.push_back((~blockSize >> 8) & 0xFF);
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + blockSize);
+		offset += blockSize;
+	} while (offset < raw.size());
+	putBigEndian32(zlib, (adlerB << 16) | adlerA);
+
+	writePNGChunk(out, "IDAT", zlib);
+	writePNGChunk(out, "IEND", {});
+	return out.good();
+}
+
+// ***************************************************************************************************************** //
+// OpenEXR
+// Single part scanline file, no compression, 32-bit float B/G/R channels.
+// https://openexr.com/en/latest/OpenEXRFileLayout.html
+// ***************************************************************************************************************** //
+
+template <typename T>
+static void putLittleEndian(std::vector<unsigned char>& buffer, T value) {
+	const unsigned char* bytes = (const unsigned char*)&value;
+	buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+static void putString(std::vector<unsigned char>& buffer, const char* str) {
+	while (*str) buffer.push_back(*str++);
+	buffer.push_back(0);
+}
+
+static void putAttributeHeader(std::vector<unsigned char>& buffer, const char* name, const char* type, int32_t size) {
+	putString(buffer, name);
+	putString(buffer, type);
+	putLittleEndian<int32_t>(buffer, size);
+}
+
+bool imageWriter::writeEXR(const std::string& path, const Framebuffer& framebuffer)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out.is_open()) return false;
+
+	const int width = framebuffer.width;
+	const int height = framebuffer.height;
+	std::vector<unsigned char> header;
+	putLittleEndian<int32_t>(header, 20000630); // magic number
+	putLittleEndian<int32_t>(header, 2);        // version 2, scanline file
+
+	// channels must be listed in alphabetical order
+	const char* channelNames[3] = { "B", "G", "R" };
+	putAttributeHeader(header, "channels", "chlist", 3 * (2 + 16) + 1);
+	for (const char* name : channelNames) {
+		putString(header, name);
+		putLittleEndian<int32_t>(header, 2); // FLOAT
+		putLittleEndian<int32_t>(header, 0); // pLinear + reserved
+		putLittleEndian<int32_t>(header, 1); // xSampling
+		putLittleEndian<int32_t>(header, 1); // ySampling
+	}
+	header.push_back(0);
+
+	putAttributeHeader(header, "compression", "compression", 1);
+	header.push_back(0); // NO_COMPRESSION
+
+	for (const char* window : { "dataWindow", "displayWindow" }) {
+		putAttributeHeader(header, window, "box2i", 16);
+		putLittleEndian<int32_t>(header, 0);
+		putLittleEndian<int32_t>(header, 0);
+		putLittleEndian<int32_t>(header, width - 1);
+		putLittleEndian<int32_t>(header, height - 1);
+	}
+
+	putAttributeHeader(header, "lineOrder", "lineOrder", 1);
+	header.push_back(0); // INCREASING_Y
+
+	putAttributeHeader(header, "pixelAspectRatio", "float", 4);
+	putLittleEndian<float>(header, 1.0f);
+
+	putAttributeHeader(header, "screenWindowCenter", "v2f", 8);
+	putLittleEndian<float>(header, 0.0f);
+	putLittleEndian<float>(header, 0.0f);
+
+	putAttributeHeader(header, "screenWindowWidth", "float", 4);
+	putLittleEndian<float>(header, 1.0f);
+	header.push_back(0); // end of header
+
+	// one scanline per block, the offset table points at each of them
+	const int32_t lineBytes = width * 3 * (int32_t)sizeof(float);
+	uint64_t blockOffset = header.size() + (uint64_t)height * sizeof(uint64_t);
+	for (int y = 0; y < height; y++) {
+		putLittleEndian<uint64_t>(header, blockOffset);
+		blockOffset += 8 + lineBytes;
+	}
+	out.write((const char*)header.data(), header.size());
+
+	std::vector<unsigned char> line;
+	line.reserve(8 + lineBytes);
+	for (int y = 0; y < height; y++) {
+		line.clear();
+		putLittleEndian<int32_t>(line, y);
+		putLittleEndian<int32_t>(line, lineBytes);
+		int row = height - 1 - y;
+		for (int channel = 2; channel >= 0; channel--) {
+			for (int x = 0; x < width; x++) {
+				putLittleEndian<float>(line, framebuffer.at(x, row)[channel]);
+			}
+		}
+		out.write((const char*)line.data(), line.size());
+	}
+	return out.good();
+}
+
+bool imageWriter::writeImage(const std::string& path, const Framebuffer& framebuffer)
+{
+	std::string extension = path.substr(path.find_last_of('.') + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+	if (extension == "png") return writePNG(path, framebuffer);
+	else if (extension == "ppm") return writePPM(path, framebuffer);
+	else if (extension == "exr") return writeEXR(path, framebuffer);
+
+	std::cout << "Unknown image format ." << extension << ", expected .png, .ppm or .exr" << std::endl;
+	return false;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+#include "framebuffer.h"
+
+namespace imageWriter {
+	bool writePPM(const std::string& path, const Framebuffer& framebuffer);
+	bool writePNG(const std::string& path, const Framebuffer& framebuffer);
+	bool writeEXR(const std::string& path, const Framebuffer& framebuffer);
+
+	/// <summary>
+	/// Writes the framebuffer in the format given by the file extension (.png, .ppm or .exr).
+	/// </summary>
+	/// <returns>false if the extension is unknown or the file could not be written</returns>
+	bool writeImage(const std::string& path, const Framebuffer& framebuffer);
+}
@@ -5,11 +5,14 @@
 #include <fstream>
 #include <string>
 #include <cstdio>
+#include <unordered_map>
 #include <glm/glm.hpp>
 
 #include "schema.h"
 
 #include "json2scene.h"
+#include "objLoader.h"
+#include "Globals.h"
 #include <glm/gtx/transform.hpp>
 
 using json = nlohmann::json;
@@ -20,7 +23,62 @@ static glm::vec3 vector_to_vec3(const std::vector<float>& v) {
 	return glm::vec3(v[0], v[1], v[2]);
 }
 
-int json_to_scene(json& jscene, Scene& s) {
+// Multiplies the object's transformations, in the order they are applied
+static glm::mat4 combinedTransformation(json& object) {
+	std::vector<glm::mat4> transformations;
+	getTransformations(object, transformations);
+	glm::mat4 matMultTrans(1);
+	for (auto t = std::crbegin(transformations); t != std::crend(transformations); t++) {
+		matMultTrans *= (*t);
+	}
+	return matMultTrans;
+}
+
+// Appends the triangles of a mesh or of an entry of "meshes" to the arrays, in model space, from its list of
+// triangles or the path of an OBJ file, relative to the scene, holding them
+static bool read_mesh_triangles(json& object, sceneCacheOps::SceneArrays& s, const std::string& directory, BS::thread_pool* pool,
+	uint32_t& firstIndex, uint32_t& triangleCount) {
+	firstIndex = (uint32_t)s.indices.size();
+
+	if (object.find("file") != object.end()) {
+		std::string path = directory + object["file"].get<std::string>();
+		s.addDependency(path);
+		objOps::ObjMesh obj;
+		if (!objOps::loadObj(path, obj, pool)) return false;
+
+		uint32_t base = (uint32_t)s.vertices.size();
+		s.vertices.insert(s.vertices.end(), obj.vertices.begin(), obj.vertices.end());
+		for (uint32_t index : obj.indices) s.indices.push_back(base + index);
+		triangleCount = (uint32_t)obj.triangleCount();
+		std::cout << "Loaded " << path << ": " << obj.faceCount << " faces, " << triangleCount << " triangles, "
+			<< obj.vertices.size() << " vertices (" << obj.duplicateVertices << " duplicates merged)\n";
+		return true;
+	}
+
+	// corners shared between triangles are merged, as they are for OBJ files
+	json& ts = object["triangles"];
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	for (json::iterator ti = ts.begin(); ti != ts.end(); ++ti) {
+		json& t = *ti;
+		for (int corner = 0; corner < 3; corner++) {
+			indices.push_back((uint32_t)vertices.size());
+			vertices.push_back(vector_to_vec3(t[corner]));
+		}
+	}
+	objOps::deduplicateVertices(vertices, indices);
+
+	uint32_t base = (uint32_t)s.vertices.size();
+	s.vertices.insert(s.vertices.end(), vertices.begin(), vertices.end());
+	for (uint32_t index : indices) s.indices.push_back(base + index);
+	triangleCount = (uint32_t)ts.size();
+	return true;
+}
+
+int json_to_arrays(json& jscene, sceneCacheOps::SceneArrays& s, const std::string& directory, BS::thread_pool* pool) {
+	// objects with the same material share one entry of the material table, found by its bytes
+	std::unordered_map<std::string, uint32_t> materialIndices;
+
 	json camera = jscene["camera"];
 
 	if (camera.find("field") != camera.end()) {
@@ -30,6 +88,23 @@ int json_to_scene(json& jscene, Scene& s) {
 		s.camera.background = vector_to_vec3(camera["background"]);
 	}
 
+	// Meshes that instances place by name, each read once however many instances there are
+	std::unordered_map<std::string, uint32_t> meshIndices;
+	if (jscene.find("meshes") != jscene.end()) {
+		json& meshes = jscene["meshes"];
+		for (json::iterator it = meshes.begin(); it != meshes.end(); ++it) {
+			json& mesh = *it;
+			std::string name = mesh["name"];
+			if (!meshIndices.emplace(name, (uint32_t)s.meshes.size()).second) {
+				std::cout << "*** there is more than one mesh named " << name << "\n";
+				return -1;
+			}
+			sceneCacheOps::FlatMesh flat = {};
+			if (!read_mesh_triangles(mesh, s, directory, pool, flat.firstIndex, flat.triangleCount)) return -1;
+			s.meshes.push_back(flat);
+		}
+	}
+
 	// Traverse the objects
 	json& objects = jscene["objects"];
 	for (json::iterator it = objects.begin(); it != objects.end(); ++it) {
@@ -60,106 +135,94 @@ int json_to_scene(json& jscene, Scene& s) {
 			m.refraction = material["refraction"];
 		}
 
+		sceneCacheOps::FlatObject flat = {};
+		auto inserted = materialIndices.emplace(std::string((const char*)&m, sizeof(Material)), (uint32_t)s.materials.size());
+		if (inserted.second) s.materials.push_back(m);
+		flat.material = inserted.first->second;
+		flat.transform = sceneCacheOps::NO_TRANSFORM;
+
 		// Every object in the scene will have a type
 		if (object["type"] == "sphere") {
-			// Every sphere has a position and a radius
-			//Vertex pos = vector_to_vec3(object["position"]);
-			float radius = object["radius"];
-
-			std::vector<glm::mat4> transformations;
-			getTransformations(object, transformations);
-			glm::mat4 matMultTrans(1);
-			for (auto t = std::crbegin(transformations); t != std::crend(transformations); t++) {
-				matMultTrans *= (*t);
-			}
-
-			Sphere* sphere = new Sphere(m, radius, matMultTrans);
-			sphere->transformPos = matMultTrans * glm::vec4(0, 0, 0, 1);
-
-			s.objects.push_back(sphere);
+			// Every sphere has a radius and is placed by its transformations
+			flat.type = (uint32_t)ObjectType::SPHERE;
+			flat.radius = object["radius"];
+			flat.transform = (uint32_t)s.transforms.size();
+			s.transforms.push_back(combinedTransformation(object));
 		}
 
 		else if (object["type"] == "cylinder") 
 		{
-			float radius = object["radius"];
-			float height = object["height"];
-
-			std::vector<glm::mat4> transformations;
-			getTransformations(object, transformations);
-
-			glm::mat4 matMultTrans(1);
-			for (auto t = std::crbegin(transformations); t != std::crend(transformations); t++) {
-				matMultTrans *= (*t);
-			}
-
-			Cylinder* cylinder = new Cylinder(m, radius, height, matMultTrans);
-			cylinder->transformPos = matMultTrans * glm::vec4(0, 0, 0,1);
-
-			s.objects.push_back(cylinder);
+			flat.type = (uint32_t)ObjectType::CYLINDER;
+			flat.radius = object["radius"];
+			flat.height = object["height"];
+			flat.transform = (uint32_t)s.transforms.size();
+			s.transforms.push_back(combinedTransformation(object));
 		}
 
 		else if (object["type"] == "plane") 
 		
 		{
 			// Every plane has a position (point of intersection) and a normal
+			flat.type = (uint32_t)ObjectType::PLANE;
 			Vertex pos = vector_to_vec3(object["position"]);
 			Vector normal = vector_to_vec3(object["normal"]);
-			s.objects.push_back(new Plane(m, pos, normal));
+			for (int i = 0; i < 3; i++) {
+				flat.position[i] = pos[i];
+				flat.normal[i] = normal[i];
+			}
 		}
 
 		else if (object["type"] == "mesh") 
 		{
-			// Every mesh has a list of triangles
-			std::vector<Triangle> tris;
-			json& ts = object["triangles"];
-
-			std::vector<glm::mat4> transformations;
-			getTransformations(object, transformations);
-			glm::mat4 matMultTrans(1);
-			for (auto t = std::crbegin(transformations); t != std::crend(transformations); t++) {
-				matMultTrans *= (*t);
-			}
-
-			Vertex mesh_center = Vertex(0, 0, 0);
-			Mesh* mesh = new Mesh(m);
-
-			for (json::iterator ti = ts.begin(); ti != ts.end(); ++ti) {
-				json& t = *ti;
-				Vertex v1 = vector_to_vec3(t[0]);
-				Vertex v2 = vector_to_vec3(t[1]);
-				Vertex v3 = vector_to_vec3(t[2]);
-				
-				// precompute for faster barycenteric coord caclulations
-				//https://ceng2.ktu.edu.tr/~cakir/files/grafikler/Texture_Mapping.pdf
-				Vector e1 = v2 - v1;
-				Vector e2 = v3 - v1;
-				float d00 = glm::dot(e1, e1);
-				float d01 = glm::dot(e1, e2);
-				float d11 = glm::dot(e2, e2);
-				float denom = d00 * d11 - d01 * d01;
-
-				Vertex arr[3] = { v1,v2,v3 };
-				Triangle tri = Triangle(m, arr, mesh, e1, e2, d00, d01, d11, denom);
-
-
-				tri.transformPos = matMultTrans * glm::vec4((v1 + v2 + v3) / 3.0f,1.0f);
-				tris.push_back(tri);
+			// Every mesh has its own triangles, kept in model space until buildScene
+			flat.type = (uint32_t)ObjectType::MESH;
+			flat.transform = (uint32_t)s.transforms.size();
+			s.transforms.push_back(combinedTransformation(object));
+			if (!read_mesh_triangles(object, s, directory, pool, flat.firstIndex, flat.triangleCount)) return -1;
+		}
 
-				mesh_center += (v1 + v2 + v3) / 3.0f;
+		else if (object["type"] == "instance")
+		{
+			// Every instance places a mesh of the scene's "meshes" by its name, with its own transformations and material
+			flat.type = (uint32_t)ObjectType::INSTANCE;
+			flat.transform = (uint32_t)s.transforms.size();
+			s.transforms.push_back(combinedTransformation(object));
+			auto mesh = meshIndices.find(object["mesh"].get<std::string>());
+			if (mesh == meshIndices.end()) {
+				std::cout << "*** unknown mesh " << object["mesh"] << " of an instance\n";
+				return -1;
 			}
-
-			mesh_center /= (float)ts.size();
-			mesh->triangles = tris;
-			mesh->transformations = matMultTrans;
-			mesh->transformPos = matMultTrans * glm::vec4(mesh_center,1.0f);
-
-			s.objects.push_back(mesh);
+			flat.mesh = mesh->second;
 		}
 
 		else {
 			std::cout << "*** unrecognized object type " << object["type"] << "\n";
 			return -1;
 		}
+
+		// Any object but a plane may spin by degrees every frame around an axis, through its own origin unless a center is given
+		if (object.find("spin") != object.end()) {
+			if (flat.transform == sceneCacheOps::NO_TRANSFORM) {
+				std::cout << "*** a " << object["type"] << " cannot spin\n";
+				return -1;
+			}
+			json& spin = object["spin"];
+			Vector axis = glm::normalize(vector_to_vec3(spin["axis"]));
+			Vertex center = s.transforms[flat.transform] * glm::vec4(0, 0, 0, 1);
+			if (spin.find("center") != spin.end()) {
+				center = vector_to_vec3(spin["center"]);
+			}
+			sceneCacheOps::FlatSpin flatSpin = {};
+			flatSpin.object = (uint32_t)s.objects.size();
+			for (int i = 0; i < 3; i++) {
+				flatSpin.axis[i] = axis[i];
+				flatSpin.center[i] = center[i];
+			}
+			flatSpin.degrees = spin["degrees"];
+			s.spins.push_back(flatSpin);
+		}
+
+		s.objects.push_back(flat);
 	}
 
 	// Traverse the lights
@@ -168,44 +231,61 @@ int json_to_scene(json& jscene, Scene& s) {
 		json& light = *it;
 
 		// Every light in the scene will have a colour (ired, igreen, iblue)
+		sceneCacheOps::FlatLight flat = {};
 		RGB colour = vector_to_vec3(light["color"]);
+		Vertex pos(0, 0, 0);
+		Vector direction(0, 0, 0);
 
 		if (light["type"] == "ambient") {
 			// There should only be one ambient light
-			for (Light* l : s.lights) {
-				if (l->type == "ambient") {
+			for (const sceneCacheOps::FlatLight& l : s.lights) {
+				if (l.type == (uint32_t)LightType::AMBIENT) {
 					std::cout << "*** there should only be one ambient light!\n";
 					return -1;
 				}
 			}
-			s.lights.push_back(new AmbientLight(colour));
+			flat.type = (uint32_t)LightType::AMBIENT;
 		}
 		else if (light["type"] == "directional") {
 			// Every directional light has a direction
-			Vector direction = vector_to_vec3(light["direction"]);
-			s.lights.push_back(new DirectionalLight(colour, direction));
+			flat.type = (uint32_t)LightType::DIRECTIONAL;
+			direction = vector_to_vec3(light["direction"]);
 		}
 		else if (light["type"] == "point") {
 			// Every point light has a position
-			Vertex pos = vector_to_vec3(light["position"]);
-			s.lights.push_back(new PointLight(colour, pos));
+			flat.type = (uint32_t)LightType::POINT;
+			pos = vector_to_vec3(light["position"]);
 		}
 		else if (light["type"] == "spot") {
 			// Every spot light has a position, direction, and cutoff
-			Vertex pos = vector_to_vec3(light["position"]);
-			Vector direction = vector_to_vec3(light["direction"]);
-			float cutoff = light["cutoff"];
-			s.lights.push_back(new SpotLight(colour, pos, direction, cutoff));
+			flat.type = (uint32_t)LightType::SPOT;
+			pos = vector_to_vec3(light["position"]);
+			direction = vector_to_vec3(light["direction"]);
+			flat.cutoff = light["cutoff"];
 		}
 		else {
 			std::cout << "*** unrecognized light type " << light["type"] << "\n";
 			return -1;
 		}
+
+		for (int i = 0; i < 3; i++) {
+			flat.colour[i] = colour[i];
+			flat.position[i] = pos[i];
+			flat.direction[i] = direction[i];
+		}
+		s.lights.push_back(flat);
 	}
 
 	return 0;
 }
 
+int json_to_scene(json& jscene, Scene& s) {
+	sceneCacheOps::SceneArrays arrays;
+	if (json_to_arrays(jscene, arrays) < 0) return -1;
+	sceneCacheOps::buildScene(arrays.view(), s);
+	return 0;
+}
+
 void getTransformations(json object, std::vector<glm::mat4>& transformations) {
 	json& ts = object["transformations"];
 
@@ -2,10 +2,14 @@
 
 #include "schema.h"
 #include "json.hpp"
+#include "sceneCache.h"
+#include "BS_thread_pool.hpp"
 
 using json = nlohmann::json;
 
 int json_to_scene(json &jscene, Scene &s);
+// directory is prepended to the paths of OBJ files the scene refers to, pool parses large ones in parallel
+int json_to_arrays(json &jscene, sceneCacheOps::SceneArrays &s, const std::string &directory = "", BS::thread_pool *pool = nullptr);
 void getTransformations(json object, std::vector<glm::mat4>& transformations);
 void printf_rgb(RGB &rgb);
 void printf_vertex(Vertex &v);
@@ -1,133 +1,250 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
 #include <tuple>
 
 #include "lightingOperations.h"
 #include "geometryIntersect.h"
 #include "Globals.h"
+#include "sampler.h"
+#include "stats.h"
 
-float randomBetween(float small, float big)
+// Offsets every component of initial by small + (big - small) * u, u being a sample in [0, 1)^3
+Vector randomVectorBy(const Vector& initial, float small, float big, const glm::vec3& u) 
 {
-	float diff = big - small;
-	return (((float)rand() / (float)RAND_MAX) * diff) + small;
+	return initial + small + (big - small) * u;
 }
 
-Vector randomVectorBy(const Vector& initial, float small, float big) 
+// soft shadow statistics of every light of the scene, indexed like scene.lights
+static std::unique_ptr<lightingOps::ShadowStats[]> shadowStats;
+static size_t shadowStatsCount = 0;
+
+// Runs the shadow query of light number lightIndex and, with soft shadows on, adds its rays and time to the light's statistics
+template <typename ShadowQuery>
+static float recordShadowQuery(size_t lightIndex, ShadowQuery shadowQuery)
+{
+	if (!Globals::APPROXIMATE_SHADOWS || lightIndex >= shadowStatsCount) return shadowQuery(nullptr);
+
+	int shadowRays = 0;
+	auto t0 = std::chrono::steady_clock::now();
+	float intensity = shadowQuery(&shadowRays);
+	auto t1 = std::chrono::steady_clock::now();
+
+	lightingOps::ShadowStats& stats = shadowStats[lightIndex];
+	stats.shadingPoints.fetch_add(1, std::memory_order_relaxed);
+	stats.shadowRays.fetch_add(shadowRays, std::memory_order_relaxed);
+	stats.nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count(), std::memory_order_relaxed);
+	return intensity;
+}
+
+void lightingOps::resetShadowStats(const Scene& scene)
 {
-	Vector newVec = Vector(initial);
-	newVec.x += randomBetween(-0.05f, 0.05f),
-	newVec.y += randomBetween(-0.05f, 0.05f),
-	newVec.z += randomBetween(-0.05f, 0.05f);
-	return newVec;
+	shadowStatsCount = scene.lights.size();
+	shadowStats = std::make_unique<ShadowStats[]>(shadowStatsCount);
+}
+
+void lightingOps::printShadowStats(const Scene& scene)
+{
+	if (!Globals::SHADOWS || !Globals::APPROXIMATE_SHADOWS || shadowStatsCount != scene.lights.size()) return;
+
+	std::cout << "Soft shadows: " << Globals::APPROXIMATE_SHADOWS_RAY_COUNT << " rays per light";
+	if (Globals::ADAPTIVE_SHADOWS) std::cout << ", adaptive with a first batch of " << glm::clamp(Globals::ADAPTIVE_SHADOWS_FIRST_BATCH, 1, Globals::APPROXIMATE_SHADOWS_RAY_COUNT);
+	std::cout << std::endl;
+
+	for (size_t i = 0; i < shadowStatsCount; i++) {
+		const ShadowStats& stats = shadowStats[i];
+		uint64_t shadingPoints = stats.shadingPoints.load();
+		if (shadingPoints == 0) continue;
+		uint64_t shadowRays = stats.shadowRays.load();
+		double milliseconds = stats.nanoseconds.load() / 1e6;
+
+		// the rays skipped would have cost about as much as the ones cast
+		uint64_t fixedRays = shadingPoints * Globals::APPROXIMATE_SHADOWS_RAY_COUNT;
+		double savedMilliseconds = (double)(fixedRays - shadowRays) * milliseconds / (double)shadowRays;
+
+		std::cout << "  light " << i << " (" << toString(scene.lights[i]->type) << "): " << shadingPoints << " hits, "
+			<< (double)shadowRays / (double)shadingPoints << " shadow rays per hit, " << milliseconds << " ms in shadow queries, about "
+			<< savedMilliseconds << " ms saved" << std::endl;
+	}
 }
 
-colour3 lightingOps::loopAllSceneLightsDoLighting(const colour3& inital_colour, const Scene& scene, const Material& material, const Vertex& intersection, const Vector& normal, const Vector& E, BVH* bvh) {
+colour3 lightingOps::loopAllSceneLightsDoLighting(const colour3& inital_colour, const Scene& scene, const Material& material, const Vertex& intersection, const Vector& normal, const Vector& E, BVH* bvh, const float* shadowIntensities) {
 	colour3 colour = colour3(inital_colour);
-	for (auto&& _light : scene.lights) {
-		if (_light->type == "ambient") {
+	for (size_t lightIndex = 0; lightIndex < scene.lights.size(); lightIndex++) {
+		Light* _light = scene.lights[lightIndex];
+		float tracedShadow = shadowIntensities != nullptr ? shadowIntensities[lightIndex] : -1.0f;
+		switch (_light->type) {
+		case LightType::AMBIENT: {
 			AmbientLight* light = (AmbientLight*)(_light);
 
 			colour += lightingOps::calculateAmbient(light, colour, material, intersection, normal, E);
+			break;
 		}
-		else if (_light->type == "directional") {
+		case LightType::DIRECTIONAL: {
 			DirectionalLight* light = (DirectionalLight*)(_light);
 
-			float shadowIntensity = Globals::SHADOWS ? lightingOps::calcDirectionalLightShadowIntensity(intersection, normal, light, scene, bvh) : 1.0f;
+			float shadowIntensity = !Globals::SHADOWS ? 1.0f : tracedShadow >= 0 ? tracedShadow : recordShadowQuery(lightIndex, [&](int* shadowRays) {
+				return lightingOps::calcDirectionalLightShadowIntensity(intersection, normal, light, scene, bvh, false, shadowRays);
+			});
 			colour += shadowIntensity * (lightingOps::calculateDirectionalPhong(light, colour, material, intersection, normal, E));
+			break;
 		}
-		else if (_light->type == "point") {
+		case LightType::POINT: {
 			PointLight* light = (PointLight*)(_light);
 
 			float distanceIntensity = lightingOps::calcDistanceIntensity(glm::length(light->position - intersection));
-			float shadowIntensity = Globals::SHADOWS ? lightingOps::calcPointLightShadowIntensity(intersection, light, scene, bvh) : 1.0f;
+			float shadowIntensity = !Globals::SHADOWS ? 1.0f : tracedShadow >= 0 ? tracedShadow : recordShadowQuery(lightIndex, [&](int* shadowRays) {
+				return lightingOps::calcPointLightShadowIntensity(intersection, light, scene, bvh, false, shadowRays);
+			});
 
 			colour += shadowIntensity * distanceIntensity * (lightingOps::calculatePointPhong(light, colour, material, intersection, normal, E));
+			break;
 		}
-		else if (_light->type == "spot") {
+		case LightType::SPOT: {
 			SpotLight* light = (SpotLight*)(_light);
 
 			float distanceIntensity = lightingOps::calcDistanceIntensity(glm::length(light->position - intersection));
-			float shadowIntensity = Globals::SHADOWS ? lightingOps::calcSpotLightShadowIntensity(intersection, light, scene, bvh) : 1.0f;
+			float shadowIntensity = !Globals::SHADOWS ? 1.0f : tracedShadow >= 0 ? tracedShadow : recordShadowQuery(lightIndex, [&](int* shadowRays) {
+				return lightingOps::calcSpotLightShadowIntensity(intersection, light, scene, bvh, false, shadowRays);
+			});
 
 			colour += distanceIntensity * shadowIntensity * (lightingOps::calculateSpotPhong(light, colour, material, intersection, normal, E));
+			break;
+		}
 		}
 	}
 	return colour;
 }
 
+void lightingOps::traceShadowPacket(const Scene& scene, BVH* bvh, const Vertex* points, int count, float* shadowIntensities)
+{
+	if (!Globals::SHADOWS || Globals::APPROXIMATE_SHADOWS || !Globals::BVH) return;
+
+	size_t lightCount = scene.lights.size();
+	for (size_t lightIndex = 0; lightIndex < lightCount; lightIndex++) {
+		Light* light = scene.lights[lightIndex];
+		if (light->type == LightType::AMBIENT) continue;
+
+		// the same rays as calc*LightShadowIntensity without soft shadows
+		RayPacket packet;
+		for (int i = 0; i < count; i++) {
+			if (light->type == LightType::DIRECTIONAL) {
+				packet.add(Ray(points[i], -((DirectionalLight*)light)->direction, 0.001f));
+			}
+			else {
+				Vertex position = light->type == LightType::POINT ? ((PointLight*)light)->position : ((SpotLight*)light)->position;
+				packet.add(Ray(points[i], position - points[i], 0.001f, 1.0f));
+			}
+		}
+
+		// infinite planes never shadow a directional light
+		uint32_t occluded = bvh->occludedPacket(packet, light->type == LightType::DIRECTIONAL);
+		statsOps::countRay(statsOps::RayKind::SHADOW, count);
+		for (int i = 0; i < count; i++) {
+			shadowIntensities[i * lightCount + lightIndex] = (occluded & (1u << i)) ? 0.0f : 1.0f;
+		}
+	}
+}
+
 float lightingOps::calcDistanceIntensity(float dist)
 {
 	return (1.0f / 1.0f + 0.001f * dist + 0.00001f * dist * dist);
 }
 
-float lightingOps::calcDirectionalLightShadowIntensity(const Vertex& intersection, const Vector& normal, DirectionalLight* light, const Scene& scene, BVH* bvh, bool pick)
+// Any hit query of a shadow ray, through the BVH unless it is disabled
+static bool shadowRayOccluded(const Ray& ray, const Scene& scene, BVH* bvh, bool ignorePlanes, bool pick)
+{
+	statsOps::countRay(statsOps::RayKind::SHADOW);
+	return (!Globals::BVH) ? rayOccluded(ray, scene.objects, ignorePlanes) : bvh->occludedBVH(ray, ignorePlanes, pick);
+}
+
+// Fraction of APPROXIMATE_SHADOWS_RAY_COUNT soft shadow rays that reach the light, occluded(i) casting ray i.
+// With ADAPTIVE_SHADOWS only a first batch is cast while it agrees: a point fully lit or fully shadowed by every
+// ray of a stratified batch is almost never in a penumbra, so the remaining rays are only spent where they disagree.
+template <typename OccludedFunction>
+static float softShadowVisibility(OccludedFunction occluded, int* shadowRays)
+{
+	int rayCount = Globals::APPROXIMATE_SHADOWS_RAY_COUNT;
+	int firstBatch = Globals::ADAPTIVE_SHADOWS ? glm::clamp(Globals::ADAPTIVE_SHADOWS_FIRST_BATCH, 1, rayCount) : rayCount;
+
+	int unoccluded = 0;
+	for (int i = 0; i < firstBatch; i++) {
+		if (!occluded(i)) unoccluded++;
+	}
+	if (unoccluded == 0 || unoccluded == firstBatch) {
+		if (shadowRays != nullptr) *shadowRays = firstBatch;
+		return (float)unoccluded / (float)firstBatch;
+	}
+
+	for (int i = firstBatch; i < rayCount; i++) {
+		if (!occluded(i)) unoccluded++;
+	}
+	if (shadowRays != nullptr) *shadowRays = rayCount;
+	return (float)unoccluded / (float)rayCount;
+}
+
+float lightingOps::calcDirectionalLightShadowIntensity(const Vertex& intersection, const Vector& normal, DirectionalLight* light, const Scene& scene, BVH* bvh, bool pick, int* shadowRays)
 {
 	if (!Globals::APPROXIMATE_SHADOWS) {
+		if (shadowRays != nullptr) *shadowRays = 1;
 		if (pick) std::cout << "Shadow directional intersection: ";
-		auto& result = (!Globals::BVH) ? rayIntersectObjects(intersection, -light->direction, scene.objects, 0.001f) : bvh->intersectBVH(intersection, -light->direction, 0.001f, pick);
-		return (std::get<0>(result) >= 0.001f && ((std::get<1>(result) != NULL && std::get<1>(result)->type == "plane") || std::get<1>(result) == NULL))
-			? 1.0f : 0.0f;		
+		// infinite planes never shadow a directional light
+		return shadowRayOccluded(Ray(intersection, -light->direction, 0.001f), scene, bvh, true, pick) ? 0.0f : 1.0f;
 	}
 
-	int uninterceptedRays = 0;
-	for (int i = 0; i < Globals::APPROXIMATE_SHADOWS_RAY_COUNT; i++) {
-		Vector randomLightDir = randomVectorBy(Vector(-light->direction),-0.05f,0.05f);
+	samplingOps::SampleSequence samples;
+	return softShadowVisibility([&](int i) {
+		Vector randomLightDir = randomVectorBy(Vector(-light->direction), -0.05f, 0.05f, samples.at(i));
 		if (pick) std::cout << "Shadow directional intersection: ";
-		auto& result = (!Globals::BVH) ? rayIntersectObjects(intersection, -light->direction, scene.objects, 0.001f) : bvh->intersectBVH(intersection, randomLightDir, 0.001f, pick);
-		if (std::get<0>(result) >= -0.001f && ((std::get<1>(result) != NULL && std::get<1>(result)->type == "plane")
-			|| std::get<1>(result) == NULL))
-			uninterceptedRays++;
-	}
-	return (float)uninterceptedRays / (float)Globals::APPROXIMATE_SHADOWS_RAY_COUNT;
+		return shadowRayOccluded(Ray(intersection, randomLightDir, 0.001f), scene, bvh, true, pick);
+	}, shadowRays);
 }
 
-float lightingOps::calcPointLightShadowIntensity(const Vertex& intersection, PointLight* light, const Scene& scene, BVH* bvh, bool pick)
+float lightingOps::calcPointLightShadowIntensity(const Vertex& intersection, PointLight* light, const Scene& scene, BVH* bvh, bool pick, int* shadowRays)
 {
 	if (!Globals::APPROXIMATE_SHADOWS) {
+		if (shadowRays != nullptr) *shadowRays = 1;
 		Vector d = light->position - intersection;
 		if (pick) std::cout << "Shadow point intersection: ";
-		auto& result = (!Globals::BVH) ? rayIntersectObjects(intersection, d, scene.objects, 0.001f) : bvh->intersectBVH(intersection, d, 0.001f, pick);
-		return (std::get<0>(result) > 1.0f || std::get<0>(result) < -0.001f)
-			? 1.0f : 0.0f;
+		// the light sits at t = 1, nothing past it casts a shadow
+		return shadowRayOccluded(Ray(intersection, d, 0.001f, 1.0f), scene, bvh, false, pick) ? 0.0f : 1.0f;
 	}
 
-	int uninterceptedRays = 0;
-	for (int i = 0; i < Globals::APPROXIMATE_SHADOWS_RAY_COUNT; i++) {
-		Vertex randomLightPoint = randomVectorBy(Vector(light->position), -0.2f, 0.2f);
+	samplingOps::SampleSequence samples;
+	return softShadowVisibility([&](int i) {
+		Vertex randomLightPoint = randomVectorBy(Vector(light->position), -0.2f, 0.2f, samples.at(i));
 		Vector d = randomLightPoint - intersection;
 		if (pick) std::cout << "Shadow point intersection: ";
-		auto& result = (!Globals::BVH) ? rayIntersectObjects(intersection, d, scene.objects, 0.001f) : bvh->intersectBVH(intersection, d, 0.001f, pick);
-		if (std::get<0>(result) > 1.0f || std::get<0>(result) < -0.001f)
-			uninterceptedRays++;
-	}
-	return (float)uninterceptedRays / (float)Globals::APPROXIMATE_SHADOWS_RAY_COUNT;
+		return shadowRayOccluded(Ray(intersection, d, 0.001f, 1.0f), scene, bvh, false, pick);
+	}, shadowRays);
 }
 
-float lightingOps::calcSpotLightShadowIntensity(const Vertex& intersection, SpotLight* light, const Scene& scene, BVH* bvh, bool pick)
+float lightingOps::calcSpotLightShadowIntensity(const Vertex& intersection, SpotLight* light, const Scene& scene, BVH* bvh, bool pick, int* shadowRays)
 {
 	if (!Globals::APPROXIMATE_SHADOWS) {
+		if (shadowRays != nullptr) *shadowRays = 1;
 		Vector d = light->position - intersection;
 		if (pick) std::cout << "Shadow spot intersection: ";
-		auto& result = (!Globals::BVH) ? rayIntersectObjects(intersection, d, scene.objects, 0.001f) : bvh->intersectBVH(intersection, d, 0.001f, pick);
-		return (std::get<0>(result) > 1.0f || std::get<0>(result) < -0.001f)
-			? 1.0f : 0.0f;
+		// the light sits at t = 1, nothing past it casts a shadow
+		return shadowRayOccluded(Ray(intersection, d, 0.001f, 1.0f), scene, bvh, false, pick) ? 0.0f : 1.0f;
 	}
 
-	int uninterceptedRays = 0;
-	for (int i = 0; i < Globals::APPROXIMATE_SHADOWS_RAY_COUNT; i++) {
-		Vertex randomLightPoint = randomVectorBy(Vector(light->position), -0.1f, 0.1f);
+	samplingOps::SampleSequence samples;
+	float visibility = softShadowVisibility([&](int i) {
+		Vertex randomLightPoint = randomVectorBy(Vector(light->position), -0.1f, 0.1f, samples.at(i));
 		Vector d = randomLightPoint - intersection;
 		if (pick) std::cout << "Shadow spot intersection: ";
-		auto& result = (!Globals::BVH) ? rayIntersectObjects(intersection, d, scene.objects, 0.001f) : bvh->intersectBVH(intersection, d, 0.001f, pick);
-		if (std::get<0>(result) > 1.0f || std::get<0>(result) < -0.001f)
-			uninterceptedRays++;
-	}
+		return shadowRayOccluded(Ray(intersection, d, 0.001f, 1.0f), scene, bvh, false, pick);
+	}, shadowRays);
 
-	if (uninterceptedRays < Globals::APPROXIMATE_SHADOWS_RAY_COUNT) {
+	if (visibility < 1.0f) {
 		Vector lightDirection = -glm::normalize(light->direction);
 		Vector directionToLight = glm::normalize(light->position - intersection);
 
 		float angle = glm::degrees(glm::acos(glm::dot(lightDirection, directionToLight)));
 
-		return glm::clamp(light->cutoff / angle, 0.0f, 1.0f) * (float)uninterceptedRays / (float)Globals::APPROXIMATE_SHADOWS_RAY_COUNT;
+		return glm::clamp(light->cutoff / angle, 0.0f, 1.0f) * visibility;
 	}
 	else {
 		return 1.0f;
@@ -200,7 +317,7 @@ Vector lightingOps::calcRefraction(const Vector& in, const Vector& normal, float
 
 	float under_sqrt = 1.0f - ((glm::pow(theta_i, 2.0f) * (1.0f - glm::pow(dot_product, 2.0f))) / glm::pow(theta_r, 2.0f));
 	return  (under_sqrt >= 0)
-			? (theta_i * (in - n * dot_product) / theta_r) - (n * sqrt(under_sqrt))
+			? (theta_i * (in - n * dot_product) / theta_r) - (n * glm::sqrt(under_sqrt))
 			: 2 * glm::dot(n, -in) * n + in;
 }
 
@@ -228,13 +345,20 @@ float lightingOps::calcSchlicksApprox(const Vector& in, const Vector& normal, co
 	return  r;
 }
 
+// https://ceng2.ktu.edu.tr/~cakir/files/grafikler/Texture_Mapping.pdf
 void calcTriangleBaryCoords(const Vertex& p, const Triangle& t, float& v, float& w, float& u) {
-	Vector e3 = p - t.vertices[0];
-
-	float d20 = glm::dot(e3, t.e1);
-	float d21 = glm::dot(e3, t.e2);
-
-	v = (t.d11 * d20 - t.d01 * d21) / t.denom;
-	w = (t.d00 * d21 - t.d01 * d20) / t.denom;
+	Vector e1 = t.edge1();
+	Vector e2 = t.edge2();
+	Vector e3 = p - t.vertex(0);
+
+	float d00 = glm::dot(e1, e1);
+	float d01 = glm::dot(e1, e2);
+	float d11 = glm::dot(e2, e2);
+	float denom = d00 * d11 - d01 * d01;
+	float d20 = glm::dot(e3, e1);
+	float d21 = glm::dot(e3, e2);
+
+	v = (d11 * d20 - d01 * d21) / denom;
+	w = (d00 * d21 - d01 * d20) / denom;
 	u = 1.0f - v - w;
 }
\ No newline at end of file
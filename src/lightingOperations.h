@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include "schema.h"
 #include "BVH/BVH.h"
@@ -8,12 +10,44 @@ typedef glm::vec3 point3;
 typedef glm::vec3 colour3;
 
 namespace lightingOps {
-	colour3 loopAllSceneLightsDoLighting(const colour3& inital_colour, const Scene& scene, const Material& material, const Vertex& intersection, const Vector& normal, const Vector& E, BVH* bvh);
+	/// <param name="shadowIntensities">= when given, the shadow intensity of every light indexed like scene.lights, already
+	/// traced e.g. by traceShadowPacket. Lights with a negative entry are queried here.</param>
+	colour3 loopAllSceneLightsDoLighting(const colour3& inital_colour, const Scene& scene, const Material& material, const Vertex& intersection, const Vector& normal, const Vector& E, BVH* bvh, const float* shadowIntensities = nullptr);
+
+	/// <summary>
+	/// Hard shadow intensities of count shading points, traced as one packet of shadow rays per point, directional
+	/// or spot light: rays from neighbouring points towards the same light are nearly as coherent as camera rays.
+	/// Only fills in anything with SHADOWS on, APPROXIMATE_SHADOWS off and the BVH enabled.
+	/// </summary>
+	/// <param name="shadowIntensities">= count rows of scene.lights.size() entries, each set to 0 or 1, or left as is for
+	/// ambient lights</param>
+	void traceShadowPacket(const Scene& scene, BVH* bvh, const Vertex* points, int count, float* shadowIntensities);
+
+	/// <summary>
+	/// Soft shadow work spent on one light over a frame, summed over every worker
+	/// </summary>
+	struct ShadowStats {
+		std::atomic<uint64_t> shadingPoints{ 0 };
+		std::atomic<uint64_t> shadowRays{ 0 };
+		std::atomic<uint64_t> nanoseconds{ 0 };
+	};
+
+	/// <summary>
+	/// Clears the soft shadow statistics, one per light of the scene. Must not run while a frame is traced.
+	/// </summary>
+	void resetShadowStats(const Scene& scene);
+
+	/// <summary>
+	/// Prints the mean shadow rays per hit, the time spent in shadow queries and the estimated time saved by
+	/// ADAPTIVE_SHADOWS for every light. Prints nothing unless soft shadows are on.
+	/// </summary>
+	void printShadowStats(const Scene& scene);
 
 	float calcDistanceIntensity(float dist);
-	float calcDirectionalLightShadowIntensity (const Vertex& intersection, const Vector& normal, DirectionalLight* light, const Scene& scene, BVH* bvh, bool pick = false);
-	float calcPointLightShadowIntensity (const Vertex& intersection, PointLight* light, const Scene& scene, BVH* bvh, bool pick = false);
-	float calcSpotLightShadowIntensity (const Vertex& intersection, SpotLight* light, const Scene& scene, BVH* bvh, bool pick = false);
+	/// <param name="shadowRays">= when given, set to the number of shadow rays cast</param>
+	float calcDirectionalLightShadowIntensity (const Vertex& intersection, const Vector& normal, DirectionalLight* light, const Scene& scene, BVH* bvh, bool pick = false, int* shadowRays = nullptr);
+	float calcPointLightShadowIntensity (const Vertex& intersection, PointLight* light, const Scene& scene, BVH* bvh, bool pick = false, int* shadowRays = nullptr);
+	float calcSpotLightShadowIntensity (const Vertex& intersection, SpotLight* light, const Scene& scene, BVH* bvh, bool pick = false, int* shadowRays = nullptr);
 
 	colour3 calculateAmbient(AmbientLight* light, const colour3& color, const Material& material, const Vertex& intersection, const Vertex& normal, const Vertex& E);
 	colour3 calculateDirectionalPhong(DirectionalLight* light, const colour3& color, const Material& material, const Vertex& intersection, const Vertex& normal, const Vertex& E);
@@ -2,7 +2,10 @@
 // Modified to isolate the main program and use GLM
 
  #include "common.h"
+#include "headless.h"
+#include "benchmark.h"
 
+#include <cstring>
 #include <iostream>
 
 
@@ -108,6 +111,14 @@ timer(int unused)
 int
 main( int argc, char **argv )
 {
+   // render straight to an image file, without creating a window or GL context
+   if ( argc > 1 && strcmp( argv[1], "--headless" ) == 0 ) {
+      return runHeadless( argc - 1, argv + 1 );
+   }
+   if ( argc > 1 && strcmp( argv[1], "--benchmark" ) == 0 ) {
+      return runBenchmark( argc - 1, argv + 1 );
+   }
+
    glutInit( &argc, argv );
    glutInitDisplayMode( GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH );
    glutInitWindowSize( 512, 512 );
@@ -0,0 +1,246 @@
+#include "objLoader.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+
+// Files below this size are parsed on the calling thread, and chunks are never smaller
+static const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+// Face indices of a chunk are resolved once the number of vertices in the chunks before it is known. Absolute
+// indices are stored as they are, 0 based. A negative index is relative to the vertices read so far, so it is stored
+// as the position it refers to within the chunk, which can be before its start, offset by this bias.
+static const int64_t RELATIVE_INDEX = std::numeric_limits<int64_t>::min() / 2;
+
+// What one chunk of the file holds, in file order
+struct ObjChunk {
+	const char* begin;
+	const char* end;
+	std::vector<Vertex> vertices;
+	std::vector<int64_t> indices;
+	size_t faceCount = 0;
+	// the first malformed line, or nullptr
+	const char* error = nullptr;
+	const char* errorMessage = nullptr;
+	// the first index outside of the file's vertices, or 0
+	int64_t badIndex = 0;
+};
+
+static bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* skipSpaces(const char* p, const char* end) {
+	while (p < end && isSpace(*p)) p++;
+	return p;
+}
+
+// from_chars does not take a leading '+'
+static const char* parseFloat(const char* p, const char* end, float& value) {
+	p = skipSpaces(p, end);
+	if (p < end && *p == '+') p++;
+	std::from_chars_result result = std::from_chars(p, end, value);
+	return result.ec == std::errc() ? result.ptr : nullptr;
+}
+
+static const char* parseIndex(const char* p, const char* end, int64_t& value) {
+	if (p < end && *p == '+') p++;
+	std::from_chars_result result = std::from_chars(p, end, value);
+	return result.ec == std::errc() ? result.ptr : nullptr;
+}
+
+static void parseChunk(ObjChunk& chunk) {
+	std::vector<int64_t> corners;
+	const char* p = chunk.begin;
+
+	while (p < chunk.end) {
+		const char* lineEnd = (const char*)memchr(p, '\n', chunk.end - p);
+		if (lineEnd == nullptr) lineEnd = chunk.end;
+		const char* q = skipSpaces(p, lineEnd);
+
+		if (lineEnd - q >= 2 && q[0] == 'v' && isSpace(q[1])) {
+			// v x y z [w], anything after z is ignored
+			Vertex v;
+			q += 2;
+			for (int axis = 0; axis < 3 && q != nullptr; axis++) q = parseFloat(q, lineEnd, v[axis]);
+			if (q == nullptr) {
+				chunk.error = p;
+				chunk.errorMessage = "expected 3 coordinates";
+				return;
+			}
+			chunk.vertices.push_back(v);
+		}
+		else if (lineEnd - q >= 2 && q[0] == 'f' && isSpace(q[1])) {
+			// f v1[/vt1][/vn1] v2... with only the position index kept
+			corners.clear();
+			q = skipSpaces(q + 2, lineEnd);
+			while (q < lineEnd && *q != '#') {
+				int64_t index;
+				q = parseIndex(q, lineEnd, index);
+				if (q == nullptr || index == 0) {
+					chunk.error = p;
+					chunk.errorMessage = "expected a vertex index";
+					return;
+				}
+				if (index > 0) corners.push_back(index - 1);
+				else corners.push_back(RELATIVE_INDEX + (int64_t)chunk.vertices.size() + index);
+
+				while (q < lineEnd && !isSpace(*q)) q++;
+				q = skipSpaces(q, lineEnd);
+			}
+			if (corners.size() < 3) {
+				chunk.error = p;
+				chunk.errorMessage = "a face needs at least 3 vertices";
+				return;
+			}
+
+			for (size_t i = 1; i + 1 < corners.size(); i++) {
+				chunk.indices.push_back(corners[0]);
+				chunk.indices.push_back(corners[i]);
+				chunk.indices.push_back(corners[i + 1]);
+			}
+			chunk.faceCount++;
+		}
+
+		p = lineEnd + 1;
+	}
+}
+
+// Splits the text into about count chunks, each ending after a line end
+static std::vector<ObjChunk> splitChunks(const char* text, size_t size, size_t count) {
+	std::vector<ObjChunk> chunks(count);
+	const char* begin = text;
+	const char* end = text + size;
+	for (size_t i = 0; i < count; i++) {
+		const char* chunkEnd = end;
+		if (i + 1 < count) {
+			chunkEnd = std::max(begin, text + size / count * (i + 1));
+			const char* newline = (const char*)memchr(chunkEnd, '\n', end - chunkEnd);
+			chunkEnd = newline == nullptr ? end : newline + 1;
+		}
+		chunks[i].begin = begin;
+		chunks[i].end = chunkEnd;
+		begin = chunkEnd;
+	}
+	return chunks;
+}
+
+// Line number of a position in the text, counting from 1
+static size_t lineNumber(const char* text, const char* position) {
+	return std::count(text, position, '\n') + 1;
+}
+
+bool objOps::loadObj(const std::string& path, ObjMesh& mesh, BS::thread_pool* pool) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in.is_open()) {
+		std::cout << "*** unable to open OBJ file " << path << "\n";
+		return false;
+	}
+	in.seekg(0, std::ios::end);
+	size_t size = (size_t)in.tellg();
+	in.seekg(0, std::ios::beg);
+	std::vector<char> text(size);
+	if (!in.read(text.data(), (std::streamsize)size)) {
+		std::cout << "*** unable to read OBJ file " << path << "\n";
+		return false;
+	}
+
+	size_t chunkCount = 1;
+	if (pool != nullptr) {
+		chunkCount = std::min<size_t>(std::max<size_t>(size / MIN_CHUNK_BYTES, 1), 4 * pool->get_thread_count());
+	}
+	std::vector<ObjChunk> chunks = splitChunks(text.data(), size, chunkCount);
+
+	auto parseChunks = [&chunks](const size_t a, const size_t b) {
+		for (size_t i = a; i < b; i++) parseChunk(chunks[i]);
+	};
+	if (chunkCount > 1) pool->parallelize_loop(chunkCount, parseChunks, chunkCount).wait();
+	else parseChunks(0, chunkCount);
+
+	// every chunk's vertices and indices start where those of the chunks before it end
+	std::vector<size_t> firstVertex(chunkCount + 1, 0);
+	std::vector<size_t> firstIndex(chunkCount + 1, 0);
+	mesh = ObjMesh();
+	for (size_t i = 0; i < chunkCount; i++) {
+		const ObjChunk& chunk = chunks[i];
+		if (chunk.error != nullptr) {
+			std::cout << "*** " << chunk.errorMessage << " on line " << lineNumber(text.data(), chunk.error) << " of " << path << "\n";
+			return false;
+		}
+		firstVertex[i + 1] = firstVertex[i] + chunk.vertices.size();
+		firstIndex[i + 1] = firstIndex[i] + chunk.indices.size();
+		mesh.faceCount += chunk.faceCount;
+	}
+
+	size_t vertexCount = firstVertex[chunkCount];
+	if (vertexCount > std::numeric_limits<uint32_t>::max()) {
+		std::cout << "*** too many vertices in " << path << "\n";
+		return false;
+	}
+	mesh.vertices.resize(vertexCount);
+	mesh.indices.resize(firstIndex[chunkCount]);
+
+	auto joinChunks = [&](const size_t a, const size_t b) {
+		for (size_t i = a; i < b; i++) {
+			ObjChunk& chunk = chunks[i];
+			std::copy(chunk.vertices.begin(), chunk.vertices.end(), mesh.vertices.begin() + firstVertex[i]);
+			for (size_t j = 0; j < chunk.indices.size(); j++) {
+				int64_t index = chunk.indices[j];
+				if (index < RELATIVE_INDEX / 2) index = index - RELATIVE_INDEX + (int64_t)firstVertex[i];
+				if (index < 0 || index >= (int64_t)vertexCount) {
+					chunk.badIndex = index + 1;
+					break;
+				}
+				mesh.indices[firstIndex[i] + j] = (uint32_t)index;
+			}
+		}
+	};
+	if (chunkCount > 1) pool->parallelize_loop(chunkCount, joinChunks, chunkCount).wait();
+	else joinChunks(0, chunkCount);
+
+	for (const ObjChunk& chunk : chunks) {
+		if (chunk.badIndex != 0) {
+			std::cout << "*** face refers to vertex " << chunk.badIndex << " of " << vertexCount << " in " << path << "\n";
+			return false;
+		}
+	}
+
+	mesh.duplicateVertices = deduplicateVertices(mesh.vertices, mesh.indices);
+	return true;
+}
+
+size_t objOps::deduplicateVertices(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+	struct PositionHash {
+		size_t operator()(const Vertex& v) const {
+			uint32_t bits[3];
+			memcpy(bits, &v[0], sizeof(bits));
+			uint64_t hash = bits[0] * 0x9e3779b97f4a7c15ull;
+			hash = (hash ^ bits[1]) * 0x9e3779b97f4a7c15ull;
+			hash = (hash ^ bits[2]) * 0x9e3779b97f4a7c15ull;
+			return (size_t)(hash ^ (hash >> 32));
+		}
+	};
+	struct PositionEqual {
+		bool operator()(const Vertex& a, const Vertex& b) const { return memcmp(&a[0], &b[0], sizeof(float) * 3) == 0; }
+	};
+
+	std::unordered_map<Vertex, uint32_t, PositionHash, PositionEqual> firstOccurrence;
+	firstOccurrence.reserve(vertices.size());
+	std::vector<uint32_t> remap(vertices.size());
+	uint32_t kept = 0;
+	for (size_t i = 0; i < vertices.size(); i++) {
+		auto inserted = firstOccurrence.emplace(vertices[i], kept);
+		if (inserted.second) vertices[kept++] = vertices[i];
+		remap[i] = inserted.first->second;
+	}
+
+	size_t removed = vertices.size() - kept;
+	if (removed == 0) return 0;
+	vertices.resize(kept);
+	for (uint32_t& index : indices) index = remap[index];
+	return removed;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "schema.h"
+#include "BS_thread_pool.hpp"
+
+/// <summary>
+/// Wavefront OBJ import. Only vertex positions and faces are read; texture coordinates, normals, groups and
+/// materials are skipped. Faces with more than 3 vertices are split into a fan of triangles, and positive as well as
+/// negative (relative) indices are understood, with or without the /vt/vn parts.
+/// The file is read into memory in one piece and tokenized in place, without copying lines. Large files are split
+/// into chunks at line ends that are parsed on the thread pool, then joined in file order.
+/// </summary>
+namespace objOps {
+	// A triangle mesh with positions shared between its triangles, 3 indices per triangle
+	struct ObjMesh {
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+		size_t faceCount = 0;
+		// positions dropped because an earlier vertex had exactly the same position
+		size_t duplicateVertices = 0;
+
+		size_t triangleCount() const { return indices.size() / 3; }
+	};
+
+	/// <summary>
+	/// Loads the OBJ file at path into mesh and merges vertices with identical positions
+	/// </summary>
+	/// <param name="pool">parses large files in parallel chunks when given, must not be called from one of its threads</param>
+	/// <returns>false if the file could not be read or is malformed, after printing why</returns>
+	bool loadObj(const std::string& path, ObjMesh& mesh, BS::thread_pool* pool = nullptr);
+
+	/// <summary>
+	/// Merges vertices with bitwise identical positions, keeping the first of each and rewriting the indices to it
+	/// </summary>
+	/// <returns>the number of vertices removed</returns>
+	size_t deduplicateVertices(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+}
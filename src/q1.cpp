@@ -5,17 +5,18 @@
 
 #include "common.h"
 #include "raytracer.h"
+#include "renderer.h"
 #include "Globals.h"
-#include "BS_thread_pool.hpp"
+#include "lightingOperations.h"
+#include "wavefront.h"
+#include "stats.h"
 
 #include <iostream>
-#define M_PI 3.14159265358979323846264338327950288
 #include <cmath>
 
 #include <glm/glm.hpp>
 
-BS::thread_pool pool;
-std::chrono::steady_clock::time_point t1;
+std::chrono::high_resolution_clock::time_point t1;
 bool finished = false;
 const char *WINDOW_TITLE = "Ray Tracing";
 const double FRAME_RATE_MS = 1;
@@ -23,32 +24,8 @@ const double FRAME_RATE_MS = 1;
 colour3 texture[1<<16]; // big enough for a row of pixels
 point3 vertices[2]; // xy+u for start and end of line
 GLuint Window;
-int vp_width, vp_height;
 float drawing_y = 0;
-
-point3 eye;
-float d = 1;
-
-float pixel_x_offsets = 0;
-float pixel_y_offsets = 0;
-
-//----------------------------------------------------------------------------
-
-point3 s(int x, int y) {
-	float aspect_ratio = (float)vp_width / vp_height;
-	float h = d * (float)tan((M_PI * fov) / 180.0 / 2.0);
-	float w = h * aspect_ratio;
-   
-	float top = h;
-	float bottom = -h;
-	float left = -w;
-	float right = w;
-   
-	float u = left + (right - left) * (x + 0.5f) / vp_width;
-	float v = bottom + (top - bottom) * (y + 0.5f) / vp_height;
-   
-	return point3(u, v, -d);
-}
+Framebuffer frame;
 
 //----------------------------------------------------------------------------
 
@@ -101,6 +78,13 @@ void display( void ) {
 	// (when fract(drawing_y) == 0.0, draw one buffer, when it is 0.5 draw the other)
 	
 	if (drawing_y <= 0.5) {
+		// start tracing the whole frame in the background; scanlines are drawn as their tiles finish
+		if (drawing_y == 0) {
+			finishFrame();
+			frame = Framebuffer(vp_width, vp_height);
+			beginFrame(frame);
+		}
+
 		glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
 		glFlush();
@@ -112,42 +96,15 @@ void display( void ) {
 	} else if (drawing_y >= 1.0 && drawing_y <= vp_height + 0.5) {
 		int y = int(drawing_y) - 1;
 
-		// only recalculate if this is a new scanline
+		// only upload if this is a new scanline
 		if (drawing_y == int(drawing_y)) {
 
-			// Thread poool library to parallelize Trace:
-			//https://github.com/bshoshany/thread-pool
-
-			auto loop = [y](const int a, const int b)
-			{
-				for (int i = a; i < b; ++i) {
-					colour3 result;
-					Object* hitObject = nullptr;
-					Vertex pixel = s(i, y);
-
-					bool res = trace(eye, pixel , result, hitObject, false);
-					if (!res) {
-						texture[i] = background_colour;
-					}
-					else if (Globals::ANTI_ALIASING && ((Globals::ANTI_ALIAS_INFINITE_PLANES &&
-						hitObject->type == "plane") || 
-						(hitObject->type != "plane")) ) 
-					{
-						colour3 c1, c2, c3, c4;
-						trace(eye, pixel + Vertex(pixel_x_offsets,0,0), c1, hitObject, false);
-						trace(eye, pixel + Vertex(-pixel_x_offsets, 0, 0), c2, hitObject, false);
-						trace(eye, pixel + Vertex(0, pixel_y_offsets, 0), c3, hitObject, false);
-						trace(eye, pixel + Vertex(0, -pixel_y_offsets, 0), c4, hitObject, false);
-
-						texture[i] = (result + c1 + c2 + c3 + c4) / 5.0f;
-					}
-					else 
-					{
-						texture[i] = result;
-					}
-				}
-			};
-			auto futures = pool.parallelize_loop(vp_width, loop);
+			// wait for the tiles covering this scanline
+			if (!isRowFinished(y)) return;
+
+			for (int i = 0; i < vp_width; ++i) {
+				texture[i] = frame.at(i, y);
+			}
 
 			// to ensure a power-of-two texture, get the next highest power of two
 			// https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
@@ -161,7 +118,6 @@ void display( void ) {
 			v |= v >> 16;
 			v++;
 
-			futures.wait();
 			glTexImage1D( GL_TEXTURE_1D, 0, GL_RGB, v, 0, GL_RGB, GL_FLOAT, texture );
 			vertices[0] = point3(0, y, 0);
 			vertices[1] = point3(v, y, 1);
@@ -184,6 +140,13 @@ void display( void ) {
 			auto time_min = std::chrono::duration_cast<std::chrono::minutes>(time);
 			auto time_hour = std::chrono::duration_cast<std::chrono::hours>(time);
 			std::cout << "Render time: " << time_hour.count() << " hours / " << time_min.count() << " mins / " << time_sec.count() << " secs" << std::endl;
+
+			const TileScheduler* tiles = finishFrame();
+			if (tiles != nullptr) tiles->printTimings();
+			lightingOps::printShadowStats(scene);
+			printAntiAliasingStats();
+			statsOps::printStats(statsOps::collect());
+			wavefrontOps::printStats();
 		}
 	}
 
@@ -239,13 +202,7 @@ void reshape( int width, int height ) {
 	// GLfloat aspect = GLfloat(width)/height;
 	// glm::mat4  projection = glm::ortho( -aspect, aspect, -1.0f, 1.0f, -1.0f, 1.0f );
 	// glUniformMatrix4fv( Projection, 1, GL_FALSE, glm::value_ptr(projection) );
-	vp_width = width;
-	vp_height = height;
+	setViewport(width, height);
 	glUniform2f( Window, width, height );
 	drawing_y = 0;
-
-	pixel_x_offsets = s(1,0).x - s(0,0).x;
-	pixel_y_offsets = s(0,1).y - s(0,0).y;
-	pixel_x_offsets += pixel_x_offsets * 0.25f;
-	pixel_y_offsets += pixel_y_offsets * 0.25f;
 }
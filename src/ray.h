@@ -0,0 +1,49 @@
+#pragma once
+
+#include <limits>
+#include <glm/glm.hpp>
+
+#include "schema.h"
+
+/// <summary>
+/// A ray with the values every box test needs computed once: the inverse direction and the sign of each component.
+/// Hits only count inside (tMin, tMax). Closest hit queries shrink tMax to the nearest hit found so far, so boxes and
+/// primitives behind it are culled, and a shadow ray can stop at its light by starting with tMax = 1.
+/// </summary>
+struct Ray {
+	Vertex origin;
+	Vector direction;
+	Vector invDirection;
+	int dirIsNeg[3];
+	float tMin;
+	float tMax;
+
+	Ray(const Vertex& _origin, const Vector& _direction, float _tMin = 0.0f, float _tMax = std::numeric_limits<float>::infinity()) :
+		origin(_origin), direction(_direction), invDirection(1.0f / _direction), tMin(_tMin), tMax(_tMax) {
+		dirIsNeg[0] = invDirection.x < 0;
+		dirIsNeg[1] = invDirection.y < 0;
+		dirIsNeg[2] = invDirection.z < 0;
+	}
+
+	/// <summary>
+	/// A ray whose inverse direction is already known, e.g. one taken out of a RayPacket
+	/// </summary>
+	Ray(const Vertex& _origin, const Vector& _direction, const Vector& _invDirection, float _tMin, float _tMax) :
+		origin(_origin), direction(_direction), invDirection(_invDirection), tMin(_tMin), tMax(_tMax) {
+		dirIsNeg[0] = invDirection.x < 0;
+		dirIsNeg[1] = invDirection.y < 0;
+		dirIsNeg[2] = invDirection.z < 0;
+	}
+
+	Vertex at(float t) const {
+		return origin + t * direction;
+	}
+
+	/// <summary>
+	/// The same ray in another space, e.g. an object's model space through its inverse transformations.
+	/// The direction is not renormalized, so t values carry over between the two spaces.
+	/// </summary>
+	Ray transformed(const glm::mat4& transformations) const {
+		return Ray(transformations * glm::vec4(origin, 1.0f), transformations * glm::vec4(direction, 0.0f), tMin, tMax);
+	}
+};
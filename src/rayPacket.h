@@ -0,0 +1,78 @@
+#pragma once
+
+#include <limits>
+
+#include "ray.h"
+
+/// <summary>
+/// Up to MAX_SIZE rays traced through the BVH together, stored as structure of arrays so one SIMD box test checks
+/// 4 of them at once. Packets pay off when their rays are coherent: camera rays of neighbouring pixels, or shadow rays
+/// from neighbouring hits to the same light. Lanes past size hold an empty [tMin, tMax] interval and never hit a box.
+/// </summary>
+struct RayPacket {
+	static const int MAX_SIZE = 16;
+
+	alignas(16) float origin[3][MAX_SIZE];
+	alignas(16) float direction[3][MAX_SIZE];
+	alignas(16) float invDirection[3][MAX_SIZE];
+	alignas(16) float tMin[MAX_SIZE];
+	alignas(16) float tMax[MAX_SIZE];
+	int size = 0;
+
+	RayPacket() {
+		for (int lane = 0; lane < MAX_SIZE; lane++) {
+			for (int axis = 0; axis < 3; axis++) {
+				origin[axis][lane] = 0;
+				direction[axis][lane] = 1.0f;
+				invDirection[axis][lane] = 1.0f;
+			}
+			tMin[lane] = std::numeric_limits<float>::infinity();
+			tMax[lane] = -std::numeric_limits<float>::infinity();
+		}
+	}
+
+	/// <summary>
+	/// Adds a ray to the packet, which must not be full
+	/// </summary>
+	/// <returns>the lane of the ray</returns>
+	int add(const Ray& ray) {
+		int lane = size++;
+		for (int axis = 0; axis < 3; axis++) {
+			origin[axis][lane] = ray.origin[axis];
+			direction[axis][lane] = ray.direction[axis];
+			invDirection[axis][lane] = ray.invDirection[axis];
+		}
+		tMin[lane] = ray.tMin;
+		tMax[lane] = ray.tMax;
+		return lane;
+	}
+
+	/// <summary>
+	/// The ray of a lane, with the lane's current tMax
+	/// </summary>
+	Ray ray(int lane) const {
+		return Ray(Vertex(origin[0][lane], origin[1][lane], origin[2][lane]), Vector(direction[0][lane], direction[1][lane], direction[2][lane]),
+			Vector(invDirection[0][lane], invDirection[1][lane], invDirection[2][lane]), tMin[lane], tMax[lane]);
+	}
+
+	/// <summary>
+	/// Number of 4 lane groups holding rays
+	/// </summary>
+	int groupCount() const { return (size + 3) / 4; }
+
+	/// <summary>
+	/// Whether every ray points the same way along each axis, the condition for tracing the rays together:
+	/// they then visit the children of a node in the same order and share the near and far slab of every box.
+	/// </summary>
+	/// <param name="dirIsNeg">= set to the shared sign of each axis</param>
+	bool sameSigns(int dirIsNeg[3]) const {
+		if (size == 0) return false;
+		for (int axis = 0; axis < 3; axis++) {
+			dirIsNeg[axis] = invDirection[axis][0] < 0;
+			for (int lane = 1; lane < size; lane++) {
+				if ((invDirection[axis][lane] < 0) != (dirIsNeg[axis] != 0)) return false;
+			}
+		}
+		return true;
+	}
+};
@@ -11,23 +11,29 @@
 #include "geometryIntersect.h"
 #include "lightingOperations.h"
 
+#include <chrono>
 #include <iostream>
+#include <iterator>
 #include <fstream>
 #include <string>
+#include <vector>
 #include <glm/glm.hpp>
 #include <glm/gtx/string_cast.hpp>
+#include <glm/gtx/transform.hpp>
 #include <glm/gtx/vector_angle.hpp>
 
 #include "schema.h"
 #include "json2scene.h"
+#include "sceneCache.h"
 #include "Globals.h"
+#include "renderer.h"
+#include "sampler.h"
 
 const char* PATH = "scenes/";
 
 double fov = 60;
 colour3 background_colour(0, 0, 0);
 
-json jscene;
 Scene scene;
 BVH* bvh;
 
@@ -42,11 +48,34 @@ namespace Globals {
 	bool SCHLICKS_APPROXIMATION = false;
 	bool ANTI_ALIASING = false;
 	bool ANTI_ALIAS_INFINITE_PLANES = true;
+	int ANTI_ALIASING_SAMPLES = 4;
+	bool ANTI_ALIASING_ADAPTIVE = true;
+	float ANTI_ALIASING_THRESHOLD = 0.1f;
 	bool BVH = true;
 	bool BVH_INCLUDE_PLANES = true;
+	bool BVH_FLAT = true;
+	int BVH_WIDTH = 8;
+	BVHBuildMethod BVH_BUILD_METHOD = BVHBuildMethod::SAH;
+	int BVH_SAH_BINS = 16;
+	float BVH_REBUILD_COST_RATIO = 1.3f;
+	bool WORLD_SPACE_TRIANGLES = true;
+	bool SCENE_CACHE = true;
 	bool APPROXIMATE_SHADOWS = false;
 	int APPROXIMATE_SHADOWS_RAY_COUNT = 10;
-	int RAYTRACER_DEPTH = 8;
+	bool ADAPTIVE_SHADOWS = true;
+	int ADAPTIVE_SHADOWS_FIRST_BATCH = 4;
+	SamplerType SAMPLER = SamplerType::SOBOL;
+	int RAYTRACER_DEPTH = 4;
+	float RAY_WEIGHT_THRESHOLD = 0.5f / 255.0f;
+	bool RUSSIAN_ROULETTE = false;
+	float RUSSIAN_ROULETTE_WEIGHT = 0.1f;
+	// packets only walk the binary tree, which single rays through the default 8 wide layout outrun on c and i
+	int RAY_PACKET_SIZE = 0;
+	bool WAVEFRONT = false;
+	bool WAVEFRONT_SORT = true;
+	int WAVEFRONT_TILE_SIZE = 64;
+	bool HEATMAP = false;
+	int TILE_SIZE = 16;
 }
 
 /****************************************************************************/
@@ -71,7 +100,7 @@ glm::vec3 vector_to_vec3(const std::vector<float>& v) {
 
 /****************************************************************************/
 
-void choose_scene(char const* fn) {
+SceneLoadTimes choose_scene(char const* fn) {
 	if (fn == NULL) {
 		fn = "g";
 		std::cout << "Using default input file " << PATH << fn << ".json\n";
@@ -80,25 +109,146 @@ void choose_scene(char const* fn) {
 	std::cout << "Loading scene " << fn << std::endl;
 
 	std::string fname = PATH + std::string(fn) + ".json";
-	std::fstream in(fname);
+	std::ifstream in(fname, std::ios::binary);
 	if (!in.is_open()) {
 		std::cout << "Unable to open scene file " << fname << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
-	in >> jscene;
-
-	if (json_to_scene(jscene, scene) < 0) {
-		std::cout << "Error in scene file " << fname << std::endl;
-		exit(EXIT_FAILURE);
+	auto t0 = std::chrono::high_resolution_clock::now();
+	std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	uint64_t sourceHash = sceneCacheOps::hashBytes(source.data(), source.size());
+
+	// the cache is only used while it was written from this exact JSON text
+	std::string cacheName = PATH + std::string(fn) + ".rtscene";
+	sceneCacheOps::MappedCache cache;
+	sceneCacheOps::SceneArrays arrays;
+	bool cached = Globals::SCENE_CACHE && cache.open(cacheName, sourceHash);
+	if (!cached) {
+		json jscene = json::parse(source);
+		if (json_to_arrays(jscene, arrays, fname.substr(0, fname.find_last_of("/\\") + 1), &pool) < 0) {
+			std::cout << "Error in scene file " << fname << std::endl;
+			exit(EXIT_FAILURE);
+		}
 	}
+	auto t1 = std::chrono::high_resolution_clock::now();
+
+	sceneCacheOps::SceneView view = cached ? cache.view() : arrays.view();
+	sceneCacheOps::buildScene(view, scene);
 
 	fov = scene.camera.field;
 	background_colour = scene.camera.background;
-	bvh = new BVH(scene);
+	auto t2 = std::chrono::high_resolution_clock::now();
+	bvh = new BVH(scene, &pool);
+	auto t3 = std::chrono::high_resolution_clock::now();
+
+	SceneLoadTimes times;
+	times.parseMilliseconds = std::chrono::duration<double, std::milli>(t1 - t0).count();
+	times.conversionMilliseconds = std::chrono::duration<double, std::milli>(t2 - t1).count();
+	times.bvhBuildMilliseconds = std::chrono::duration<double, std::milli>(t3 - t2).count();
+	times.cached = cached;
+
+	// written after the timings so a first load is not charged for the cache
+	if (Globals::SCENE_CACHE && !cached && !sceneCacheOps::writeCache(cacheName, sourceHash, view)) {
+		std::cout << "Unable to write scene cache " << cacheName << std::endl;
+	}
+
+	std::cout << std::endl << (cached ? "Scene cache load time: " : "JSON parse time: ") << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms"
+		<< ", scene conversion time: " << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " ms"
+		<< ", BVH build time: " << std::chrono::duration_cast<std::chrono::milliseconds>(t3 - t2).count() << " ms";
 
 	if (!Globals::BVH) std::cout << std::endl << "Note: BVH is disabled!";
-	std::cout << std::endl << "Finished loading (BVH size = " << bvh->tree.getNodeCount() << "). Now tracing..." << std::endl;	
+	if (bvh->getOverlappingNodeCount() > 0) std::cout << std::endl << "Bad BVH nodes: " << bvh->getOverlappingNodeCount() << " with an overlap of " << BVH::OVERLAP_WARNING_PERCENTAGE << "% or more between their bounding boxes";
+	std::cout << std::endl << "Finished loading (BVH builder = " << (Globals::BVH_BUILD_METHOD == Globals::BVHBuildMethod::SAH ? "sah" : "median")
+		<< ", width = " << Globals::BVH_WIDTH << ", size = " << bvh->tree.getNodeCount() << ", SAH cost = " << bvh->getSAHCost() << "). Now tracing..." << std::endl;
+
+	SceneMemory memory = getSceneMemory();
+	auto megabytes = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+	std::cout << "Scene memory: " << megabytes(memory.totalBytes()) << " MB (triangles " << megabytes(memory.triangleBytes) << " MB for " << memory.triangleCount
+		<< ", vertices " << megabytes(memory.vertexBytes) << " MB for " << memory.vertexCount << ", other objects " << megabytes(memory.objectBytes)
+		<< " MB, " << scene.materials.size() << " materials " << megabytes(memory.materialBytes) << " MB, BVH " << megabytes(memory.bvhBytes) << " MB)" << std::endl;
+	return times;
+}
+
+SceneMemory getSceneMemory() {
+	SceneMemory memory;
+	auto addMesh = [&memory](Mesh* mesh) {
+		memory.objectBytes += sizeof(Mesh);
+		memory.triangleCount += mesh->triangles.size();
+		memory.triangleBytes += mesh->triangles.capacity() * sizeof(Triangle);
+		memory.vertexCount += mesh->vertices.size();
+		memory.vertexBytes += mesh->vertices.capacity() * sizeof(Vertex);
+	};
+	for (Object* object : scene.objects) {
+		switch (object->type) {
+		case ObjectType::SPHERE: memory.objectBytes += sizeof(Sphere); break;
+		case ObjectType::PLANE: memory.objectBytes += sizeof(Plane); break;
+		case ObjectType::CYLINDER: memory.objectBytes += sizeof(Cylinder); break;
+		case ObjectType::TRIANGLE: memory.triangleBytes += sizeof(Triangle); memory.triangleCount++; break;
+		case ObjectType::MESH: addMesh((Mesh*)object); break;
+		case ObjectType::INSTANCE: memory.objectBytes += sizeof(Instance); break;
+		}
+	}
+	// shared meshes count once, however many instances place them
+	for (Mesh* mesh : scene.meshes) addMesh(mesh);
+	memory.objectBytes += (scene.objects.capacity() + scene.meshes.capacity()) * sizeof(Object*);
+	memory.materialBytes = scene.materials.capacity() * sizeof(Material);
+	if (bvh != nullptr) memory.bvhBytes = bvh->getMemoryBytes();
+	return memory;
+}
+
+void animate_scene(int frame) {
+	if (scene.spins.empty()) return;
+
+	auto t0 = std::chrono::high_resolution_clock::now();
+	for (const Spin& spin : scene.spins) {
+		glm::mat4 transformations = glm::translate(spin.center) * glm::rotate(glm::radians(spin.degrees * frame), spin.axis)
+			* glm::translate(-spin.center) * spin.transformations;
+		switch (spin.object->type) {
+		case ObjectType::SPHERE: ((Sphere*)spin.object)->setTransformations(transformations); break;
+		case ObjectType::CYLINDER: ((Cylinder*)spin.object)->setTransformations(transformations); break;
+		case ObjectType::MESH: ((Mesh*)spin.object)->setTransformations(transformations); break;
+		case ObjectType::INSTANCE: ((Instance*)spin.object)->setTransformations(transformations); break;
+		default: break;
+		}
+	}
+	float builtCost = bvh->getBuiltSAHCost();
+	BVH::UpdateStats update = bvh->update();
+	auto t1 = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Frame " << frame << ": " << scene.spins.size() << " objects moved, BVH update time: " << std::chrono::duration<double, std::milli>(t1 - t0).count()
+		<< " ms, SAH cost after refit = " << update.refitCost << " (built " << builtCost << ")";
+	if (update.fullRebuild) std::cout << ", rebuilt to cost " << update.cost;
+	else if (update.rebuiltSubtrees > 0) std::cout << ", rebuilt " << update.rebuiltSubtrees << " subtrees to cost " << update.cost;
+	if (update.overlappingNodes > 0) std::cout << ", " << update.overlappingNodes << " bad BVH nodes with an overlap of " << BVH::OVERLAP_WARNING_PERCENTAGE << "% or more";
+	std::cout << std::endl;
+}
+
+void unload_scene() {
+	delete bvh;
+	bvh = nullptr;
+
+	// objects and lights have no virtual destructors, so each is deleted as its own type
+	for (Object* object : scene.objects) {
+		switch (object->type) {
+		case ObjectType::SPHERE: delete (Sphere*)object; break;
+		case ObjectType::PLANE: delete (Plane*)object; break;
+		case ObjectType::CYLINDER: delete (Cylinder*)object; break;
+		case ObjectType::MESH: delete (Mesh*)object; break;
+		case ObjectType::TRIANGLE: delete (Triangle*)object; break;
+		case ObjectType::INSTANCE: delete (Instance*)object; break;
+		}
+	}
+	for (Mesh* mesh : scene.meshes) delete mesh;
+	for (Light* light : scene.lights) {
+		switch (light->type) {
+		case LightType::AMBIENT: delete (AmbientLight*)light; break;
+		case LightType::DIRECTIONAL: delete (DirectionalLight*)light; break;
+		case LightType::POINT: delete (PointLight*)light; break;
+		case LightType::SPOT: delete (SpotLight*)light; break;
+		}
+	}
+	scene = Scene();
 }
 
 bool isReflective(Material material) {
@@ -109,59 +259,203 @@ bool isTransmissive(Material material) {
 	return (material.transmissive.r > 0 || material.transmissive.g > 0 || material.transmissive.b > 0);
 }
 
-colour3 recursiveRayTrace(const Vertex& e, const Vector& d, bool& hit, Object*& hitObject, bool pick, int depth) {
-	if (depth > 4) {
-		return background_colour;
+// Adds a reflection or transmission ray to the shading unless it cannot matter: its colour is clamped to [0, 1],
+// so it changes the pixel by at most its path weight, and rays under RAY_WEIGHT_THRESHOLD are dropped.
+// With RUSSIAN_ROULETTE, rays under RUSSIAN_ROULETTE_WEIGHT survive with a probability proportional to
+// their weight and are scaled up to make up for the ones dropped. This is not unbiased: a hit's colour is still
+// clamped to [0, 1] after a survivor's scaled up colour is added, so bright survivors lose what they were scaled by.
+static void addChildRay(HitShading& shading, const colour3& parentPathWeight, const Vector& direction, const colour3& weight, statsOps::RayKind kind) {
+	colour3 pathWeight = parentPathWeight * weight;
+	float contribution = glm::max(pathWeight.r, glm::max(pathWeight.g, pathWeight.b));
+	if (contribution < Globals::RAY_WEIGHT_THRESHOLD) return;
+
+	colour3 childWeight = weight;
+	if (Globals::RUSSIAN_ROULETTE && contribution < Globals::RUSSIAN_ROULETTE_WEIGHT) {
+		float survival = contribution / Globals::RUSSIAN_ROULETTE_WEIGHT;
+		if (samplingOps::uniform() >= survival) return;
+		childWeight /= survival;
 	}
 
-	float minT = depth == 0 ? 1 : 0.001f;
-	hit = depth == 0 ? false : true;
-
-	auto& result = (!Globals::BVH) ? rayIntersectObjects(e, d, scene.objects, minT) : bvh->intersectBVH(e, d, minT, pick);
+	shading.childDirection[shading.childCount] = direction;
+	shading.childWeight[shading.childCount] = childWeight;
+	shading.childKind[shading.childCount] = kind;
+	shading.childCount++;
+}
 
+void shadeHit(const Vertex& origin, const Vector& d, const std::tuple<float, Object*, Vector, Vertex>& result, const colour3& pathWeight, const float* shadowIntensities, HitShading& shading) {
 	Object* object = std::get<1>(result);
-	if (object == NULL) return background_colour;
-	else hit = true;
-
-	colour3 colour = colour3(0, 0, 0);
-	float t = std::get<0>(result);
 	Vector normal = std::get<2>(result);
 	Vertex intersection = std::get<3>(result);
-	Material& material = object->material;
-	Vector E = glm::normalize(e - intersection);
-
-	if (pick && depth ==0) std::cout << "HIT: " << object->type << ", t=" << t << ", n=" << glm::to_string(normal) << std::endl;
+	const Material& material = scene.materials[object->material];
+	Vector E = glm::normalize(origin - intersection);
 
-	colour += lightingOps::loopAllSceneLightsDoLighting(colour, scene, material, intersection, normal, E, bvh);
+	colour3 colour = lightingOps::loopAllSceneLightsDoLighting(colour3(0, 0, 0), scene, material, intersection, normal, E, bvh, shadowIntensities);
 
 	// a refraction value is assumed to exist if SCHLICKS_APPROXIMATION is toggled
 	float schlicks = (isReflective(material) || isTransmissive(material)) ? lightingOps::calcSchlicksApprox(d, normal, material) : 1.0f;
 
+	// the transmitted colour is blended over everything else at this hit, reflections included
+	bool transmits = Globals::TRANSMISSIVE && isTransmissive(material);
+	colour3 blend = transmits ? 1.0f - material.transmissive : colour3(1.0f);
+
+	shading.colour = colour * blend;
+	shading.childCount = 0;
+
 	if (Globals::REFLECTIONS && isReflective(material)) {
 		Vector reflectedRay = 2 * glm::dot(normal, E) * normal - E;
-		colour3 reflectColor = recursiveRayTrace(intersection, reflectedRay, hit, hitObject, pick, depth + 1);
-		colour += reflectColor * (Globals::SCHLICKS_APPROXIMATION ? colour3(schlicks)* material.reflective : material.reflective);
+		colour3 reflectance = Globals::SCHLICKS_APPROXIMATION ? colour3(schlicks) * material.reflective : material.reflective;
+		addChildRay(shading, pathWeight, reflectedRay, reflectance * blend, statsOps::RayKind::REFLECTION);
 	}
 
-	if (Globals::TRANSMISSIVE && isTransmissive(material)) {
+	if (transmits) {
 		Vector reflectedRay = (Globals::REFRACTION && material.refraction > 0) ? lightingOps::calcRefraction(d, normal, material.refraction) : d;
-		colour = (colour * (1.0f - material.transmissive)) + recursiveRayTrace(intersection, reflectedRay, hit, hitObject, pick, depth + 1) * material.transmissive;
+		addChildRay(shading, pathWeight, reflectedRay, material.transmissive, statsOps::RayKind::REFRACTION);
 	}
+}
 
-	colour = glm::clamp(colour, 0.0f, 1.0f);
+// One ray of the tree traced for a pixel. Every hit can spawn a reflection and a transmission ray, and the colour of
+// a hit is clamp(local * localWeight + sum of child colour * child weight), so children are evaluated first and
+// added to their parent's sum as they finish.
+struct RayFrame {
+	Vertex origin;
+	Vector direction;
+	int depth;
+	colour3 pathWeight;      // product of the child weights from the camera down to this ray
+	statsOps::RayKind kind;
+
+	bool shaded = false;
+	colour3 sum = colour3(0);
+	Vertex intersection;
+	HitShading shading;
+	int nextChild = 0;
+
+	RayFrame(const Vertex& _origin, const Vector& _direction, int _depth, const colour3& _pathWeight, statsOps::RayKind _kind) :
+		origin(_origin), direction(_direction), depth(_depth), pathWeight(_pathWeight), kind(_kind) {}
+};
+
+// The closest hit and the shadow intensities of every light of a camera ray, when a ray packet already traced them
+struct PrimaryHit {
+	std::tuple<float, Object*, Vector, Vertex> result;
+	const float* shadowIntensities;
+};
+
+// Intersects and lights the frame's ray and queues its reflection and transmission rays
+static bool shadeRayFrame(RayFrame& frame, bool& hit, Object*& hitObject, Vector& hitNormal, const PrimaryHit* primaryHit, bool pick) {
+	float minT = frame.depth == 0 ? 1 : 0.001f;
+	const PrimaryHit* traced = frame.depth == 0 ? primaryHit : nullptr;
+
+	Ray ray(frame.origin, frame.direction, minT);
+	if (traced == nullptr) statsOps::countRay(frame.kind);
+	auto result = traced != nullptr ? traced->result : (!Globals::BVH) ? rayIntersectObjects(ray, scene.objects) : bvh->intersectBVH(ray, pick);
+
+	Object* object = std::get<1>(result);
+	if (object == NULL) return false;
 
-	hitObject = object;
+	if (frame.depth == 0) {
+		hit = true;
+		hitObject = object;
+		hitNormal = std::get<2>(result);
+		if (pick) std::cout << "HIT: " << toString(object->type) << ", t=" << std::get<0>(result) << ", n=" << glm::to_string(hitNormal) << std::endl;
+	}
+
+	shadeHit(frame.origin, frame.direction, result, frame.pathWeight, traced != nullptr ? traced->shadowIntensities : nullptr, frame.shading);
+	frame.shaded = true;
+	frame.sum = frame.shading.colour;
+	frame.intersection = std::get<3>(result);
+	return true;
+}
+
+// Traces the tree of reflection and transmission rays of a camera ray depth first on an explicit stack,
+// so the work per pixel follows the rays that can still change it rather than 2^depth
+static colour3 traceRayTree(const Vertex& e, const Vector& d, bool& hit, Object*& hitObject, Vector& hitNormal, const PrimaryHit* primaryHit, bool pick) {
+	// at most one frame per depth is on the stack, reused between pixels of the same thread
+	static thread_local std::vector<RayFrame> stack;
+	stack.clear();
+	stack.push_back(RayFrame(e, d, 0, colour3(1.0f), statsOps::RayKind::PRIMARY));
+
+	colour3 colour = background_colour;
+	while (!stack.empty()) {
+		RayFrame& frame = stack.back();
+		colour3 finished;
+
+		if (!frame.shaded && !shadeRayFrame(frame, hit, hitObject, hitNormal, primaryHit, pick)) {
+			finished = background_colour;
+		}
+		else if (frame.nextChild < frame.shading.childCount) {
+			int child = frame.nextChild++;
+			if (frame.depth + 1 > Globals::RAYTRACER_DEPTH) {
+				frame.sum += background_colour * frame.shading.childWeight[child];
+			}
+			else {
+				RayFrame childFrame(frame.intersection, frame.shading.childDirection[child], frame.depth + 1, frame.pathWeight * frame.shading.childWeight[child], frame.shading.childKind[child]);
+				stack.push_back(childFrame);
+			}
+			continue;
+		}
+		else {
+			finished = glm::clamp(frame.sum, 0.0f, 1.0f);
+		}
 
+		stack.pop_back();
+		if (stack.empty()) {
+			colour = finished;
+		}
+		else {
+			RayFrame& parent = stack.back();
+			parent.sum += finished * parent.shading.childWeight[parent.nextChild - 1];
+		}
+	}
 	return colour;
 }
 
 bool trace(const point3& e, const point3& s, colour3& colour, Object*& objectHit, bool pick) {
+	Vector normalHit;
+	return trace(e, s, colour, objectHit, normalHit, pick);
+}
+
+bool trace(const point3& e, const point3& s, colour3& colour, Object*& objectHit, Vector& normalHit, bool pick) {
 	Vector d = s - e;
 	bool hit = false;
-	colour = recursiveRayTrace(e, d, hit, objectHit, pick, 0);
+	colour = traceRayTree(e, d, hit, objectHit, normalHit, nullptr, pick);
 	return hit;
 }
 
+void tracePacket(const point3& e, CameraSample* samples, int count) {
+	RayPacket packet;
+	std::tuple<float, Object*, Vector, Vertex> results[RayPacket::MAX_SIZE];
+	for (int i = 0; i < count; i++) packet.add(Ray(e, samples[i].s - e, 1.0f));
+	statsOps::countRay(statsOps::RayKind::PRIMARY, count);
+
+	if (Globals::BVH) bvh->intersectPacket(packet, results);
+	else for (int i = 0; i < count; i++) results[i] = rayIntersectObjects(packet.ray(i), scene.objects);
+
+	// hits that missed everything get no shadow rays and are never shaded
+	Vertex points[RayPacket::MAX_SIZE];
+	int pointSample[RayPacket::MAX_SIZE];
+	int pointCount = 0;
+	for (int i = 0; i < count; i++) {
+		if (std::get<1>(results[i]) == NULL) continue;
+		pointSample[pointCount] = i;
+		points[pointCount++] = std::get<3>(results[i]);
+	}
+
+	static thread_local std::vector<float> shadowIntensities;
+	size_t lightCount = scene.lights.size();
+	shadowIntensities.assign(pointCount * lightCount, -1.0f);
+	lightingOps::traceShadowPacket(scene, bvh, points, pointCount, shadowIntensities.data());
+
+	const float* sampleShadows[RayPacket::MAX_SIZE] = {};
+	for (int p = 0; p < pointCount; p++) sampleShadows[pointSample[p]] = shadowIntensities.data() + p * lightCount;
+
+	for (int i = 0; i < count; i++) {
+		CameraSample& sample = samples[i];
+		PrimaryHit primaryHit = { results[i], sampleShadows[i] };
+		samplingOps::beginPixel(sample.x, sample.y);
+		sample.hit = false;
+		sample.colour = traceRayTree(e, sample.s - e, sample.hit, sample.objectHit, sample.normalHit, &primaryHit, false);
+	}
+}
+
 bool SingleTrace(const point3& e, const point3& s, colour3& colour, Object*& objectHit, bool pick)
 {
 	return false;
@@ -1,13 +1,77 @@
 #pragma once
+#include <tuple>
 #include <glm/glm.hpp>
 #include "schema.h"
+#include "stats.h"
 
 typedef glm::vec3 point3;
 typedef glm::vec3 colour3;
 
+class BVH;
+
 extern double fov;
 extern colour3 background_colour;
+extern BVH* bvh;
+extern Scene scene;
+// directory the scene files are loaded from
+extern const char* PATH;
+
+// Wall clock time of each step of choose_scene
+struct SceneLoadTimes {
+	double parseMilliseconds = 0;
+	double conversionMilliseconds = 0;
+	double bvhBuildMilliseconds = 0;
+	// the scene was read from its binary cache rather than parsed from JSON
+	bool cached = false;
+};
+
+// Bytes held by the loaded scene, by kind
+struct SceneMemory {
+	size_t triangleCount = 0;
+	size_t vertexCount = 0;
+	size_t triangleBytes = 0;
+	size_t vertexBytes = 0;
+	// spheres, cylinders, planes, instances and the mesh objects themselves
+	size_t objectBytes = 0;
+	size_t materialBytes = 0;
+	size_t bvhBytes = 0;
 
-void choose_scene(char const *fn);
+	size_t totalBytes() const { return triangleBytes + vertexBytes + objectBytes + materialBytes + bvhBytes; }
+};
+
+SceneLoadTimes choose_scene(char const *fn);
+SceneMemory getSceneMemory();
+// Moves every spinning object to where it is at frame, 0 being the scene as loaded, and updates the BVH to match
+void animate_scene(int frame);
+// Frees the scene and its BVH so another one can be loaded
+void unload_scene();
 bool trace(const point3 &e, const point3 &s, colour3 &colour, Object*& objectHit, bool pick);
+// also returns the normal of the primary hit, used to find edges for anti-aliasing
+bool trace(const point3& e, const point3& s, colour3& colour, Object*& objectHit, Vector& normalHit, bool pick);
+// A camera ray traced as part of a batch, by tracePacket or wavefrontOps::traceBatch
+struct CameraSample {
+	point3 s;
+	int x = 0, y = 0;  // the pixel the sampler is seeded from before the ray is shaded
+	colour3 colour;
+	Object* objectHit = nullptr;
+	Vector normalHit;
+	bool hit = false;
+};
+
+// Traces count (at most RayPacket::MAX_SIZE) camera rays from e like trace does, but finds their primary hits and the
+// hard shadows at those hits as ray packets. Reflection and transmission rays are still traced one by one.
+void tracePacket(const point3& e, CameraSample* samples, int count);
+// Lit colour of a hit and the reflection and transmission rays it spawns
+struct HitShading {
+	colour3 colour;  // local lighting, times the part of it the transmitted colour does not cover
+	int childCount = 0;
+	Vector childDirection[2];
+	colour3 childWeight[2];  // a child's colour is added to its parent's times this weight
+	statsOps::RayKind childKind[2];
+};
+
+// Shades the closest hit of the ray from origin along d. pathWeight is the product of the child weights from the
+// camera down to the ray, used to drop children that cannot change the pixel. shadowIntensities may hold shadows
+// already traced, see lightingOps::loopAllSceneLightsDoLighting.
+void shadeHit(const Vertex& origin, const Vector& d, const std::tuple<float, Object*, Vector, Vertex>& result, const colour3& pathWeight, const float* shadowIntensities, HitShading& shading);
 bool SingleTrace(const point3& e, const point3& s, colour3& colour, Object*& objectHit, bool pick);
@@ -0,0 +1,337 @@
+#include "renderer.h"
+#include "Globals.h"
+#include "sampler.h"
+#include "stats.h"
+#include "lightingOperations.h"
+#include "rayPacket.h"
+#include "wavefront.h"
+#include "heatmap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <vector>
+#ifndef M_PI
+#define M_PI 3.14159265358979323846264338327950288
+#endif
+
+BS::thread_pool pool;
+int vp_width, vp_height;
+
+point3 eye;
+float d = 1;
+
+float pixel_x_offsets = 0;
+float pixel_y_offsets = 0;
+float pixel_width = 0;
+float pixel_height = 0;
+
+static std::unique_ptr<TileScheduler> scheduler;
+
+// Adaptive anti-aliasing traces a frame in two passes over the same tiles: one sample per pixel first,
+// then extra samples only for pixels on an edge, found by comparing the first samples of neighbouring pixels.
+struct PrimarySample {
+	colour3 colour;
+	Object* object = nullptr;  // nullptr for the background
+	Vector normal;
+};
+
+// primary normals closer than this (cosine of about 25 degrees) lie on the same smooth surface
+static const float EDGE_NORMAL_COSINE = 0.9f;
+
+static Framebuffer* frameInFlight = nullptr;
+static bool adaptiveFrame = false;
+static std::vector<PrimarySample> primarySamples;
+static std::unique_ptr<TileScheduler> refineScheduler;
+static std::atomic<int> supersampledPixels{ 0 };
+
+//----------------------------------------------------------------------------
+
+point3 s(int x, int y) {
+	float aspect_ratio = (float)vp_width / vp_height;
+	float h = d * (float)tan((M_PI * fov) / 180.0 / 2.0);
+	float w = h * aspect_ratio;
+
+	float top = h;
+	float bottom = -h;
+	float left = -w;
+	float right = w;
+
+	float u = left + (right - left) * (x + 0.5f) / vp_width;
+	float v = bottom + (top - bottom) * (y + 0.5f) / vp_height;
+
+	return point3(u, v, -d);
+}
+
+//----------------------------------------------------------------------------
+
+void setViewport(int width, int height) {
+	vp_width = width;
+	vp_height = height;
+
+	pixel_width = s(1, 0).x - s(0, 0).x;
+	pixel_height = s(0, 1).y - s(0, 0).y;
+	pixel_x_offsets = pixel_width;
+	pixel_y_offsets = pixel_height;
+	pixel_x_offsets += pixel_x_offsets * 0.25f;
+	pixel_y_offsets += pixel_y_offsets * 0.25f;
+}
+
+//----------------------------------------------------------------------------
+
+colour3 tracePixel(int x, int y) {
+	colour3 result;
+	Object* hitObject = nullptr;
+	Vertex pixel = s(x, y);
+	samplingOps::beginPixel(x, y);
+
+	bool res = trace(eye, pixel, result, hitObject, false);
+	if (!res) {
+		return background_colour;
+	}
+	else if (Globals::ANTI_ALIASING && ((Globals::ANTI_ALIAS_INFINITE_PLANES &&
+		hitObject->type == ObjectType::PLANE) ||
+		(hitObject->type != ObjectType::PLANE)))
+	{
+		// the extra samples cover the box the old cross of four samples reached, 1.25 pixels either way (see setViewport)
+		samplingOps::SampleSequence samples;
+		for (int i = 0; i < Globals::ANTI_ALIASING_SAMPLES; i++) {
+			glm::vec3 u = samples.at(i);
+			colour3 sample;
+			trace(eye, pixel + Vertex((2.0f * u.x - 1.0f) * pixel_x_offsets, (2.0f * u.y - 1.0f) * pixel_y_offsets, 0), sample, hitObject, false);
+			result += sample;
+		}
+
+		return result / (float)(Globals::ANTI_ALIASING_SAMPLES + 1);
+	}
+	else
+	{
+		return result;
+	}
+}
+
+//----------------------------------------------------------------------------
+
+// First pass of adaptive anti-aliasing: a single sample through the centre of the pixel
+static PrimarySample tracePrimarySample(int x, int y) {
+	PrimarySample sample;
+	samplingOps::beginPixel(x, y);
+	if (!trace(eye, s(x, y), sample.colour, sample.object, sample.normal, false)) {
+		sample.colour = background_colour;
+		sample.object = nullptr;
+	}
+	else {
+		sample.normal = glm::normalize(sample.normal);
+	}
+	return sample;
+}
+
+// Keeps the first samples of a batch for the second pass of adaptive frames and writes their colours to the framebuffer
+static void storeFirstSamples(const CameraSample* samples, int count, Framebuffer& framebuffer) {
+	for (int i = 0; i < count; i++) {
+		const CameraSample& traced = samples[i];
+		PrimarySample sample;
+		if (traced.hit) {
+			sample.colour = traced.colour;
+			sample.object = traced.objectHit;
+			sample.normal = glm::normalize(traced.normalHit);
+		}
+		else {
+			sample.colour = background_colour;
+		}
+		if (adaptiveFrame) primarySamples[(size_t)traced.y * framebuffer.width + traced.x] = sample;
+		framebuffer.at(traced.x, traced.y) = sample.colour;
+	}
+}
+
+// First samples of a whole tile, traced in packets of RAY_PACKET_SIZE camera rays from square-ish blocks of pixels
+static void tracePacketTile(const Tile& tile, Framebuffer& framebuffer) {
+	const int blockWidth = Globals::RAY_PACKET_SIZE >= 8 ? 4 : 2;
+	const int blockHeight = Globals::RAY_PACKET_SIZE / blockWidth;
+	CameraSample samples[RayPacket::MAX_SIZE];
+
+	for (int by = tile.y0; by < tile.y1; by += blockHeight) {
+		for (int bx = tile.x0; bx < tile.x1; bx += blockWidth) {
+			int count = 0;
+			for (int y = by; y < std::min(by + blockHeight, tile.y1); ++y) {
+				for (int x = bx; x < std::min(bx + blockWidth, tile.x1); ++x) {
+					samples[count].s = s(x, y);
+					samples[count].x = x;
+					samples[count].y = y;
+					count++;
+				}
+			}
+
+			tracePacket(eye, samples, count);
+			storeFirstSamples(samples, count, framebuffer);
+		}
+	}
+}
+
+// First samples of a whole tile, traced as one wavefront batch
+static void traceWavefrontTile(const Tile& tile, Framebuffer& framebuffer) {
+	static thread_local std::vector<CameraSample> samples;
+	samples.clear();
+	for (int y = tile.y0; y < tile.y1; ++y) {
+		for (int x = tile.x0; x < tile.x1; ++x) {
+			CameraSample sample;
+			sample.s = s(x, y);
+			sample.x = x;
+			sample.y = y;
+			samples.push_back(sample);
+		}
+	}
+
+	wavefrontOps::traceBatch(eye, samples.data(), (int)samples.size());
+	storeFirstSamples(samples.data(), (int)samples.size(), framebuffer);
+}
+
+// A pixel is on an edge when any of its four neighbours sees another object, a differently oriented
+// part of the same one, or a colour further away than ANTI_ALIASING_THRESHOLD in any channel, e.g. a shadow boundary.
+static bool isEdgePixel(int x, int y, int width, int height) {
+	const PrimarySample& sample = primarySamples[(size_t)y * width + x];
+	if (!Globals::ANTI_ALIAS_INFINITE_PLANES && sample.object != nullptr && sample.object->type == ObjectType::PLANE) return false;
+
+	const int neighbours[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	for (auto& offset : neighbours) {
+		int nx = x + offset[0], ny = y + offset[1];
+		if (nx < 0 || ny < 0 || nx >= width || ny >= height) continue;
+
+		const PrimarySample& neighbour = primarySamples[(size_t)ny * width + nx];
+		if (neighbour.object != sample.object) return true;
+		if (sample.object != nullptr && glm::dot(sample.normal, neighbour.normal) < EDGE_NORMAL_COSINE) return true;
+		colour3 difference = glm::abs(sample.colour - neighbour.colour);
+		if (glm::max(difference.r, glm::max(difference.g, difference.b)) > Globals::ANTI_ALIASING_THRESHOLD) return true;
+	}
+	return false;
+}
+
+// Second pass of adaptive anti-aliasing: stratified samples inside the footprint of every edge pixel, averaged with its first sample
+static void refineTile(const Tile& tile, Framebuffer& framebuffer) {
+	int supersampled = 0;
+	for (int y = tile.y0; y < tile.y1; ++y) {
+		for (int x = tile.x0; x < tile.x1; ++x) {
+			const PrimarySample& primary = primarySamples[(size_t)y * framebuffer.width + x];
+			if (!isEdgePixel(x, y, framebuffer.width, framebuffer.height)) {
+				framebuffer.at(x, y) = primary.colour;
+				continue;
+			}
+
+			heatmapOps::PixelStart cost = heatmapOps::beginPixel();
+			samplingOps::beginPixel(x, y, 1);
+			samplingOps::SampleSequence samples;
+			Vertex pixel = s(x, y);
+			colour3 result = primary.colour;
+			for (int i = 0; i < Globals::ANTI_ALIASING_SAMPLES; i++) {
+				glm::vec3 u = samples.at(i);
+				colour3 sample;
+				Object* hitObject = nullptr;
+				if (!trace(eye, pixel + Vertex((u.x - 0.5f) * pixel_width, (u.y - 0.5f) * pixel_height, 0), sample, hitObject, false)) {
+					sample = background_colour;
+				}
+				result += sample;
+			}
+			framebuffer.at(x, y) = result / (float)(Globals::ANTI_ALIASING_SAMPLES + 1);
+			heatmapOps::endPixel(x, y, cost);
+			supersampled++;
+		}
+	}
+	supersampledPixels += supersampled;
+}
+
+// Starts the second pass once every first sample is in
+static void startRefinePass() {
+	Framebuffer& framebuffer = *frameInFlight;
+	refineScheduler = std::make_unique<TileScheduler>(framebuffer.width, framebuffer.height, scheduler->getTileSize());
+	refineScheduler->start(pool, [&framebuffer](const Tile& tile) { refineTile(tile, framebuffer); });
+}
+
+void beginFrame(Framebuffer& framebuffer) {
+	finishFrame();
+	lightingOps::resetShadowStats(scene);
+	statsOps::reset();
+	wavefrontOps::resetStats();
+	heatmapOps::beginFrame(framebuffer.width, framebuffer.height);
+
+	frameInFlight = &framebuffer;
+	adaptiveFrame = Globals::ANTI_ALIASING && Globals::ANTI_ALIASING_ADAPTIVE;
+	refineScheduler.reset();
+	supersampledPixels = 0;
+	if (adaptiveFrame) primarySamples.assign((size_t)framebuffer.width * framebuffer.height, PrimarySample());
+
+	// full anti-aliasing traces the extra samples of a pixel right after its first one, so only the other modes trace
+	// their first samples in packets or wavefront batches. A wavefront batch is a whole tile, so it gets larger tiles.
+	// Heatmaps need the cost of every pixel on its own, so they trace pixel by pixel.
+	bool batched = (adaptiveFrame || !Globals::ANTI_ALIASING) && !Globals::HEATMAP;
+	bool wavefront = batched && Globals::WAVEFRONT;
+	bool packets = batched && !wavefront && Globals::RAY_PACKET_SIZE > 0;
+
+	scheduler = std::make_unique<TileScheduler>(framebuffer.width, framebuffer.height, wavefront ? Globals::WAVEFRONT_TILE_SIZE : Globals::TILE_SIZE);
+	scheduler->start(pool, [&framebuffer, wavefront, packets](const Tile& tile)
+	{
+		if (wavefront) {
+			traceWavefrontTile(tile, framebuffer);
+			return;
+		}
+		if (packets) {
+			tracePacketTile(tile, framebuffer);
+			return;
+		}
+		for (int y = tile.y0; y < tile.y1; ++y) {
+			for (int x = tile.x0; x < tile.x1; ++x) {
+				heatmapOps::PixelStart cost = heatmapOps::beginPixel();
+				if (adaptiveFrame) {
+					PrimarySample& sample = primarySamples[(size_t)y * framebuffer.width + x];
+					sample = tracePrimarySample(x, y);
+					framebuffer.at(x, y) = sample.colour;
+				}
+				else {
+					framebuffer.at(x, y) = tracePixel(x, y);
+				}
+				heatmapOps::endPixel(x, y, cost);
+			}
+		}
+	});
+}
+
+bool isRowFinished(int y) {
+	if (scheduler == nullptr) return false;
+	if (!adaptiveFrame) return scheduler->isRowFinished(y);
+
+	// rows are only final after the second pass, which needs every first sample
+	if (refineScheduler == nullptr) {
+		if (!scheduler->isFinished()) return false;
+		scheduler->wait();
+		startRefinePass();
+	}
+	return refineScheduler->isRowFinished(y);
+}
+
+const TileScheduler* finishFrame() {
+	if (scheduler == nullptr) return nullptr;
+	scheduler->wait();
+	if (adaptiveFrame) {
+		if (refineScheduler == nullptr) startRefinePass();
+		refineScheduler->wait();
+		scheduler->addTimings(*refineScheduler);
+		// the timings are folded in once, and the frame counts as finished from here on
+		adaptiveFrame = false;
+	}
+	return scheduler.get();
+}
+
+void printAntiAliasingStats() {
+	if (!Globals::ANTI_ALIASING || frameInFlight == nullptr) return;
+	int pixelCount = frameInFlight->width * frameInFlight->height;
+	if (Globals::ANTI_ALIASING_ADAPTIVE) {
+		std::cout << "Adaptive anti-aliasing: " << supersampledPixels << " of " << pixelCount << " pixels supersampled ("
+			<< 100.0 * supersampledPixels / pixelCount << "%) with " << Globals::ANTI_ALIASING_SAMPLES << " extra samples each" << std::endl;
+	}
+}
+
+const TileScheduler* renderFrame(Framebuffer& framebuffer) {
+	beginFrame(framebuffer);
+	return finishFrame();
+}
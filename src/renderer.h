@@ -0,0 +1,53 @@
+#pragma once
+
+#include "raytracer.h"
+#include "framebuffer.h"
+#include "tileScheduler.h"
+#include "BS_thread_pool.hpp"
+
+// Shared between the GLUT front end (q1.cpp) and the headless renderer.
+extern BS::thread_pool pool;
+extern int vp_width, vp_height;
+extern point3 eye;
+extern float d;
+
+point3 s(int x, int y);
+
+/// <summary>
+/// Sets the viewport size used by s(x, y) and the anti-aliasing sample offsets.
+/// </summary>
+void setViewport(int width, int height);
+
+/// <summary>
+/// Traces a single pixel, including the anti-aliasing samples when enabled. Used when ANTI_ALIASING_ADAPTIVE is off,
+/// adaptive anti-aliasing needs the neighbouring pixels and runs as a second pass over the frame instead.
+/// </summary>
+colour3 tracePixel(int x, int y);
+
+/// <summary>
+/// Starts tracing the framebuffer tile by tile on the pool and returns immediately.
+/// Any frame still in flight is finished first. The framebuffer must outlive the frame.
+/// </summary>
+void beginFrame(Framebuffer& framebuffer);
+
+/// <summary>
+/// True once scanline y of the frame in flight has been fully traced. With adaptive anti-aliasing, this is the
+/// call that starts the second pass once the first one is done, so the GLUT front end keeps polling it.
+/// </summary>
+bool isRowFinished(int y);
+
+/// <summary>
+/// Blocks until the frame in flight is traced.
+/// </summary>
+/// <returns>the scheduler of the last frame, holding its per-tile timings, or nullptr if no frame was started</returns>
+const TileScheduler* finishFrame();
+
+/// <summary>
+/// Traces every pixel of the current viewport into the framebuffer using all threads of the pool.
+/// </summary>
+const TileScheduler* renderFrame(Framebuffer& framebuffer);
+
+/// <summary>
+/// Prints how many pixels of the last frame adaptive anti-aliasing supersampled. Prints nothing when it is off.
+/// </summary>
+void printAntiAliasingStats();
@@ -0,0 +1,78 @@
+#include "sampler.h"
+#include "Globals.h"
+
+static thread_local PCG32 generator;
+
+// splitmix64 finalizer, spreads neighbouring pixel coordinates over the whole seed space
+static uint64_t mixBits(uint64_t v) {
+	v ^= v >> 30;
+	v *= 0xbf58476d1ce4e5b9ull;
+	v ^= v >> 27;
+	v *= 0x94d049bb133111ebull;
+	v ^= v >> 31;
+	return v;
+}
+
+void samplingOps::beginPixel(int x, int y, uint32_t pass) {
+	uint64_t key = ((uint64_t)(uint32_t)y << 32) | (uint32_t)x;
+	generator.seed(mixBits(key), mixBits(key ^ 0x9e3779b97f4a7c15ull) + pass);
+}
+
+float samplingOps::uniform() {
+	return generator.nextFloat();
+}
+
+// ***************************************************************************************************************** //
+// Sobol sequence
+// Direction numbers of the first three dimensions (Joe and Kuo, "Constructing Sobol sequences with better
+// two-dimensional projections", 2008): the van der Corput sequence, then the primitive polynomials x + 1 and
+// x^2 + x + 1 with initial numbers m = {1} and m = {1, 3}.
+// ***************************************************************************************************************** //
+
+struct SobolDirections {
+	uint32_t v[3][32];
+
+	SobolDirections() {
+		for (int k = 0; k < 32; k++) v[0][k] = 1u << (31 - k);
+
+		v[1][0] = 1u << 31;
+		for (int k = 1; k < 32; k++) v[1][k] = v[1][k - 1] ^ (v[1][k - 1] >> 1);
+
+		v[2][0] = 1u << 31;
+		v[2][1] = 3u << 30;
+		for (int k = 2; k < 32; k++) v[2][k] = v[2][k - 1] ^ v[2][k - 2] ^ (v[2][k - 2] >> 2);
+	}
+};
+
+static const SobolDirections sobolDirections;
+
+static uint32_t sobolBits(uint32_t index, int dimension) {
+	uint32_t bits = 0;
+	for (int k = 0; index != 0; k++, index >>= 1) {
+		if (index & 1) bits ^= sobolDirections.v[dimension][k];
+	}
+	return bits;
+}
+
+// top 24 bits, so the result stays below 1 as a float
+static float bitsToFloat(uint32_t bits) {
+	return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+glm::vec3 samplingOps::sobol(uint32_t index) {
+	return glm::vec3(bitsToFloat(sobolBits(index, 0)), bitsToFloat(sobolBits(index, 1)), bitsToFloat(sobolBits(index, 2)));
+}
+
+samplingOps::SampleSequence::SampleSequence() {
+	for (int dimension = 0; dimension < 3; dimension++) scramble[dimension] = generator.nextUInt();
+}
+
+glm::vec3 samplingOps::SampleSequence::at(uint32_t index) const {
+	if (Globals::SAMPLER == Globals::SamplerType::RANDOM) {
+		return glm::vec3(uniform(), uniform(), uniform());
+	}
+	// XOR with a random value keeps the stratification of the sequence while decorrelating pixels and lights
+	return glm::vec3(bitsToFloat(sobolBits(index, 0) ^ scramble[0]),
+		bitsToFloat(sobolBits(index, 1) ^ scramble[1]),
+		bitsToFloat(sobolBits(index, 2) ^ scramble[2]));
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+
+/// <summary>
+/// PCG32 generator (O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically Good Algorithms for
+/// Random Number Generation", 2014). 16 bytes of state, so every thread can own one without any locking.
+/// </summary>
+class PCG32 {
+public:
+	PCG32() { seed(0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull); }
+	PCG32(uint64_t state, uint64_t sequence) { seed(state, sequence); }
+
+	void seed(uint64_t initState, uint64_t sequence) {
+		state = 0;
+		increment = (sequence << 1) | 1;
+		nextUInt();
+		state += initState;
+		nextUInt();
+	}
+
+	uint32_t nextUInt() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ull + increment;
+		uint32_t xorShifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+		uint32_t rotation = (uint32_t)(old >> 59);
+		return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+	}
+
+	/// <summary>
+	/// Uniform float in [0, 1)
+	/// </summary>
+	float nextFloat() {
+		return (nextUInt() >> 8) * (1.0f / 16777216.0f);
+	}
+
+private:
+	uint64_t state;
+	uint64_t increment;
+};
+
+/// <summary>
+/// Per thread random numbers and sample sequences for soft shadows and anti-aliasing. Every pixel reseeds the calling
+/// thread's generator from its coordinates, so an image comes out the same no matter which worker traced which tile.
+/// </summary>
+namespace samplingOps {
+	/// <summary>
+	/// Reseeds the calling thread's generator for pixel (x, y)
+	/// </summary>
+	/// <param name="pass">= gives a pixel traced more than once per frame an independent stream for every pass</param>
+	void beginPixel(int x, int y, uint32_t pass = 0);
+
+	/// <summary>
+	/// Uniform float in [0, 1) from the calling thread's generator
+	/// </summary>
+	float uniform();
+
+	/// <summary>
+	/// The first points of the 3D Sobol sequence, scrambled with a random digit shift drawn from the calling
+	/// thread's generator. Any power of two run of points starting at 0 is stratified in every dimension, so
+	/// a handful of them covers the unit cube far more evenly than the same number of independent random points.
+	/// With Globals::SAMPLER = RANDOM, the points are independent uniform ones instead, for comparison.
+	/// </summary>
+	class SampleSequence {
+	public:
+		SampleSequence();
+
+		/// <summary>
+		/// Point number index in [0, 1)^3
+		/// </summary>
+		glm::vec3 at(uint32_t index) const;
+
+	private:
+		uint32_t scramble[3];
+	};
+
+	/// <summary>
+	/// Sobol point number index in [0, 1)^3, without any scrambling
+	/// </summary>
+	glm::vec3 sobol(uint32_t index);
+}
@@ -0,0 +1,379 @@
+#include "sceneCache.h"
+#include "Globals.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// the arrays are written and mapped as raw bytes
+static_assert(std::is_trivially_copyable<Material>::value && sizeof(Material) == 17 * sizeof(float), "Material must be 17 packed floats");
+static_assert(sizeof(glm::mat4) == 16 * sizeof(float) && sizeof(Vertex) == 3 * sizeof(float), "glm types must be packed floats");
+
+static const char CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+// bump whenever the layout of the file or of the flat structs changes
+static const uint32_t CACHE_VERSION = 4;
+static const uint64_t ARRAY_ALIGNMENT = 16;
+
+// Where each array starts, in bytes from the start of the file
+struct CacheArray {
+	uint64_t offset;
+	uint32_t count;
+	uint32_t elementSize;
+};
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	uint64_t sourceHash;
+	float cameraField;
+	float background[3];
+	CacheArray materials;
+	CacheArray transforms;
+	CacheArray objects;
+	CacheArray vertices;
+	CacheArray indices;
+	CacheArray meshes;
+	CacheArray lights;
+	CacheArray spins;
+	CacheArray dependencies;
+	CacheArray dependencyPaths;
+};
+
+sceneCacheOps::SceneView sceneCacheOps::SceneArrays::view() const {
+	SceneView view;
+	view.camera = camera;
+	view.materials = materials.data();
+	view.materialCount = (uint32_t)materials.size();
+	view.transforms = transforms.data();
+	view.transformCount = (uint32_t)transforms.size();
+	view.objects = objects.data();
+	view.objectCount = (uint32_t)objects.size();
+	view.vertices = vertices.data();
+	view.vertexCount = (uint32_t)vertices.size();
+	view.indices = indices.data();
+	view.indexCount = (uint32_t)indices.size();
+	view.meshes = meshes.data();
+	view.meshCount = (uint32_t)meshes.size();
+	view.lights = lights.data();
+	view.lightCount = (uint32_t)lights.size();
+	view.spins = spins.data();
+	view.spinCount = (uint32_t)spins.size();
+	view.dependencies = dependencies.data();
+	view.dependencyCount = (uint32_t)dependencies.size();
+	view.dependencyPaths = dependencyPaths.data();
+	view.dependencyPathLength = (uint32_t)dependencyPaths.size();
+	return view;
+}
+
+// Size and modification time of a file, false if it does not exist
+static bool fileStamp(const std::string& path, uint64_t& size, int64_t& modified) {
+	std::error_code error;
+	size = (uint64_t)std::filesystem::file_size(path, error);
+	if (error) return false;
+	modified = (int64_t)std::filesystem::last_write_time(path, error).time_since_epoch().count();
+	return !error;
+}
+
+void sceneCacheOps::SceneArrays::addDependency(const std::string& path) {
+	FlatDependency dependency = {};
+	if (!fileStamp(path, dependency.size, dependency.modified)) dependency.modified = -1;
+	dependency.pathStart = (uint32_t)dependencyPaths.size();
+	dependency.pathLength = (uint32_t)path.size();
+	dependencyPaths += path;
+	dependencies.push_back(dependency);
+}
+
+static Vertex toVec3(const float v[3]) {
+	return Vertex(v[0], v[1], v[2]);
+}
+
+// Builds the mesh of a FlatObject from its indexed triangles in model space. The mesh gets its own copy of the
+// range of vertices its triangles use. With worldSpace the transformations are baked into the vertices, leaving the
+// mesh with an identity transform.
+static Mesh* buildMesh(uint32_t material, const Vertex* vertices, const uint32_t* indices, uint32_t triangleCount, const glm::mat4& matMultTrans, bool worldSpace) {
+	glm::mat4 vertexTrans = worldSpace ? matMultTrans : glm::mat4(1);
+	glm::mat4 meshTrans = worldSpace ? glm::mat4(1) : matMultTrans;
+
+	Mesh* mesh = new Mesh(material);
+	mesh->setTransformations(meshTrans);
+	mesh->worldSpace = worldSpace;
+	if (triangleCount == 0) return mesh;
+
+	uint32_t firstVertex = *std::min_element(indices, indices + 3 * triangleCount);
+	uint32_t lastVertex = *std::max_element(indices, indices + 3 * triangleCount);
+	mesh->vertices.reserve(lastVertex - firstVertex + 1);
+	for (uint32_t i = firstVertex; i <= lastVertex; i++) {
+		mesh->vertices.push_back(vertexTrans * glm::vec4(vertices[i], 1.0f));
+	}
+
+	mesh->triangles.reserve(triangleCount);
+	for (uint32_t i = 0; i < triangleCount; i++) {
+		mesh->triangles.push_back(Triangle(material, mesh, indices[3 * i] - firstVertex, indices[3 * i + 1] - firstVertex, indices[3 * i + 2] - firstVertex));
+	}
+	return mesh;
+}
+
+void sceneCacheOps::buildScene(const SceneView& view, Scene& scene) {
+	scene.camera = view.camera;
+
+	// the view's materials are appended to the scene's table
+	uint32_t firstMaterial = (uint32_t)scene.materials.size();
+	scene.materials.insert(scene.materials.end(), view.materials, view.materials + view.materialCount);
+
+	// shared meshes stay in their own space, which the instances placing them transform rays into, so nothing is
+	// left to transform per triangle. Their triangles take the material of whichever instance is hit.
+	uint32_t firstMesh = (uint32_t)scene.meshes.size();
+	for (uint32_t i = 0; i < view.meshCount; i++) {
+		const FlatMesh& mesh = view.meshes[i];
+		scene.meshes.push_back(buildMesh(firstMaterial, view.vertices, view.indices + mesh.firstIndex, mesh.triangleCount, glm::mat4(1), true));
+	}
+
+	// a spinning mesh keeps its vertices in model space, so moving it only changes its transformations
+	std::vector<bool> spinning(view.objectCount, false);
+	for (uint32_t i = 0; i < view.spinCount; i++) spinning[view.spins[i].object] = true;
+
+	uint32_t firstObject = (uint32_t)scene.objects.size();
+	for (uint32_t i = 0; i < view.objectCount; i++) {
+		const FlatObject& object = view.objects[i];
+		uint32_t m = firstMaterial + object.material;
+		glm::mat4 matMultTrans = object.transform == NO_TRANSFORM ? glm::mat4(1) : view.transforms[object.transform];
+
+		switch ((ObjectType)object.type) {
+		case ObjectType::SPHERE:
+			scene.objects.push_back(new Sphere(m, object.radius, matMultTrans));
+			break;
+		case ObjectType::CYLINDER:
+			scene.objects.push_back(new Cylinder(m, object.radius, object.height, matMultTrans));
+			break;
+		case ObjectType::PLANE:
+			scene.objects.push_back(new Plane(m, toVec3(object.position), toVec3(object.normal)));
+			break;
+		case ObjectType::MESH:
+			scene.objects.push_back(buildMesh(m, view.vertices, view.indices + object.firstIndex, object.triangleCount, matMultTrans, Globals::WORLD_SPACE_TRIANGLES && !spinning[i]));
+			break;
+		case ObjectType::INSTANCE:
+			scene.objects.push_back(new Instance(m, scene.meshes[firstMesh + object.mesh], matMultTrans));
+			break;
+		case ObjectType::TRIANGLE:
+			break;
+		}
+	}
+
+	for (uint32_t i = 0; i < view.spinCount; i++) {
+		const FlatSpin& spin = view.spins[i];
+		const FlatObject& object = view.objects[spin.object];
+		scene.spins.push_back(Spin(scene.objects[firstObject + spin.object], view.transforms[object.transform], toVec3(spin.axis), toVec3(spin.center), spin.degrees));
+	}
+
+	for (uint32_t i = 0; i < view.lightCount; i++) {
+		const FlatLight& light = view.lights[i];
+		RGB colour = toVec3(light.colour);
+		switch ((LightType)light.type) {
+		case LightType::AMBIENT: scene.lights.push_back(new AmbientLight(colour)); break;
+		case LightType::DIRECTIONAL: scene.lights.push_back(new DirectionalLight(colour, toVec3(light.direction))); break;
+		case LightType::POINT: scene.lights.push_back(new PointLight(colour, toVec3(light.position))); break;
+		case LightType::SPOT: scene.lights.push_back(new SpotLight(colour, toVec3(light.position), toVec3(light.direction), light.cutoff)); break;
+		}
+	}
+}
+
+uint64_t sceneCacheOps::hashBytes(const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+bool sceneCacheOps::writeCache(const std::string& path, uint64_t sourceHash, const SceneView& view) {
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.headerSize = sizeof(CacheHeader);
+	header.sourceHash = sourceHash;
+	header.cameraField = view.camera.field;
+	header.background[0] = view.camera.background.r;
+	header.background[1] = view.camera.background.g;
+	header.background[2] = view.camera.background.b;
+
+	struct Block {
+		CacheArray* array;
+		const void* data;
+		uint32_t count;
+		uint32_t elementSize;
+	};
+	Block blocks[] = {
+		{ &header.materials, view.materials, view.materialCount, sizeof(Material) },
+		{ &header.transforms, view.transforms, view.transformCount, sizeof(glm::mat4) },
+		{ &header.objects, view.objects, view.objectCount, sizeof(FlatObject) },
+		{ &header.vertices, view.vertices, view.vertexCount, sizeof(Vertex) },
+		{ &header.indices, view.indices, view.indexCount, sizeof(uint32_t) },
+		{ &header.meshes, view.meshes, view.meshCount, sizeof(FlatMesh) },
+		{ &header.lights, view.lights, view.lightCount, sizeof(FlatLight) },
+		{ &header.spins, view.spins, view.spinCount, sizeof(FlatSpin) },
+		{ &header.dependencies, view.dependencies, view.dependencyCount, sizeof(FlatDependency) },
+		{ &header.dependencyPaths, view.dependencyPaths, view.dependencyPathLength, sizeof(char) },
+	};
+
+	uint64_t offset = sizeof(CacheHeader);
+	for (Block& block : blocks) {
+		offset = (offset + ARRAY_ALIGNMENT - 1) / ARRAY_ALIGNMENT * ARRAY_ALIGNMENT;
+		*block.array = { offset, block.count, block.elementSize };
+		offset += (uint64_t)block.count * block.elementSize;
+	}
+
+	// written under another name first, so a crash never leaves a half written cache behind under the real one
+	std::string partialPath = path + ".partial";
+	{
+		std::ofstream out(partialPath, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) return false;
+
+		out.write((const char*)&header, sizeof(header));
+		const char padding[ARRAY_ALIGNMENT] = {};
+		for (const Block& block : blocks) {
+			out.write(padding, block.array->offset - (uint64_t)out.tellp());
+			out.write((const char*)block.data, (std::streamsize)block.count * block.elementSize);
+		}
+		if (!out.good()) {
+			out.close();
+			std::remove(partialPath.c_str());
+			return false;
+		}
+	}
+
+	std::remove(path.c_str());
+	return std::rename(partialPath.c_str(), path.c_str()) == 0;
+}
+
+bool sceneCacheOps::MappedCache::open(const std::string& path, uint64_t sourceHash) {
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= (LONGLONG)sizeof(CacheHeader)) {
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	if (mapping != NULL) {
+		address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		length = (size_t)fileSize.QuadPart;
+		// the view keeps the file mapped on its own
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+#else
+	int descriptor = ::open(path.c_str(), O_RDONLY);
+	if (descriptor < 0) return false;
+	struct stat status;
+	if (fstat(descriptor, &status) == 0 && status.st_size >= (off_t)sizeof(CacheHeader)) {
+		void* mapped = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		if (mapped != MAP_FAILED) {
+			address = mapped;
+			length = (size_t)status.st_size;
+		}
+	}
+	::close(descriptor);
+#endif
+	if (address == nullptr) {
+		length = 0;
+		return false;
+	}
+
+	const unsigned char* bytes = (const unsigned char*)address;
+	const CacheHeader& header = *(const CacheHeader*)bytes;
+	bool valid = memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 && header.version == CACHE_VERSION
+		&& header.headerSize == sizeof(CacheHeader) && header.sourceHash == sourceHash;
+
+	auto mapArray = [&](const CacheArray& array, uint32_t elementSize, uint32_t& count) -> const void* {
+		if (array.elementSize != elementSize || array.offset % ARRAY_ALIGNMENT != 0 || array.offset > length
+			|| (uint64_t)array.count * elementSize > length - array.offset) {
+			valid = false;
+			return nullptr;
+		}
+		count = array.count;
+		return bytes + array.offset;
+	};
+
+	if (valid) {
+		sceneView.camera = Camera(header.cameraField, RGB(header.background[0], header.background[1], header.background[2]));
+		sceneView.materials = (const Material*)mapArray(header.materials, sizeof(Material), sceneView.materialCount);
+		sceneView.transforms = (const glm::mat4*)mapArray(header.transforms, sizeof(glm::mat4), sceneView.transformCount);
+		sceneView.objects = (const FlatObject*)mapArray(header.objects, sizeof(FlatObject), sceneView.objectCount);
+		sceneView.vertices = (const Vertex*)mapArray(header.vertices, sizeof(Vertex), sceneView.vertexCount);
+		sceneView.indices = (const uint32_t*)mapArray(header.indices, sizeof(uint32_t), sceneView.indexCount);
+		sceneView.meshes = (const FlatMesh*)mapArray(header.meshes, sizeof(FlatMesh), sceneView.meshCount);
+		sceneView.lights = (const FlatLight*)mapArray(header.lights, sizeof(FlatLight), sceneView.lightCount);
+		sceneView.spins = (const FlatSpin*)mapArray(header.spins, sizeof(FlatSpin), sceneView.spinCount);
+		sceneView.dependencies = (const FlatDependency*)mapArray(header.dependencies, sizeof(FlatDependency), sceneView.dependencyCount);
+		sceneView.dependencyPaths = (const char*)mapArray(header.dependencyPaths, sizeof(char), sceneView.dependencyPathLength);
+	}
+
+	// indices are checked once here, so buildScene can trust them
+	for (uint32_t i = 0; valid && i < sceneView.objectCount; i++) {
+		const FlatObject& object = sceneView.objects[i];
+		valid = object.type <= (uint32_t)ObjectType::INSTANCE && object.type != (uint32_t)ObjectType::TRIANGLE && object.material < sceneView.materialCount
+			&& (object.transform == NO_TRANSFORM || object.transform < sceneView.transformCount)
+			&& (object.type != (uint32_t)ObjectType::MESH || (uint64_t)object.firstIndex + 3ull * object.triangleCount <= sceneView.indexCount)
+			&& (object.type != (uint32_t)ObjectType::INSTANCE || object.mesh < sceneView.meshCount);
+	}
+	for (uint32_t i = 0; valid && i < sceneView.meshCount; i++) {
+		const FlatMesh& mesh = sceneView.meshes[i];
+		valid = (uint64_t)mesh.firstIndex + 3ull * mesh.triangleCount <= sceneView.indexCount;
+	}
+	for (uint32_t i = 0; valid && i < sceneView.indexCount; i++) {
+		valid = sceneView.indices[i] < sceneView.vertexCount;
+	}
+	for (uint32_t i = 0; valid && i < sceneView.lightCount; i++) {
+		valid = sceneView.lights[i].type <= (uint32_t)LightType::SPOT;
+	}
+	for (uint32_t i = 0; valid && i < sceneView.spinCount; i++) {
+		uint32_t object = sceneView.spins[i].object;
+		valid = object < sceneView.objectCount && sceneView.objects[object].transform != NO_TRANSFORM;
+	}
+
+	// a model changed since the cache was written makes it stale just like a change to the JSON
+	for (uint32_t i = 0; valid && i < sceneView.dependencyCount; i++) {
+		const FlatDependency& dependency = sceneView.dependencies[i];
+		uint64_t size;
+		int64_t modified;
+		valid = (uint64_t)dependency.pathStart + dependency.pathLength <= sceneView.dependencyPathLength
+			&& fileStamp(std::string(sceneView.dependencyPaths + dependency.pathStart, dependency.pathLength), size, modified)
+			&& size == dependency.size && modified == dependency.modified;
+	}
+
+	if (!valid) close();
+	return valid;
+}
+
+void sceneCacheOps::MappedCache::close() {
+	if (address != nullptr) {
+#ifdef _WIN32
+		UnmapViewOfFile(address);
+#else
+		munmap(address, length);
+#endif
+	}
+	address = nullptr;
+	length = 0;
+	sceneView = SceneView();
+}
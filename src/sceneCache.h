@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "schema.h"
+
+/// <summary>
+/// Scenes as flat arrays of materials, transforms, objects, mesh vertices, lights and spins, the form json_to_arrays reads
+/// them into and buildScene turns into a Scene. The same arrays are cached in a binary file next to the scene's JSON,
+/// tagged with a hash of the JSON text, so later loads map the file into memory and build the scene straight from it
+/// without parsing anything. Files the scene refers to, such as OBJ models, are recorded with their size and
+/// modification time, and a change to any of them also makes the cache stale. The file holds native floats and
+/// integers and is not meant to move between machines.
+/// </summary>
+namespace sceneCacheOps {
+	static const uint32_t NO_TRANSFORM = 0xffffffffu;
+
+	// One object of the scene. Spheres and cylinders use radius, height and their transform, planes position and
+	// normal, meshes their transform and triangleCount triangles of 3 vertex indices each starting at firstIndex,
+	// instances their transform and the index of the shared mesh they place.
+	struct FlatObject {
+		uint32_t type;          // an ObjectType
+		uint32_t material;
+		uint32_t transform;     // index in the transforms, NO_TRANSFORM for planes
+		uint32_t firstIndex;
+		uint32_t triangleCount;
+		uint32_t mesh;          // index in the meshes
+		float radius;
+		float height;
+		float position[3];
+		float normal[3];
+	};
+
+	// A mesh shared by instances: triangleCount triangles of 3 vertex indices each starting at firstIndex
+	struct FlatMesh {
+		uint32_t firstIndex;
+		uint32_t triangleCount;
+	};
+
+	// An object turning every frame, see Spin
+	struct FlatSpin {
+		uint32_t object;        // index in the objects
+		float axis[3];
+		float center[3];
+		float degrees;
+	};
+
+	struct FlatLight {
+		uint32_t type;          // a LightType
+		float colour[3];
+		float position[3];
+		float direction[3];
+		float cutoff;
+	};
+
+	// A file the scene was read from besides its JSON
+	struct FlatDependency {
+		uint64_t size;
+		int64_t modified;       // std::filesystem::last_write_time, in the clock's ticks
+		uint32_t pathStart;     // the path's characters in dependencyPaths
+		uint32_t pathLength;
+	};
+
+	// The arrays of a scene, owned by a SceneArrays or pointing into a mapped cache file
+	struct SceneView {
+		Camera camera;
+		const Material* materials = nullptr;
+		uint32_t materialCount = 0;
+		const glm::mat4* transforms = nullptr;
+		uint32_t transformCount = 0;
+		const FlatObject* objects = nullptr;
+		uint32_t objectCount = 0;
+		const Vertex* vertices = nullptr;
+		uint32_t vertexCount = 0;
+		const uint32_t* indices = nullptr;
+		uint32_t indexCount = 0;
+		const FlatMesh* meshes = nullptr;
+		uint32_t meshCount = 0;
+		const FlatLight* lights = nullptr;
+		uint32_t lightCount = 0;
+		const FlatSpin* spins = nullptr;
+		uint32_t spinCount = 0;
+		const FlatDependency* dependencies = nullptr;
+		uint32_t dependencyCount = 0;
+		const char* dependencyPaths = nullptr;
+		uint32_t dependencyPathLength = 0;
+	};
+
+	struct SceneArrays {
+		Camera camera;
+		std::vector<Material> materials;
+		std::vector<glm::mat4> transforms;
+		std::vector<FlatObject> objects;
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+		std::vector<FlatMesh> meshes;
+		std::vector<FlatLight> lights;
+		std::vector<FlatSpin> spins;
+		std::vector<FlatDependency> dependencies;
+		std::string dependencyPaths;
+
+		SceneView view() const;
+
+		/// <summary>
+		/// Records the current size and modification time of a file the scene is read from
+		/// </summary>
+		void addDependency(const std::string& path);
+	};
+
+	/// <summary>
+	/// Creates the objects, shared meshes, lights and spins of the view and appends them to the scene, baking mesh
+	/// transforms into the vertices when Globals::WORLD_SPACE_TRIANGLES is on, except for meshes that spin
+	/// </summary>
+	void buildScene(const SceneView& view, Scene& scene);
+
+	/// <summary>
+	/// 64 bit FNV-1a hash of the bytes
+	/// </summary>
+	uint64_t hashBytes(const void* data, size_t size);
+
+	/// <summary>
+	/// Writes the arrays to a cache file, tagged with the hash of the scene source they were read from
+	/// </summary>
+	/// <returns>false if the file could not be written</returns>
+	bool writeCache(const std::string& path, uint64_t sourceHash, const SceneView& view);
+
+	/// <summary>
+	/// A cache file mapped read only into memory. The view points into the mapping and is valid until the cache is
+	/// closed or destroyed.
+	/// </summary>
+	class MappedCache {
+	public:
+		MappedCache() = default;
+		MappedCache(const MappedCache&) = delete;
+		MappedCache& operator=(const MappedCache&) = delete;
+		~MappedCache() { close(); }
+
+		/// <summary>
+		/// Maps the cache file at path
+		/// </summary>
+		/// <returns>false if there is no such file, or it is from another version, another source or is damaged</returns>
+		bool open(const std::string& path, uint64_t sourceHash);
+		void close();
+		const SceneView& view() const { return sceneView; }
+
+	private:
+		void* address = nullptr;
+		size_t length = 0;
+		SceneView sceneView;
+	};
+}
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
@@ -45,99 +46,153 @@ struct Material {
       reflective(_reflective), transmissive(_transmissive), refraction(_refraction) {}
 };
 
+// Tags used to dispatch on the kind of object or light without comparing strings
+enum class ObjectType { SPHERE, CYLINDER, PLANE, TRIANGLE, MESH, INSTANCE };
+enum class LightType { AMBIENT, DIRECTIONAL, POINT, SPOT };
+
+inline const char* toString(ObjectType type) {
+  switch (type) {
+    case ObjectType::SPHERE: return "sphere";
+    case ObjectType::CYLINDER: return "cylinder";
+    case ObjectType::PLANE: return "plane";
+    case ObjectType::TRIANGLE: return "triangle";
+    case ObjectType::MESH: return "mesh";
+    case ObjectType::INSTANCE: return "instance";
+  }
+  return "unknown";
+}
+
+inline const char* toString(LightType type) {
+  switch (type) {
+    case LightType::AMBIENT: return "ambient";
+    case LightType::DIRECTIONAL: return "directional";
+    case LightType::POINT: return "point";
+    case LightType::SPOT: return "spot";
+  }
+  return "unknown";
+}
+
+// Materials are shared through Scene::materials, so an object only keeps the index of its own
 struct Object {
-  std::string type;
-  Material material;
-  Vertex transformPos;
+  ObjectType type;
+  uint32_t material;
   
-  Object(std::string _type, Material _material) :
+  Object(ObjectType _type, uint32_t _material) :
     type(_type), material(_material) {}
 };
 
-struct Cylinder : public Object {
+// Model to world transform together with its inverse and normal matrix, computed once at load
+// so the intersection tests never invert a matrix per ray
+struct Transform {
+  glm::mat4 transformations;
+  glm::mat4 inverseTransformations;
+  glm::mat3 normalTransformations;
+
+  Transform() : transformations(1), inverseTransformations(1), normalTransformations(1) {}
+  Transform(const glm::mat4& _transformations) { setTransformations(_transformations); }
+
+  void setTransformations(const glm::mat4& _transformations) {
+    transformations = _transformations;
+    inverseTransformations = glm::inverse(_transformations);
+    normalTransformations = glm::transpose(glm::mat3(inverseTransformations));
+  }
+};
+
+struct Cylinder : public Object, public Transform {
     float radius;
     float height;
-    glm::mat4 transformations;
 
-    Cylinder(Material _material, float _radius, float _height, glm::mat4 _transformations) :
-        Object("cylinder", _material), radius(_radius), height(_height), transformations(_transformations) {}
+    Cylinder(uint32_t _material, float _radius, float _height, glm::mat4 _transformations) :
+        Object(ObjectType::CYLINDER, _material), Transform(_transformations), radius(_radius), height(_height) {}
 };
 
-struct Sphere : public Object {
+struct Sphere : public Object, public Transform {
   float radius;
-  glm::mat4 transformations;
 
-  Sphere(Material _material, float _radius, glm::mat4 _transformations) :
-    Object("sphere", _material), radius(_radius), transformations(_transformations) {}
+  Sphere(uint32_t _material, float _radius, glm::mat4 _transformations) :
+    Object(ObjectType::SPHERE, _material), Transform(_transformations), radius(_radius) {}
 };
 
 struct Plane : public Object {
   Vertex position;
   Vector normal;
   
-  Plane(Material _material, Vertex _position, Vector _normal) :
-    Object("plane", _material), position(_position), normal(_normal) {}
+  Plane(uint32_t _material, Vertex _position, Vector _normal) :
+    Object(ObjectType::PLANE, _material), position(_position), normal(_normal) {}
 };
 
 struct Mesh;
 
+// A triangle of a mesh, kept to what the BVH and the intersection tests need: the indices of its corners in the
+// mesh's shared vertex buffer. Edges and normal are worked out from the vertices when the triangle is tested.
 struct Triangle : public Object{
-  Vertex vertices[3];
+  Mesh* parent_mesh;
+  uint32_t indices[3];
 
-  //precomputed values for faster barycenteric coord calculations
-  Vector e1;
-  Vector e2;
-  float d00;
-  float d01;
-  float d11;
-  float denom;
+  Triangle(uint32_t _material, Mesh* _parent_mesh, uint32_t i0, uint32_t i1, uint32_t i2) :
+      Object(ObjectType::TRIANGLE, _material), parent_mesh(_parent_mesh), indices{ i0, i1, i2 } {}
 
-  Mesh* parent_mesh;
-  Triangle(Material _material, Vertex _vertices[3], Mesh* _parent_mesh,
-      Vector _e1, Vector _e2, float _d00, float _d01, float _d11 ,float _denom) :
-      Object("triangle", _material), parent_mesh(_parent_mesh),
-      e1(_e1),e2(_e2), d00(_d00), d01(_d01), d11(_d01),denom(_denom){
-      vertices[0] = _vertices[0];
-      vertices[1] = _vertices[1];
-      vertices[2] = _vertices[2];
-  }
+  inline const Vertex& vertex(int corner) const;
+  // edges from the first vertex, as the Moller-Trumbore test uses them
+  Vector edge1() const { return vertex(1) - vertex(0); }
+  Vector edge2() const { return vertex(2) - vertex(0); }
+  // geometric normal in the space of the vertices
+  Vector normal() const { return -glm::normalize(glm::cross((vertex(2) - vertex(1)), (vertex(1) - vertex(0)))); }
 };
 
-struct Mesh : public Object {
+struct Mesh : public Object, public Transform {
+  // vertices shared by the triangles, which index into them
+  std::vector<Vertex> vertices;
   std::vector<Triangle> triangles;
-  glm::mat4 transformations;
+  // true when the vertices were baked into world space at load, so triangle tests skip the transform
+  bool worldSpace = false;
+
+  Mesh(uint32_t _material): Object(ObjectType::MESH, _material) {};
+};
+
+inline const Vertex& Triangle::vertex(int corner) const {
+  return parent_mesh->vertices[indices[corner]];
+}
 
-  Mesh(Material _material): Object("mesh",_material) {};
-  Mesh(Material _material, std::vector<Triangle> _triangles, glm::mat4 _transformations) :
-    Object("mesh", _material), triangles(_triangles), transformations(_transformations) {}
+class BVH;
+
+// A placement of a mesh shared by many instances. Rays are taken into the mesh's space through the inverse
+// transformations and traced against the BVH built once over the mesh's triangles.
+struct Instance : public Object, public Transform {
+  Mesh* mesh;
+  // owned by the scene's BVH, which sets it when it is built
+  BVH* meshBVH = nullptr;
+
+  Instance(uint32_t _material, Mesh* _mesh, glm::mat4 _transformations) :
+    Object(ObjectType::INSTANCE, _material), Transform(_transformations), mesh(_mesh) {}
 };
 
 struct Light {
-  std::string type;
+  LightType type;
   // for ambient lights, color is ia
   // for all other kinds of lights, color is both id and is
   // you could separate out those two if necessary
   RGB color;
   
-  Light(std::string _type, RGB _color) : type(_type), color(_color) {}
+  Light(LightType _type, RGB _color) : type(_type), color(_color) {}
 };
 
 struct AmbientLight : public Light {
-  AmbientLight(RGB _color) : Light( "ambient", _color) {}
+  AmbientLight(RGB _color) : Light(LightType::AMBIENT, _color) {}
 };
 
 struct DirectionalLight : public Light {
   Vector direction;
   
   DirectionalLight(RGB _color, Vector _direction) :
-    Light( "directional", _color), direction(_direction) {}
+    Light(LightType::DIRECTIONAL, _color), direction(_direction) {}
 };
 
 struct PointLight : public Light {
   Vertex position;
 
   PointLight(RGB _color, Vertex _position) :
-    Light( "point", _color), position(_position) {}
+    Light(LightType::POINT, _color), position(_position) {}
 };
 
 struct SpotLight : public Light {
@@ -147,13 +202,31 @@ struct SpotLight : public Light {
   float cutoff;
 
   SpotLight(RGB _color, Vertex _position, Vector _direction, float _cutoff) :
-    Light( "spot", _color), position(_position), direction(_direction), cutoff(_cutoff) {}
+    Light(LightType::SPOT, _color), position(_position), direction(_direction), cutoff(_cutoff) {}
+};
+
+// An object turning by degrees every frame around an axis through center, for animated renders
+struct Spin {
+  Object* object;
+  // the object's transformations at frame 0
+  glm::mat4 transformations;
+  Vector axis;
+  Vertex center;
+  float degrees;
+
+  Spin(Object* _object, const glm::mat4& _transformations, Vector _axis, Vertex _center, float _degrees) :
+    object(_object), transformations(_transformations), axis(_axis), center(_center), degrees(_degrees) {}
 };
 
 struct Scene {
   Camera camera;
+  // every distinct material of the scene, indexed by Object::material
+  std::vector<Material> materials;
   std::vector<Object*> objects;
+  // meshes placed by instances, kept in their own space and not traced as objects themselves
+  std::vector<Mesh*> meshes;
   std::vector<Light*> lights;
+  std::vector<Spin> spins;
 };
 
 /*** The following is c.json hard-coded using this schema ***/
@@ -0,0 +1,93 @@
+#include "stats.h"
+
+#include <deque>
+#include <iostream>
+#include <mutex>
+
+// a deque never moves its elements, so the pointers handed to threads stay valid as more threads register
+static std::mutex registryMutex;
+static std::deque<statsOps::Counters> registry;
+
+const char* statsOps::toString(RayKind kind) {
+	switch (kind) {
+	case RayKind::PRIMARY: return "primary";
+	case RayKind::SHADOW: return "shadow";
+	case RayKind::REFLECTION: return "reflection";
+	case RayKind::REFRACTION: return "refraction";
+	default: return "unknown";
+	}
+}
+
+uint64_t statsOps::Counters::totalRays() const {
+	uint64_t total = 0;
+	for (uint64_t count : rays) total += count;
+	return total;
+}
+
+uint64_t statsOps::Counters::totalPrimitiveTests() const {
+	uint64_t total = 0;
+	for (uint64_t count : primitiveTests) total += count;
+	return total;
+}
+
+uint64_t statsOps::Counters::leafVisits() const {
+	uint64_t total = 0;
+	for (uint64_t count : leafSizes) total += count;
+	return total;
+}
+
+statsOps::Counters& statsOps::Counters::operator+=(const Counters& other) {
+	for (int kind = 0; kind < (int)RayKind::COUNT; kind++) rays[kind] += other.rays[kind];
+	nodeVisits += other.nodeVisits;
+	boxTests += other.boxTests;
+	for (int type = 0; type < OBJECT_TYPES; type++) primitiveTests[type] += other.primitiveTests[type];
+	for (int size = 0; size < LEAF_SIZE_BUCKETS; size++) leafSizes[size] += other.leafSizes[size];
+	return *this;
+}
+
+statsOps::Counters* statsOps::registerThread() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	registry.emplace_back();
+	return &registry.back();
+}
+
+void statsOps::reset() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	for (Counters& counters : registry) counters = Counters();
+}
+
+statsOps::Counters statsOps::collect() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	Counters total;
+	for (const Counters& counters : registry) total += counters;
+	return total;
+}
+
+void statsOps::printStats(const Counters& counters) {
+	uint64_t rays = counters.totalRays();
+	if (rays == 0) return;
+
+	std::cout << "Rays: " << rays;
+	for (int kind = 0; kind < (int)RayKind::COUNT; kind++) std::cout << ", " << toString((RayKind)kind) << " " << counters.rays[kind];
+	std::cout << std::endl;
+
+#if RT_ENABLE_STATS
+	std::cout << "  per ray: node visits " << (double)counters.nodeVisits / rays << ", box tests " << (double)counters.boxTests / rays
+		<< ", primitive tests " << (double)counters.totalPrimitiveTests() / rays;
+	for (int type = 0; type < OBJECT_TYPES; type++) {
+		if (counters.primitiveTests[type] > 0) std::cout << ", " << toString((ObjectType)type) << " " << (double)counters.primitiveTests[type] / rays;
+	}
+	std::cout << std::endl;
+
+	uint64_t leaves = counters.leafVisits();
+	if (leaves == 0) return;
+	std::cout << "  leaves visited: " << leaves << ", by primitive count:";
+	for (int size = 0; size < LEAF_SIZE_BUCKETS; size++) {
+		if (counters.leafSizes[size] == 0) continue;
+		std::cout << " " << size << (size == LEAF_SIZE_BUCKETS - 1 ? "+" : "") << ": " << 100.0 * counters.leafSizes[size] / leaves << "%";
+	}
+	std::cout << std::endl;
+#else
+	std::cout << "  traversal statistics are compiled out (RT_ENABLE_STATS=0)" << std::endl;
+#endif
+}
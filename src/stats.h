@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+
+#include "schema.h"
+
+// Traversal statistics: node visits, box and primitive tests and leaf sizes. Build with RT_ENABLE_STATS=0 to compile
+// them out of the traversal loops; rays are counted by kind either way, one increment per ray.
+#ifndef RT_ENABLE_STATS
+#define RT_ENABLE_STATS 1
+#endif
+
+#if RT_ENABLE_STATS
+#define RT_STATS(statement) statement
+#else
+#define RT_STATS(statement)
+#endif
+
+/// <summary>
+/// Render counters kept per thread, so counting costs a plain increment with no atomics or shared cache lines.
+/// Every thread's counters live until the process exits; collect() sums them once the workers are idle.
+/// </summary>
+namespace statsOps {
+	enum class RayKind { PRIMARY, SHADOW, REFLECTION, REFRACTION, COUNT };
+
+	const char* toString(RayKind kind);
+
+	static const int OBJECT_TYPES = (int)ObjectType::INSTANCE + 1;
+	// leaves of 0 to 15 primitives, then every larger leaf in the last bucket
+	static const int LEAF_SIZE_BUCKETS = 17;
+
+	struct Counters {
+		uint64_t rays[(int)RayKind::COUNT] = {};
+		// nodes taken off a traversal stack, a ray packet counting one per node for all its rays
+		uint64_t nodeVisits = 0;
+		// ray-box slab tests: a wide node tests the boxes of all its children, a packet one box per ray
+		uint64_t boxTests = 0;
+		uint64_t primitiveTests[OBJECT_TYPES] = {};
+		// leaves whose box was hit, by primitive count
+		uint64_t leafSizes[LEAF_SIZE_BUCKETS] = {};
+
+		uint64_t totalRays() const;
+		uint64_t totalPrimitiveTests() const;
+		uint64_t leafVisits() const;
+		Counters& operator+=(const Counters& other);
+	};
+
+	/// <summary>
+	/// Creates the counters of the calling thread. Use local() instead.
+	/// </summary>
+	Counters* registerThread();
+
+	/// <summary>
+	/// The calling thread's counters. Traversal loops fetch them once per query rather than once per count.
+	/// </summary>
+	inline Counters& local() {
+		static thread_local Counters* counters = registerThread();
+		return *counters;
+	}
+
+	inline void countRay(RayKind kind, uint64_t count = 1) {
+		local().rays[(int)kind] += count;
+	}
+
+	inline void countLeaf(Counters& counters, int primitiveCount) {
+		counters.leafSizes[primitiveCount < LEAF_SIZE_BUCKETS - 1 ? primitiveCount : LEAF_SIZE_BUCKETS - 1]++;
+	}
+
+	inline void countPrimitiveTest(Counters& counters, ObjectType type) {
+		counters.primitiveTests[(int)type]++;
+	}
+
+	/// <summary>
+	/// Zeroes the counters of every thread. Must not run while a frame is traced.
+	/// </summary>
+	void reset();
+
+	/// <summary>
+	/// Sum of the counters of every thread since the last reset. Must not run while a frame is traced.
+	/// </summary>
+	Counters collect();
+
+	/// <summary>
+	/// Prints the rays by kind and, unless RT_ENABLE_STATS is 0, the traversal work per ray and the sizes of the
+	/// leaves visited. Prints nothing when no ray was counted.
+	/// </summary>
+	void printStats(const Counters& counters);
+}
@@ -0,0 +1,170 @@
+#include "tileScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+// Interleaves the bits of x and y, so tiles that are close on screen are close in the ordering.
+// https://fgiesen.wordpress.com/2009/12/13/decoding-morton-codes/
+static uint32_t mortonCode2D(uint32_t x, uint32_t y) {
+	auto part1By1 = [](uint32_t v) {
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+	return (part1By1(y) << 1) | part1By1(x);
+}
+
+TileScheduler::TileScheduler(int width, int height, int tileSize)
+	: width(width), height(height), tileSize(std::max(1, tileSize))
+{
+	tilesX = (width + this->tileSize - 1) / this->tileSize;
+	tilesY = (height + this->tileSize - 1) / this->tileSize;
+
+	std::vector<std::pair<uint32_t, Tile>> ordered;
+	for (int ty = 0; ty < tilesY; ty++) {
+		for (int tx = 0; tx < tilesX; tx++) {
+			Tile tile;
+			tile.x0 = tx * this->tileSize;
+			tile.y0 = ty * this->tileSize;
+			tile.x1 = std::min(tile.x0 + this->tileSize, width);
+			tile.y1 = std::min(tile.y0 + this->tileSize, height);
+			ordered.push_back({ mortonCode2D(tx, ty), tile });
+		}
+	}
+	std::sort(ordered.begin(), ordered.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	for (auto& entry : ordered) tiles.push_back(entry.second);
+
+	finishedPerTileRow.reset(new std::atomic<int>[tilesY]);
+	for (int i = 0; i < tilesY; i++) finishedPerTileRow[i] = 0;
+}
+
+void TileScheduler::start(BS::thread_pool& pool, std::function<void(const Tile&)> tileFunction)
+{
+	this->tileFunction = tileFunction;
+
+	// seed each worker with a contiguous run of the curve
+	int workerCount = std::max(1, (int)pool.get_thread_count());
+	queues.clear();
+	for (int w = 0; w < workerCount; w++) queues.push_back(std::make_unique<WorkQueue>());
+	for (int i = 0; i < (int)tiles.size(); i++) {
+		queues[(size_t)i * workerCount / tiles.size()]->tiles.push_back(i);
+	}
+
+	workers.clear();
+	for (int w = 0; w < workerCount; w++) {
+		workers.push_back(pool.submit([this, w] { workerLoop(w); }));
+	}
+}
+
+void TileScheduler::wait()
+{
+	for (auto& worker : workers) worker.get();
+	workers.clear();
+}
+
+bool TileScheduler::isRowFinished(int y) const
+{
+	return finishedPerTileRow[y / tileSize] == tilesX;
+}
+
+bool TileScheduler::isFinished() const
+{
+	for (int i = 0; i < tilesY; i++) {
+		if (finishedPerTileRow[i] != tilesX) return false;
+	}
+	return true;
+}
+
+void TileScheduler::addTimings(const TileScheduler& other)
+{
+	// both passes order their tiles the same way, along the Morton curve
+	for (size_t i = 0; i < tiles.size() && i < other.tiles.size(); i++) {
+		tiles[i].milliseconds += other.tiles[i].milliseconds;
+	}
+}
+
+bool TileScheduler::popTile(int worker, int& tileIndex)
+{
+	WorkQueue& queue = *queues[worker];
+	std::lock_guard<std::mutex> guard(queue.lock);
+	if (queue.tiles.empty()) return false;
+	tileIndex = queue.tiles.front();
+	queue.tiles.pop_front();
+	return true;
+}
+
+bool TileScheduler::stealTile(int worker, int& tileIndex)
+{
+	// steal from the far end of the victim's run, the part it would have reached last
+	for (size_t i = 1; i < queues.size(); i++) {
+		WorkQueue& victim = *queues[(worker + i) % queues.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tiles.empty()) {
+			tileIndex = victim.tiles.back();
+			victim.tiles.pop_back();
+			queues[worker]->steals++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void TileScheduler::workerLoop(int worker)
+{
+	int tileIndex;
+	while (popTile(worker, tileIndex) || stealTile(worker, tileIndex)) {
+		Tile& tile = tiles[tileIndex];
+		auto t0 = std::chrono::high_resolution_clock::now();
+		tileFunction(tile);
+		auto t1 = std::chrono::high_resolution_clock::now();
+
+		tile.milliseconds = std::chrono::duration<double, std::milli>(t1 - t0).count();
+		tile.worker = worker;
+		finishedPerTileRow[tile.y0 / tileSize]++;
+	}
+}
+
+void TileScheduler::printTimings() const
+{
+	if (tiles.empty()) return;
+
+	double total = 0;
+	const Tile* slowest = &tiles[0];
+	const Tile* fastest = &tiles[0];
+	std::vector<double> busyPerWorker(queues.size(), 0);
+	for (auto& tile : tiles) {
+		total += tile.milliseconds;
+		if (tile.milliseconds > slowest->milliseconds) slowest = &tile;
+		if (tile.milliseconds < fastest->milliseconds) fastest = &tile;
+		if (tile.worker >= 0) busyPerWorker[tile.worker] += tile.milliseconds;
+	}
+
+	std::cout << "Tiles: " << tiles.size() << " of " << tileSize << "x" << tileSize
+		<< ", min " << fastest->milliseconds << " ms, mean " << total / tiles.size()
+		<< " ms, max " << slowest->milliseconds << " ms (tile at " << slowest->x0 << "," << slowest->y0 << ")" << std::endl;
+
+	int steals = 0;
+	for (auto& queue : queues) steals += queue->steals;
+	auto busiest = std::max_element(busyPerWorker.begin(), busyPerWorker.end());
+	auto idlest = std::min_element(busyPerWorker.begin(), busyPerWorker.end());
+	std::cout << "Workers: " << queues.size() << ", busy time min " << *idlest << " ms / max " << *busiest
+		<< " ms, tiles stolen: " << steals << std::endl;
+}
+
+bool TileScheduler::writeTimingsCSV(const std::string& path) const
+{
+	std::ofstream out(path);
+	if (!out.is_open()) return false;
+
+	out << "x0,y0,x1,y1,worker,milliseconds\n";
+	for (auto& tile : tiles) {
+		out << tile.x0 << "," << tile.y0 << "," << tile.x1 << "," << tile.y1 << "," << tile.worker << "," << tile.milliseconds << "\n";
+	}
+	return out.good();
+}
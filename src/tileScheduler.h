@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BS_thread_pool.hpp"
+
+struct Tile {
+	int x0, y0; // inclusive
+	int x1, y1; // exclusive
+	double milliseconds = 0;
+	int worker = -1;
+};
+
+/// <summary>
+/// Splits an image into square tiles ordered along a Morton curve and traces them on the thread pool.
+/// Every worker owns a deque seeded with a contiguous run of the curve, pops from its front and,
+/// once empty, steals from the back of another worker's deque, so all cores stay busy until the frame ends.
+/// </summary>
+class TileScheduler {
+public:
+	TileScheduler(int width, int height, int tileSize);
+
+	/// <summary>
+	/// Starts tracing every tile on the pool and returns immediately. tileFunction is called once per tile from a worker thread.
+	/// </summary>
+	void start(BS::thread_pool& pool, std::function<void(const Tile&)> tileFunction);
+	void wait();
+	void run(BS::thread_pool& pool, std::function<void(const Tile&)> tileFunction) { start(pool, tileFunction); wait(); }
+
+	/// <summary>
+	/// True once every tile overlapping scanline y has been traced.
+	/// </summary>
+	bool isRowFinished(int y) const;
+
+	/// <summary>
+	/// True once every tile has been traced.
+	/// </summary>
+	bool isFinished() const;
+
+	/// <summary>
+	/// Adds the tile timings of another pass over the same image and tile size, e.g. a refinement pass, to this one's.
+	/// </summary>
+	void addTimings(const TileScheduler& other);
+
+	const std::vector<Tile>& getTiles() const { return tiles; }
+	int getTileSize() const { return tileSize; }
+
+	void printTimings() const;
+	bool writeTimingsCSV(const std::string& path) const;
+
+private:
+	struct WorkQueue {
+		std::mutex lock;
+		std::deque<int> tiles;
+		int steals = 0;
+	};
+
+	int width, height, tileSize;
+	int tilesX, tilesY;
+	std::vector<Tile> tiles;
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::unique_ptr<std::atomic<int>[]> finishedPerTileRow;
+	std::vector<std::future<void>> workers;
+	std::function<void(const Tile&)> tileFunction;
+
+	bool popTile(int worker, int& tileIndex);
+	bool stealTile(int worker, int& tileIndex);
+	void workerLoop(int worker);
+};
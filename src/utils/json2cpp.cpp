@@ -33,7 +33,7 @@ void scene_to_cpp(Scene &s) {
   for (int i = 0; i < s.objects.size(); i++) {
     Object *o = s.objects[i];
     
-    if (o->type == "sphere") {
+    if (o->type == ObjectType::SPHERE) {
       Sphere *s = (Sphere *)(o);
       printf("    new Sphere( ");
       printf_material(s->material);
@@ -41,7 +41,7 @@ void scene_to_cpp(Scene &s) {
       printf_vertex(s->position);
       printf(" )");
 
-    } else if (o->type == "plane") {
+    } else if (o->type == ObjectType::PLANE) {
       Plane *p = (Plane *)(o);
       printf("    new Plane( ");
       printf_material(p->material);
@@ -51,7 +51,7 @@ void scene_to_cpp(Scene &s) {
       printf_vector(p->normal);
       printf(" )");
       
-    } else if (o->type == "mesh") {
+    } else if (o->type == ObjectType::MESH) {
       Mesh *m = (Mesh *)(o);
       printf("    new Mesh( ");
       printf_material(m->material);
@@ -88,26 +88,26 @@ void scene_to_cpp(Scene &s) {
   for (int i = 0; i < s.lights.size(); i++) {
     Light *l = s.lights[i];
     
-    if (l->type == "ambient") {
+    if (l->type == LightType::AMBIENT) {
       AmbientLight *a = (AmbientLight *)(l);
       printf("    new AmbientLight( ");
       printf_rgb(a->color);
       printf(" )");
-    } else if (l->type == "directional") {
+    } else if (l->type == LightType::DIRECTIONAL) {
       DirectionalLight *d = (DirectionalLight *)(l);
       printf("    new DirectionalLight( ");
       printf_rgb(d->color);
       printf(", ");
       printf_vector(d->direction);
       printf(" )");
-    } else if (l->type == "point") {
+    } else if (l->type == LightType::POINT) {
       PointLight *p = (PointLight *)(l);
       printf("    new PointLight( ");
       printf_rgb(p->color);
       printf(", ");
       printf_vertex(p->position);
       printf(" )");
-    } else if (l->type == "spot") {
+    } else if (l->type == LightType::SPOT) {
       SpotLight *s = (SpotLight *)(l);
       printf("    new SpotLight( ");
       printf_rgb(s->color);
@@ -0,0 +1,194 @@
+#include "wavefront.h"
+#include "BVH/BVH.h"
+#include "geometryIntersect.h"
+#include "Globals.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+static wavefrontOps::StageStats stageStats;
+
+// One ray of a stream
+struct StreamRay {
+	Vertex origin;
+	Vector direction;
+	colour3 weight;      // of the ray's colour in its parent's
+	colour3 pathWeight;  // product of the weights from the camera down to the ray
+	int parent;          // index in the previous depth's stream, -1 for camera rays
+	int sample;          // the camera sample the ray belongs to
+	uint32_t path;       // 1 for a camera ray, then 2 * the parent's path + the child's slot
+	statsOps::RayKind kind;
+};
+
+// All rays of one depth of the batch's ray trees, in the order they were queued, which keeps the children of every
+// parent in order for the resolve stage. The trace and shade stages visit them in sorted order instead.
+struct Stream {
+	std::vector<StreamRay> rays;
+	std::vector<std::tuple<float, Object*, Vector, Vertex>> hits;
+	std::vector<colour3> sums;
+	std::vector<uint64_t> order;  // sort key in the high 32 bits, ray index in the low 32
+};
+
+// Interleaves the low 10 bits of x, y and z, see mortonCode2D in tileScheduler.cpp
+static uint32_t mortonCode3D(uint32_t x, uint32_t y, uint32_t z) {
+	auto part1By2 = [](uint32_t v) {
+		v &= 0x000003ff;
+		v = (v ^ (v << 16)) & 0xff0000ff;
+		v = (v ^ (v << 8)) & 0x0300f00f;
+		v = (v ^ (v << 4)) & 0x030c30c3;
+		v = (v ^ (v << 2)) & 0x09249249;
+		return v;
+	};
+	return (part1By2(z) << 2) | (part1By2(y) << 1) | part1By2(x);
+}
+
+// Orders a stream by the octant of the ray directions, then along a Morton curve through the origins quantized to
+// 512 cells per axis over the stream's bounds, so the 3 octant bits fit above the 27 bit Morton code. Rays of the
+// same octant take the same near-first path down the BVH, and neighbouring origins start from the same nodes.
+static void sortStream(Stream& stream) {
+	Vertex lower(std::numeric_limits<float>::infinity());
+	Vertex upper(-std::numeric_limits<float>::infinity());
+	for (const StreamRay& ray : stream.rays) {
+		lower = glm::min(lower, ray.origin);
+		upper = glm::max(upper, ray.origin);
+	}
+	Vector scale = 511.0f / glm::max(upper - lower, Vector(1e-6f));
+
+	for (size_t i = 0; i < stream.rays.size(); i++) {
+		const StreamRay& ray = stream.rays[i];
+		uint32_t octant = (ray.direction.x < 0 ? 1 : 0) | (ray.direction.y < 0 ? 2 : 0) | (ray.direction.z < 0 ? 4 : 0);
+		Vector cell = (ray.origin - lower) * scale;
+		uint32_t key = (octant << 27) | mortonCode3D((uint32_t)cell.x, (uint32_t)cell.y, (uint32_t)cell.z);
+		stream.order[i] = ((uint64_t)key << 32) | i;
+	}
+	std::sort(stream.order.begin(), stream.order.end());
+}
+
+void wavefrontOps::traceBatch(const point3& e, CameraSample* samples, int count) {
+	typedef std::chrono::steady_clock Clock;
+	auto elapsed = [](Clock::time_point& since) {
+		Clock::time_point now = Clock::now();
+		uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count();
+		since = now;
+		return nanoseconds;
+	};
+	uint64_t generateTime = 0, sortTime = 0, traceTime = 0, shadeTime = 0, resolveTime = 0;
+	Clock::time_point stageStart = Clock::now();
+
+	// reused between the batches of a thread
+	static thread_local std::vector<Stream> streams;
+	if (streams.empty()) streams.resize(1);
+	for (Stream& stream : streams) stream.rays.clear();
+
+	for (int i = 0; i < count; i++) {
+		streams[0].rays.push_back({ e, samples[i].s - e, colour3(1.0f), colour3(1.0f), -1, i, 1, statsOps::RayKind::PRIMARY });
+	}
+	generateTime += elapsed(stageStart);
+
+	int depth = 0;
+	while (depth < (int)streams.size() && !streams[depth].rays.empty()) {
+		if ((int)streams.size() < depth + 2) streams.resize(depth + 2);
+		Stream& stream = streams[depth];
+		Stream& next = streams[depth + 1];
+		const size_t rayCount = stream.rays.size();
+		stageStats.rays[std::min(depth, StageStats::MAX_DEPTH - 1)] += rayCount;
+
+		stream.order.resize(rayCount);
+		if (depth > 0 && Globals::WAVEFRONT_SORT) {
+			sortStream(stream);
+		}
+		else {
+			// camera rays are already in pixel order
+			for (size_t i = 0; i < rayCount; i++) stream.order[i] = i;
+		}
+		sortTime += elapsed(stageStart);
+
+		float minT = depth == 0 ? 1 : 0.001f;
+		stream.hits.resize(rayCount);
+		for (uint64_t entry : stream.order) {
+			uint32_t i = (uint32_t)entry;
+			Ray ray(stream.rays[i].origin, stream.rays[i].direction, minT);
+			statsOps::countRay(stream.rays[i].kind);
+			stream.hits[i] = (!Globals::BVH) ? rayIntersectObjects(ray, scene.objects) : bvh->intersectBVH(ray);
+		}
+		traceTime += elapsed(stageStart);
+
+		stream.sums.assign(rayCount, background_colour);
+		for (uint64_t entry : stream.order) {
+			uint32_t i = (uint32_t)entry;
+			const StreamRay& ray = stream.rays[i];
+			if (std::get<1>(stream.hits[i]) == NULL) continue;
+
+			// camera rays draw from the pixel's own stream like trace() does, the others from a stream of their own.
+			// Their passes are even, so they never meet the odd one of the adaptive anti-aliasing pass.
+			const CameraSample& sample = samples[ray.sample];
+			samplingOps::beginPixel(sample.x, sample.y, (ray.path - 1) << 1);
+
+			HitShading shading;
+			shadeHit(ray.origin, ray.direction, stream.hits[i], ray.pathWeight, nullptr, shading);
+			stream.sums[i] = shading.colour;
+
+			for (int child = 0; child < shading.childCount; child++) {
+				if (depth + 1 > Globals::RAYTRACER_DEPTH) {
+					stream.sums[i] += background_colour * shading.childWeight[child];
+					continue;
+				}
+				next.rays.push_back({ std::get<3>(stream.hits[i]), shading.childDirection[child], shading.childWeight[child],
+					ray.pathWeight * shading.childWeight[child], (int)i, ray.sample, ray.path * 2 + child, shading.childKind[child] });
+			}
+		}
+		shadeTime += elapsed(stageStart);
+		depth++;
+	}
+
+	// every child was queued right after its sibling, so each parent adds its children in the same order as trace()
+	for (int d = depth - 1; d > 0; d--) {
+		Stream& stream = streams[d];
+		Stream& parents = streams[d - 1];
+		for (size_t i = 0; i < stream.rays.size(); i++) {
+			const StreamRay& ray = stream.rays[i];
+			colour3 colour = std::get<1>(stream.hits[i]) == NULL ? stream.sums[i] : glm::clamp(stream.sums[i], 0.0f, 1.0f);
+			parents.sums[ray.parent] += colour * ray.weight;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		CameraSample& sample = samples[i];
+		const std::tuple<float, Object*, Vector, Vertex>& hit = streams[0].hits[i];
+		sample.hit = std::get<1>(hit) != NULL;
+		sample.objectHit = std::get<1>(hit);
+		sample.normalHit = std::get<2>(hit);
+		sample.colour = sample.hit ? glm::clamp(streams[0].sums[i], 0.0f, 1.0f) : background_colour;
+	}
+	resolveTime += elapsed(stageStart);
+
+	stageStats.generateNanoseconds += generateTime;
+	stageStats.sortNanoseconds += sortTime;
+	stageStats.traceNanoseconds += traceTime;
+	stageStats.shadeNanoseconds += shadeTime;
+	stageStats.resolveNanoseconds += resolveTime;
+}
+
+void wavefrontOps::resetStats() {
+	stageStats.generateNanoseconds = 0;
+	stageStats.sortNanoseconds = 0;
+	stageStats.traceNanoseconds = 0;
+	stageStats.shadeNanoseconds = 0;
+	stageStats.resolveNanoseconds = 0;
+	for (auto& rays : stageStats.rays) rays = 0;
+}
+
+void wavefrontOps::printStats() {
+	if (stageStats.rays[0] == 0) return;
+
+	std::cout << "Wavefront (" << (Globals::WAVEFRONT_SORT ? "sorted" : "unsorted") << ") rays per depth:";
+	for (int depth = 0; depth < StageStats::MAX_DEPTH && stageStats.rays[depth] > 0; depth++) std::cout << " " << stageStats.rays[depth];
+	std::cout << std::endl;
+	std::cout << "  stage times summed over workers: generate " << stageStats.generateNanoseconds / 1e6 << " ms, sort "
+		<< stageStats.sortNanoseconds / 1e6 << " ms, trace " << stageStats.traceNanoseconds / 1e6 << " ms, shade "
+		<< stageStats.shadeNanoseconds / 1e6 << " ms, resolve " << stageStats.resolveNanoseconds / 1e6 << " ms" << std::endl;
+}
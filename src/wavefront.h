@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "raytracer.h"
+
+/// <summary>
+/// Wavefront (ray stream) evaluation of the ray trees of a batch of camera rays, instead of walking every pixel's tree
+/// depth first. All rays of one depth are traced as a stream before any of them is shaded, and shading queues the
+/// rays of the next depth. The reflection and transmission streams are sorted by direction octant and the Morton code
+/// of their origin first, so rays that visit the same BVH nodes run back to back while those nodes are in cache.
+/// The trees are resolved bottom up once no rays are left, giving the same colours as trace().
+/// Based on Laine et al., "Megakernels Considered Harmful: Wavefront Path Tracing on GPUs", 2013.
+/// </summary>
+namespace wavefrontOps {
+	/// <summary>
+	/// Time spent in each stage of the streams over a frame, summed over every worker
+	/// </summary>
+	struct StageStats {
+		static const int MAX_DEPTH = 32;
+
+		std::atomic<uint64_t> generateNanoseconds{ 0 };
+		std::atomic<uint64_t> sortNanoseconds{ 0 };
+		std::atomic<uint64_t> traceNanoseconds{ 0 };
+		std::atomic<uint64_t> shadeNanoseconds{ 0 };
+		std::atomic<uint64_t> resolveNanoseconds{ 0 };
+		std::atomic<uint64_t> rays[MAX_DEPTH] = {};
+	};
+
+	/// <summary>
+	/// Traces count camera rays from e through samples[i].s with all their reflection and transmission rays.
+	/// Soft shadows and Russian roulette draw from a sampler seeded per ray rather than per pixel, so with either
+	/// on the noise differs from trace(); the image is otherwise the same.
+	/// </summary>
+	void traceBatch(const point3& e, CameraSample* samples, int count);
+
+	/// <summary>
+	/// Clears the stage statistics. Must not run while a frame is traced.
+	/// </summary>
+	void resetStats();
+
+	/// <summary>
+	/// Prints the rays traced at every depth and the time spent in every stage. Prints nothing when no batch was traced.
+	/// </summary>
+	void printStats();
+}